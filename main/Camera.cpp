@@ -83,6 +83,13 @@ glm::mat4 Camera::translate(int32_t xrel, int32_t yrel)
     return m_view;
 }
 
+glm::mat4 Camera::lookAt(const glm::vec3& eye, const glm::vec3& origin)
+{
+    m_eye = eye;
+    m_origin = origin;
+    return updateView();
+}
+
 glm::mat4 Camera::updateView()
 {
     m_view = glm::lookAt(m_eye, m_origin, m_up);
@@ -15,6 +15,7 @@ public:
     glm::mat4 rotate(int32_t x, int32_t y, int32_t xrel, int32_t yrel, int32_t width, int32_t height);
     glm::mat4 zoom(int32_t y);
     glm::mat4 translate(int32_t xrel, int32_t yrel);
+    glm::mat4 lookAt(const glm::vec3& eye, const glm::vec3& origin);
     glm::mat4 getModelView();
     glm::mat4 getPerspective();
 
@@ -0,0 +1,460 @@
+/*
+Headless benchmark
+Drives vkRender without a window for a fixed number of frames along a camera path and writes a
+JSON report with frame time percentiles, startup time per init stage, upload throughput and peak
+memory, so builds can be compared run to run.
+
+Usage: benchmark [--frames N] [--warmup N] [--width W] [--height H] [--instances N] [--depth-prepass 0|1] [--path file] [--out file]
+       benchmark --dedup-triangles N [--out file]
+       benchmark --cull-objects N[,N...] [--out file]
+
+A path file holds one keyframe per line, "eyeX eyeY eyeZ originX originY originZ", which are
+linearly interpolated over the measured frames. Without one the camera orbits the origin.
+
+--instances renders a grid of N instances of the model instead of a single one. With GPU occlusion
+culling the report averages the culled, occluded and drawn counts per frame.
+
+--depth-prepass 1 lays down depth from a position only stream before the shaded pass.
+
+--dedup-triangles skips rendering and times vertex deduplication of a synthetic grid mesh with
+about N triangles, comparing the legacy unordered_map path against vkMeshTools.
+
+--cull-objects skips rendering and times CPU frustum culling of N random bounding spheres, brute
+force against vkCullBvh on one thread and on the worker pool, once per comma separated count.
+*/
+
+#define SDL_MAIN_HANDLED
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "glm/gtc/constants.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "Camera.h"
+#include "vkCullBvh.h"
+#include "vkMeshTools.h"
+#include "vkRender.h"
+#include "vkThreadPool.h"
+
+#include "glm/gtx/hash.hpp"
+
+#include <unordered_map>
+
+struct BenchmarkOptions
+{
+    uint32_t frames = 1000;
+    uint32_t warmup = 30;
+    uint32_t width = 1200;
+    uint32_t height = 960;
+    uint32_t instances = 1;
+    bool depthPrepass = false;
+    std::string pathFile;
+    std::string outFile = "benchmark.json";
+    uint32_t dedupTriangles = 0;
+    std::vector<uint32_t> cullObjects;
+};
+
+struct CameraKey
+{
+    glm::vec3 eye;
+    glm::vec3 origin;
+};
+
+static bool parseOptions(int argc, char** argv, BenchmarkOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if (!value) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+
+        if (strcmp(arg, "--frames") == 0) {
+            options.frames = std::max(1, atoi(value));
+        } else if (strcmp(arg, "--warmup") == 0) {
+            options.warmup = std::max(0, atoi(value));
+        } else if (strcmp(arg, "--width") == 0) {
+            options.width = std::max(1, atoi(value));
+        } else if (strcmp(arg, "--height") == 0) {
+            options.height = std::max(1, atoi(value));
+        } else if (strcmp(arg, "--instances") == 0) {
+            options.instances = std::max(1, atoi(value));
+        } else if (strcmp(arg, "--depth-prepass") == 0) {
+            options.depthPrepass = atoi(value) != 0;
+        } else if (strcmp(arg, "--path") == 0) {
+            options.pathFile = value;
+        } else if (strcmp(arg, "--out") == 0) {
+            options.outFile = value;
+        } else if (strcmp(arg, "--dedup-triangles") == 0) {
+            options.dedupTriangles = std::max(2, atoi(value));
+        } else if (strcmp(arg, "--cull-objects") == 0) {
+            std::istringstream is(value);
+            std::string count;
+            while (std::getline(is, count, ',')) {
+                options.cullObjects.push_back(std::max(1, atoi(count.c_str())));
+            }
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+        ++i;
+    }
+
+    return true;
+}
+
+static std::vector<CameraKey> loadCameraPath(const std::string& fileName)
+{
+    std::vector<CameraKey> keys;
+    std::ifstream file(fileName);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream is(line);
+        CameraKey key;
+        if (is >> key.eye.x >> key.eye.y >> key.eye.z >> key.origin.x >> key.origin.y >> key.origin.z) {
+            keys.push_back(key);
+        }
+    }
+
+    return keys;
+}
+
+static CameraKey sampleCameraPath(const std::vector<CameraKey>& keys, float t)
+{
+    if (keys.empty()) {
+        // One full orbit at the default viewing distance with a slow vertical bob
+        float angle = t * glm::two_pi<float>();
+        CameraKey key;
+        key.eye = glm::vec3(2.0f * sinf(angle), 0.5f * sinf(2.0f * angle), -2.0f * cosf(angle));
+        key.origin = glm::vec3(0.0f);
+        return key;
+    }
+    if (keys.size() == 1) {
+        return keys[0];
+    }
+
+    float pos = t * (keys.size() - 1);
+    size_t index = std::min(static_cast<size_t>(pos), keys.size() - 2);
+    float frac = pos - index;
+
+    CameraKey key;
+    key.eye = glm::mix(keys[index].eye, keys[index + 1].eye, frac);
+    key.origin = glm::mix(keys[index].origin, keys[index + 1].origin, frac);
+    return key;
+}
+
+static uint64_t peakProcessMemory()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+static bool writeReport(const std::string& fileName, const std::string& report)
+{
+    std::cout << report;
+    std::ofstream out(fileName, std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "Could not write " << fileName << std::endl;
+        return false;
+    }
+    out << report;
+    return true;
+}
+
+// The hash loadModel used with std::unordered_map before vkMeshTools
+struct LegacyVertexHash
+{
+    size_t operator()(Vertex const& vertex) const
+    {
+        return ((std::hash<glm::vec3>()(vertex.pos) ^ (std::hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^ (std::hash<glm::vec2>()(vertex.texCoord) << 1);
+    }
+};
+
+static int runDedupBenchmark(const BenchmarkOptions& options)
+{
+    // Unindexed grid as produced by an OBJ import, six corners per quad
+    uint32_t side = static_cast<uint32_t>(std::sqrt(options.dedupTriangles / 2.0)) + 1;
+    std::vector<Vertex> corners;
+    corners.reserve(size_t(side - 1) * (side - 1) * 6);
+    for (uint32_t y = 0; y + 1 < side; ++y) {
+        for (uint32_t x = 0; x + 1 < side; ++x) {
+            const uint32_t quad[6][2] = { {x, y}, {x + 1, y}, {x + 1, y + 1}, {x, y}, {x + 1, y + 1}, {x, y + 1} };
+            for (const auto& c : quad) {
+                Vertex vertex = {};
+                vertex.pos = glm::vec3(float(c[0]), float(c[1]), 0.0f);
+                vertex.color = glm::vec3(1.0f);
+                vertex.texCoord = glm::vec2(float(c[0]) / side, float(c[1]) / side);
+                corners.push_back(vertex);
+            }
+        }
+    }
+
+    auto legacyBegin = std::chrono::high_resolution_clock::now();
+    std::unordered_map<Vertex, uint32_t, LegacyVertexHash> uniqueVertices;
+    std::vector<Vertex> legacyVertices;
+    std::vector<uint32_t> legacyIndices;
+    for (const auto& vertex : corners) {
+        if (uniqueVertices.count(vertex) == 0) {
+            uniqueVertices[vertex] = static_cast<uint32_t>(legacyVertices.size());
+            legacyVertices.push_back(vertex);
+        }
+        legacyIndices.push_back(uniqueVertices[vertex]);
+    }
+    double legacyMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - legacyBegin).count();
+
+    auto remapBegin = std::chrono::high_resolution_clock::now();
+    std::vector<uint32_t> indices;
+    uint32_t vertexCount = vkMeshTools::generateVertexRemap(corners.data(), corners.size(), sizeof(Vertex), indices);
+    std::vector<Vertex> vertices(vertexCount);
+    vkMeshTools::remapVertexBuffer(vertices.data(), corners.data(), corners.size(), sizeof(Vertex), indices);
+    double remapMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - remapBegin).count();
+
+    bool identical = indices == legacyIndices && vertexCount == legacyVertices.size()
+        && memcmp(vertices.data(), legacyVertices.data(), vertexCount * sizeof(Vertex)) == 0;
+
+    std::ostringstream json;
+    json << "{\n  \"dedup\": {\"triangles\": " << corners.size() / 3 << ", \"corners\": " << corners.size()
+         << ", \"uniqueVertices\": " << vertexCount << ", \"workers\": " << vkThreadPool::instance()->size()
+         << ", \"legacyMs\": " << legacyMs << ", \"remapMs\": " << remapMs
+         << ", \"speedup\": " << (remapMs > 0.0 ? legacyMs / remapMs : 0.0)
+         << ", \"identical\": " << (identical ? "true" : "false") << "}\n}\n";
+
+    return (writeReport(options.outFile, json.str()) && identical) ? 0 : 1;
+}
+
+static int runCullBenchmark(const BenchmarkOptions& options)
+{
+    const uint32_t kViews = 64;
+    bool identical = true;
+
+    std::ostringstream json;
+    json << "{\n  \"cull\": [";
+    for (size_t run = 0; run < options.cullObjects.size(); ++run) {
+        // Uniform random spheres in a cube that grows with the count, so the density stays the same
+        uint32_t count = options.cullObjects[run];
+        float half = 0.5f * std::cbrt(float(count)) * 4.0f;
+        std::vector<glm::vec4> spheres(count);
+        uint32_t seed = 1;
+        auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) * (1.0f / 16777216.0f); };
+        for (auto& sphere : spheres) {
+            sphere = glm::vec4((random() * 2.0f - 1.0f) * half, (random() * 2.0f - 1.0f) * half, (random() * 2.0f - 1.0f) * half, 0.5f + random());
+        }
+
+        // Cameras on a circle inside the cube looking outwards
+        glm::mat4 proj = glm::perspective(glm::radians(45.0f), 1.25f, 0.1f, 2.0f * half);
+        std::vector<vkCullParams> views(kViews);
+        for (uint32_t v = 0; v < kViews; ++v) {
+            float angle = v * glm::two_pi<float>() / kViews;
+            glm::vec3 eye(0.5f * half * sinf(angle), 0.5f * half * cosf(angle), 0.0f);
+            views[v] = vkCullParams::fromMatrices(proj, glm::lookAt(eye, eye * 2.0f, glm::vec3(0.0f, 0.0f, 1.0f)));
+        }
+
+        auto buildBegin = std::chrono::high_resolution_clock::now();
+        vkCullBvh bvh;
+        bvh.build(spheres.data(), spheres.size(), sizeof(glm::vec4));
+        double buildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - buildBegin).count();
+
+        // Brute force lists are kept per view as the reference for both BVH paths
+        std::vector<std::vector<uint32_t>> bruteVisible(kViews);
+        size_t visibleTotal = 0;
+        auto bruteBegin = std::chrono::high_resolution_clock::now();
+        for (uint32_t v = 0; v < kViews; ++v) {
+            for (uint32_t i = 0; i < count; ++i) {
+                if (views[v].sphereVisible(glm::vec3(spheres[i]), spheres[i].w)) {
+                    bruteVisible[v].push_back(i);
+                }
+            }
+            visibleTotal += bruteVisible[v].size();
+        }
+        double bruteMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - bruteBegin).count() / kViews;
+
+        std::vector<uint32_t> visible;
+        auto bvhBegin = std::chrono::high_resolution_clock::now();
+        for (const auto& view : views) {
+            bvh.cull(view.planes, visible);
+        }
+        double bvhMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - bvhBegin).count() / kViews;
+
+        auto poolBegin = std::chrono::high_resolution_clock::now();
+        for (const auto& view : views) {
+            bvh.cull(view.planes, visible, vkThreadPool::instance());
+        }
+        double poolMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - poolBegin).count() / kViews;
+
+        // Every view of both paths has to agree, checked outside the timed loops
+        std::vector<uint32_t> pooled;
+        for (uint32_t v = 0; v < kViews && identical; ++v) {
+            bvh.cull(views[v].planes, visible);
+            bvh.cull(views[v].planes, pooled, vkThreadPool::instance());
+            std::sort(visible.begin(), visible.end());
+            std::sort(pooled.begin(), pooled.end());
+            identical = visible == bruteVisible[v] && pooled == bruteVisible[v];
+        }
+
+        json << (run ? "," : "") << "\n    {\"objects\": " << count << ", \"nodes\": " << bvh.nodeCount()
+             << ", \"visibleAverage\": " << visibleTotal / kViews << ", \"workers\": " << vkThreadPool::instance()->size()
+             << ", \"buildMs\": " << buildMs << ", \"bruteForceMs\": " << bruteMs
+             << ", \"bvhMs\": " << bvhMs << ", \"bvhPoolMs\": " << poolMs
+             << ", \"speedup\": " << (poolMs > 0.0 ? bruteMs / poolMs : 0.0) << "}";
+    }
+    json << "\n  ],\n  \"identical\": " << (identical ? "true" : "false") << "\n}\n";
+
+    return (writeReport(options.outFile, json.str()) && identical) ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+    if (options.dedupTriangles > 0) {
+        return runDedupBenchmark(options);
+    }
+    if (!options.cullObjects.empty()) {
+        return runCullBenchmark(options);
+    }
+
+    std::vector<CameraKey> path;
+    if (!options.pathFile.empty()) {
+        path = loadCameraPath(options.pathFile);
+        if (path.empty()) {
+            std::cerr << "No camera keys in " << options.pathFile << std::endl;
+            return 1;
+        }
+    }
+
+    auto pCamera = std::make_shared<Camera>(100.0f);
+
+    auto startupBegin = std::chrono::high_resolution_clock::now();
+    std::unique_ptr<vkRender> pRender;
+    try {
+        pRender = std::make_unique<vkRender>(nullptr, pCamera, options.width, options.height, options.instances, options.depthPrepass);
+    } catch (const std::exception& e) {
+        std::cerr << "Renderer initialization failed: " << e.what() << std::endl;
+        return 1;
+    }
+    double startupMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startupBegin).count();
+
+    // Wait for the initial upload so its fence time is measured rather than observed a frame late
+    vkUploadBatch& upload = pRender->getUploadBatch();
+    upload.retire(true);
+    double uploadMBps = upload.uploadSeconds() > 0.0 ? (upload.stagedBytes() / (1024.0 * 1024.0)) / upload.uploadSeconds() : 0.0;
+
+    for (uint32_t i = 0; i < options.warmup; ++i) {
+        CameraKey key = sampleCameraPath(path, 0.0f);
+        pCamera->lookAt(key.eye, key.origin);
+        pRender->drawFrame();
+    }
+
+    std::vector<double> frameTimes;
+    frameTimes.reserve(options.frames);
+    auto runBegin = std::chrono::high_resolution_clock::now();
+    auto last = runBegin;
+    double culled = 0.0, occluded = 0.0, drawn = 0.0;
+    for (uint32_t i = 0; i < options.frames; ++i) {
+        CameraKey key = sampleCameraPath(path, options.frames > 1 ? float(i) / (options.frames - 1) : 0.0f);
+        pCamera->lookAt(key.eye, key.origin);
+        pRender->drawFrame();
+
+        // Counters of the frame whose fence drawFrame waited on
+        vkCullStats cullStats = pRender->getCullStats();
+        culled += cullStats.culled;
+        occluded += cullStats.occluded;
+        drawn += cullStats.drawn;
+
+        auto now = std::chrono::high_resolution_clock::now();
+        frameTimes.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+        last = now;
+    }
+    pRender->waitIdle();
+    double runSeconds = std::chrono::duration<double>(last - runBegin).count();
+
+    std::vector<double> sorted = frameTimes;
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0.0;
+    for (double v : sorted) {
+        sum += v;
+    }
+
+    const vkProfiler& profiler = pRender->getProfiler();
+    vkAllocatorStats memStats = pRender->getAllocator().getStats();
+
+    std::string pathName = options.pathFile.empty() ? "orbit" : options.pathFile;
+    std::replace(pathName.begin(), pathName.end(), '\\', '/');
+
+    std::ostringstream json;
+    json << "{\n";
+    json << "  \"config\": {\"frames\": " << options.frames << ", \"warmup\": " << options.warmup
+         << ", \"width\": " << options.width << ", \"height\": " << options.height
+         << ", \"instances\": " << options.instances << ", \"depthPrepass\": " << (options.depthPrepass ? "true" : "false")
+         << ", \"path\": \"" << pathName << "\"},\n";
+    json << "  \"frame\": {\"avg\": " << sum / sorted.size() << ", \"min\": " << sorted.front() << ", \"max\": " << sorted.back()
+         << ", \"p50\": " << percentile(sorted, 0.50) << ", \"p95\": " << percentile(sorted, 0.95) << ", \"p99\": " << percentile(sorted, 0.99)
+         << ", \"fps\": " << (runSeconds > 0.0 ? options.frames / runSeconds : 0.0) << "},\n";
+
+    // Per stage numbers cover the profiler window, i.e. the tail of the run
+    json << "  \"stages\": {";
+    for (uint32_t i = 0; i < static_cast<uint32_t>(vkStage::eCount); ++i) {
+        vkStage stage = static_cast<vkStage>(i);
+        vkStageStats stats = profiler.getStats(stage);
+        json << (i ? ", " : "") << "\n    \"" << vkProfiler::stageName(stage) << "\": {\"avg\": " << stats.avg
+             << ", \"p50\": " << stats.p50 << ", \"p95\": " << stats.p95 << ", \"p99\": " << stats.p99 << "}";
+    }
+    json << "\n  },\n";
+
+    json << "  \"startup\": {\"total\": " << startupMs << ", \"stages\": {";
+    const auto& initStages = profiler.getInitStages();
+    for (size_t i = 0; i < initStages.size(); ++i) {
+        json << (i ? ", " : "") << "\"" << initStages[i].first << "\": " << initStages[i].second;
+    }
+    json << "}},\n";
+
+    json << "  \"upload\": {\"bytes\": " << upload.stagedBytes() << ", \"seconds\": " << upload.uploadSeconds()
+         << ", \"MBps\": " << uploadMBps << "},\n";
+    json << "  \"culling\": {\"culled\": " << culled / options.frames << ", \"occluded\": " << occluded / options.frames
+         << ", \"drawn\": " << drawn / options.frames << "},\n";
+    json << "  \"memory\": {\"peakDeviceBlockBytes\": " << memStats.peakBlockBytes << ", \"deviceBlockBytes\": " << memStats.blockBytes
+         << ", \"deviceUsedBytes\": " << memStats.usedBytes << ", \"peakProcessBytes\": " << peakProcessMemory() << "}\n";
+    json << "}\n";
+
+    return writeReport(options.outFile, json.str()) ? 0 : 1;
+}
@@ -0,0 +1,18 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_GOOGLE_include_directive : enable
+out gl_PerVertex {
+    invariant vec4 gl_Position;
+};
+
+#include "transform.glsl"
+
+// Depth prepass, the positions come from their own tightly packed stream
+layout(location = 0) in vec3 inPosition;
+
+// Instance rate: index into the instance transforms
+layout(location = 3) in uint inInstance;
+
+void main() {
+    gl_Position = transformPosition(inPosition, inInstance);
+}
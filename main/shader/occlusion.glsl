@@ -0,0 +1,87 @@
+// Occlusion test against the depth pyramid of the previous frame and the culling counters, shared
+// by the culling shaders. Without OCCLUSION nothing is occluded and nothing is counted.
+
+// Outcome of a culling test
+const uint kCulled = 0;         // Outside the frustum, or facing away for meshlets
+const uint kOccluded = 1;
+const uint kDrawn = 2;
+const uint kNotTested = 3;      // Invocation past the end of the list
+
+#ifdef OCCLUSION
+layout(set = 1, binding = 0) uniform sampler2D depthPyramid;
+
+// Matches vkOcclusionRegion
+layout(std430, set = 1, binding = 1) buffer Occlusion {
+    mat4 viewProj;              // Frame the pyramid was built from, times the model transform of the bounds
+    vec2 pyramidSize;           // Level 0 in texels
+    uint pyramidLevels;
+    uint valid;                 // 0 until a pyramid has been built
+    uint counts[4];             // Indexed by outcome
+} occlusion;
+
+shared uint groupCounts[3];
+
+// True when the sphere lies behind the farthest depth of the pyramid everywhere it covers
+bool sphereOccluded(vec3 center, float radius) {
+    if (occlusion.valid == 0) {
+        return false;
+    }
+
+    // Screen rectangle and nearest depth of the corners of the sphere's bounding box
+    vec2 lo = vec2(1.0);
+    vec2 hi = vec2(-1.0);
+    float nearest = 1.0;
+    for (int i = 0; i < 8; ++i) {
+        vec3 corner = center + radius * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+        vec4 clip = occlusion.viewProj * vec4(corner, 1.0);
+        // Reaches behind the camera, the projection is unbounded
+        if (clip.w <= 0.0) {
+            return false;
+        }
+        vec3 ndc = clip.xyz / clip.w;
+        lo = min(lo, ndc.xy);
+        hi = max(hi, ndc.xy);
+        nearest = min(nearest, ndc.z);
+    }
+    // Partly off screen, the pyramid has no depth for the hidden part
+    if (any(lessThan(lo, vec2(-1.0))) || any(greaterThan(hi, vec2(1.0)))) {
+        return false;
+    }
+    vec2 uvLo = clamp(lo * 0.5 + 0.5, 0.0, 1.0);
+    vec2 uvHi = clamp(hi * 0.5 + 0.5, 0.0, 1.0);
+
+    // The level where the rectangle spans at most one texel, so four texels cover it
+    vec2 extent = (uvHi - uvLo) * occlusion.pyramidSize;
+    int level = min(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))), int(occlusion.pyramidLevels) - 1);
+    ivec2 size = textureSize(depthPyramid, level);
+    ivec2 a = clamp(ivec2(uvLo * vec2(size)), ivec2(0), size - 1);
+    ivec2 b = clamp(ivec2(uvHi * vec2(size)), ivec2(0), size - 1);
+    float farthest = max(max(texelFetch(depthPyramid, a, level).x, texelFetch(depthPyramid, ivec2(b.x, a.y), level).x),
+                         max(texelFetch(depthPyramid, ivec2(a.x, b.y), level).x, texelFetch(depthPyramid, b, level).x));
+
+    return nearest > farthest;
+}
+
+// Adds the outcome of every invocation to the counters, one atomic per group and outcome.
+// Must be reached by the whole work group.
+void countOutcome(uint outcome) {
+    if (gl_LocalInvocationIndex < 3) {
+        groupCounts[gl_LocalInvocationIndex] = 0;
+    }
+    barrier();
+    if (outcome < 3) {
+        atomicAdd(groupCounts[outcome], 1);
+    }
+    barrier();
+    if (gl_LocalInvocationIndex < 3 && groupCounts[gl_LocalInvocationIndex] != 0) {
+        atomicAdd(occlusion.counts[gl_LocalInvocationIndex], groupCounts[gl_LocalInvocationIndex]);
+    }
+}
+#else
+bool sphereOccluded(vec3 center, float radius) {
+    return false;
+}
+
+void countOutcome(uint outcome) {
+}
+#endif
@@ -1,19 +1,21 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
+#extension GL_GOOGLE_include_directive : enable
 out gl_PerVertex {
-    vec4 gl_Position;
+    invariant vec4 gl_Position;
 };
 
-layout(binding = 0) uniform UniformBufferObject{
-    vec2 foo;
-    mat4 modelview;
-    mat4 proj;
-} ubo;
+#include "transform.glsl"
 
 layout(location = 0) in vec3 inPosition;
+#ifdef VERTEX_COLOR
 layout(location = 1) in vec3 inColor;
+#endif
 layout(location = 2) in vec2 inTexCoord;
 
+// Instance rate: index into the instance transforms
+layout(location = 3) in uint inInstance;
+
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
 
@@ -37,7 +39,11 @@ vec2 texcoord[3] = vec2[] (
 void main() {
     // gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
     // fragColor = colors[gl_VertexIndex];
-    gl_Position = ubo.proj * ubo.modelview * vec4(inPosition, 1.0);
+    gl_Position = transformPosition(inPosition, inInstance);
+#ifdef VERTEX_COLOR
     fragColor = inColor;
+#else
+    fragColor = vec3(1.0);
+#endif
     fragTexCoord = inTexCoord;
 }
\ No newline at end of file
@@ -0,0 +1,21 @@
+// Vertex transform shared by the main pass and the depth prepass. Both declare gl_Position
+// invariant and compute it here from the same inputs, so the main pass can test depth for EQUAL.
+
+layout(binding = 0) uniform UniformBufferObject{
+    vec2 foo;
+    mat4 modelview;
+    mat4 proj;
+} ubo;
+
+// Matches vkInstanceData, three rows of the model to world transform per instance
+layout(std430, binding = 2) readonly buffer Instances {
+    vec4 rows[];
+} instances;
+
+// Quantized positions arrive in [0, 1], the instance transform carries their dequantization
+vec4 transformPosition(vec3 inPosition, uint inInstance) {
+    vec4 position = vec4(inPosition, 1.0);
+    uint row = inInstance * 3;
+    vec3 world = vec3(dot(instances.rows[row], position), dot(instances.rows[row + 1], position), dot(instances.rows[row + 2], position));
+    return ubo.proj * ubo.modelview * vec4(world, 1.0);
+}
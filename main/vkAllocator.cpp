@@ -0,0 +1,263 @@
+#include <algorithm>
+
+#include "vkAllocator.h"
+
+#include "spdlog/spdlog.h"
+
+static vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+vkUniqueAllocation& vkUniqueAllocation::operator=(vkUniqueAllocation&& other)
+{
+    if (this != &other) {
+        reset();
+        m_owner = other.m_owner;
+        m_allocation = other.m_allocation;
+        other.m_owner = nullptr;
+        other.m_allocation = vkAllocation();
+    }
+    return *this;
+}
+
+void vkUniqueAllocation::reset()
+{
+    if (m_owner) {
+        m_owner->free(m_allocation);
+        m_owner = nullptr;
+        m_allocation = vkAllocation();
+    }
+}
+
+vkAllocator::vkAllocator(vk::PhysicalDevice physicalDevice, vk::Device device, vk::DeviceSize blockSize)
+{
+    m_device = device;
+    m_blockSize = blockSize;
+    m_memProperties = physicalDevice.getMemoryProperties();
+    m_granularity = std::max<vk::DeviceSize>(physicalDevice.getProperties().limits.bufferImageGranularity, 1);
+    m_blocks.resize(m_memProperties.memoryTypeCount);
+}
+
+vkAllocator::~vkAllocator()
+{
+    auto stats = getStats();
+    if (stats.allocationCount != 0) {
+        spdlog::warn("vkAllocator destroyed with {} live allocations", stats.allocationCount);
+    }
+}
+
+uint32_t vkAllocator::findMemoryType(uint32_t typeFilter, vk::MemoryPropertyFlags properties) const
+{
+    for (uint32_t i = 0; i < m_memProperties.memoryTypeCount; ++i) {
+        if ((typeFilter & (1 << i)) && (m_memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+            return i;
+        }
+    }
+    throw std::runtime_error("failed to find suitable memory type");
+}
+
+vkUniqueAllocation vkAllocator::allocate(const vk::MemoryRequirements& requirements, vk::MemoryPropertyFlags properties, bool linear)
+{
+    uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, properties);
+    vk::DeviceSize alignment = std::max<vk::DeviceSize>(requirements.alignment, 1);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    vkAllocation allocation;
+    auto& blocks = m_blocks[memoryType];
+
+    vk::DeviceSize heapSize = m_memProperties.memoryHeaps[m_memProperties.memoryTypes[memoryType].heapIndex].size;
+    vk::DeviceSize blockSize = std::max<vk::DeviceSize>(std::min(m_blockSize, heapSize / 8), m_granularity);
+
+    if (requirements.size > blockSize / 2) {
+        Block* block = createBlock(memoryType, requirements.size, true);
+        allocateFromBlock(block, requirements.size, alignment, linear, allocation);
+    } else {
+        bool found = false;
+        for (auto& block : blocks) {
+            if (!block->dedicated && block->size - block->used >= requirements.size &&
+                allocateFromBlock(block.get(), requirements.size, alignment, linear, allocation)) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            Block* block = createBlock(memoryType, blockSize, false);
+            if (!allocateFromBlock(block, requirements.size, alignment, linear, allocation)) {
+                throw std::runtime_error("vkAllocator failed to sub-allocate from a fresh block");
+            }
+        }
+    }
+
+    ++m_totalAllocations;
+    return vkUniqueAllocation(this, allocation);
+}
+
+vkAllocator::Block* vkAllocator::createBlock(uint32_t memoryType, vk::DeviceSize size, bool dedicated)
+{
+    vk::MemoryAllocateInfo allocInfo;
+    allocInfo.setAllocationSize(size).setMemoryTypeIndex(memoryType);
+
+    std::unique_ptr<Block> block = std::make_unique<Block>();
+    block->memory = m_device.allocateMemoryUnique(allocInfo);
+    block->size = size;
+    block->memoryType = memoryType;
+    block->dedicated = dedicated;
+    block->ranges.push_back({ 0, size, true, false });
+    if (m_memProperties.memoryTypes[memoryType].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) {
+        block->pointer = m_device.mapMemory(*block->memory, 0, VK_WHOLE_SIZE);
+    }
+
+    ++m_totalDeviceAllocations;
+    m_blockBytes += size;
+    m_peakBlockBytes = std::max(m_peakBlockBytes, m_blockBytes);
+
+    m_blocks[memoryType].push_back(std::move(block));
+    return m_blocks[memoryType].back().get();
+}
+
+bool vkAllocator::onSamePage(vk::DeviceSize lastByte, vk::DeviceSize firstByte) const
+{
+    return (lastByte & ~(m_granularity - 1)) == (firstByte & ~(m_granularity - 1));
+}
+
+bool vkAllocator::allocateFromBlock(Block* block, vk::DeviceSize size, vk::DeviceSize alignment, bool linear, vkAllocation& allocation)
+{
+    auto& ranges = block->ranges;
+    size_t bestIdx = ranges.size();
+    vk::DeviceSize bestOffset = 0;
+
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        const Range& range = ranges[i];
+        if (!range.free || range.size < size) {
+            continue;
+        }
+        vk::DeviceSize offset = alignUp(range.offset, alignment);
+        if (i > 0 && ranges[i - 1].linear != linear && onSamePage(range.offset - 1, offset)) {
+            offset = alignUp(offset, m_granularity);
+        }
+        if (offset + size > range.offset + range.size) {
+            continue;
+        }
+        if (i + 1 < ranges.size() && ranges[i + 1].linear != linear && onSamePage(offset + size - 1, ranges[i + 1].offset)) {
+            continue;
+        }
+        if (bestIdx == ranges.size() || range.size < ranges[bestIdx].size) {
+            bestIdx = i;
+            bestOffset = offset;
+        }
+    }
+
+    if (bestIdx == ranges.size()) {
+        return false;
+    }
+
+    // Split the chosen free range into [padding][allocation][tail]
+    Range chosen = ranges[bestIdx];
+    std::vector<Range> split;
+    if (bestOffset > chosen.offset) {
+        split.push_back({ chosen.offset, bestOffset - chosen.offset, true, false });
+    }
+    split.push_back({ bestOffset, size, false, linear });
+    vk::DeviceSize end = bestOffset + size;
+    if (end < chosen.offset + chosen.size) {
+        split.push_back({ end, chosen.offset + chosen.size - end, true, false });
+    }
+    ranges.erase(ranges.begin() + bestIdx);
+    ranges.insert(ranges.begin() + bestIdx, split.begin(), split.end());
+
+    block->used += size;
+    block->allocationCount++;
+
+    allocation.memory = *block->memory;
+    allocation.offset = bestOffset;
+    allocation.size = size;
+    allocation.memoryType = block->memoryType;
+    allocation.pointer = block->pointer ? static_cast<char*>(block->pointer) + bestOffset : nullptr;
+    allocation.block = block;
+
+    return true;
+}
+
+void vkAllocator::free(const vkAllocation& allocation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto& blocks = m_blocks[allocation.memoryType];
+    auto blockIt = std::find_if(blocks.begin(), blocks.end(), [&](const std::unique_ptr<Block>& b) { return b.get() == allocation.block; });
+    if (blockIt == blocks.end()) {
+        spdlog::error("vkAllocator::free called with an unknown block");
+        return;
+    }
+    Block* block = blockIt->get();
+
+    auto& ranges = block->ranges;
+    auto it = std::lower_bound(ranges.begin(), ranges.end(), allocation.offset, [](const Range& r, vk::DeviceSize offset) { return r.offset < offset; });
+    if (it == ranges.end() || it->offset != allocation.offset || it->free) {
+        spdlog::error("vkAllocator::free called with an unknown range");
+        return;
+    }
+
+    it->free = true;
+    it->linear = false;
+    block->used -= it->size;
+    block->allocationCount--;
+
+    // Coalesce with the following and preceding free ranges
+    size_t idx = it - ranges.begin();
+    if (idx + 1 < ranges.size() && ranges[idx + 1].free) {
+        ranges[idx].size += ranges[idx + 1].size;
+        ranges.erase(ranges.begin() + idx + 1);
+    }
+    if (idx > 0 && ranges[idx - 1].free) {
+        ranges[idx - 1].size += ranges[idx].size;
+        ranges.erase(ranges.begin() + idx);
+    }
+
+    if (block->allocationCount == 0) {
+        // Keep a single empty block around per memory type to avoid allocation churn
+        bool otherEmpty = std::any_of(blocks.begin(), blocks.end(), [&](const std::unique_ptr<Block>& b) {
+            return b.get() != block && !b->dedicated && b->allocationCount == 0;
+        });
+        if (block->dedicated || otherEmpty) {
+            m_blockBytes -= block->size;
+            blocks.erase(blockIt);
+        }
+    }
+}
+
+vkAllocatorStats vkAllocator::getStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    vkAllocatorStats stats;
+    for (const auto& blocks : m_blocks) {
+        for (const auto& block : blocks) {
+            stats.blockCount++;
+            stats.allocationCount += block->allocationCount;
+            stats.blockBytes += block->size;
+            stats.usedBytes += block->used;
+            for (const auto& range : block->ranges) {
+                if (range.free) {
+                    stats.largestFreeRange = std::max(stats.largestFreeRange, range.size);
+                }
+            }
+        }
+    }
+    stats.freeBytes = stats.blockBytes - stats.usedBytes;
+    stats.fragmentation = stats.freeBytes ? 1.0f - float(stats.largestFreeRange) / float(stats.freeBytes) : 0.0f;
+    stats.totalDeviceAllocations = m_totalDeviceAllocations;
+    stats.totalAllocations = m_totalAllocations;
+    stats.peakBlockBytes = m_peakBlockBytes;
+
+    return stats;
+}
+
+void vkAllocator::logStats() const
+{
+    auto stats = getStats();
+    spdlog::info("vkAllocator: {} allocations in {} blocks ({} device allocations total), {:.2f}/{:.2f} MB used, fragmentation {:.1f}%",
+                 stats.allocationCount, stats.blockCount, stats.totalDeviceAllocations,
+                 stats.usedBytes / (1024.0 * 1024.0), stats.blockBytes / (1024.0 * 1024.0), stats.fragmentation * 100.0f);
+}
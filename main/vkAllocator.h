@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class vkAllocator;
+
+// A sub-range of a device memory block handed out by vkAllocator.
+struct vkAllocation
+{
+    vk::DeviceMemory memory;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    uint32_t memoryType = 0;
+    void* pointer = nullptr;        // Persistent mapping (host visible memory only), already offset
+    void* block = nullptr;          // Owning block, opaque to the caller
+};
+
+// Move-only owner of a vkAllocation, returns the range to the allocator on destruction.
+// Mirrors the vk::UniqueDeviceMemory interface so it can replace it in place.
+class vkUniqueAllocation
+{
+public:
+    vkUniqueAllocation() = default;
+    vkUniqueAllocation(vkAllocator* owner, const vkAllocation& allocation) : m_owner(owner), m_allocation(allocation) {}
+    ~vkUniqueAllocation() { reset(); }
+
+    vkUniqueAllocation(vkUniqueAllocation const&) = delete;
+    vkUniqueAllocation& operator=(vkUniqueAllocation const&) = delete;
+    vkUniqueAllocation(vkUniqueAllocation&& other) { *this = std::move(other); }
+    vkUniqueAllocation& operator=(vkUniqueAllocation&& other);
+
+    void reset();
+
+    const vkAllocation& operator*() const { return m_allocation; }
+    const vkAllocation* operator->() const { return &m_allocation; }
+    explicit operator bool() const { return m_owner != nullptr; }
+
+private:
+    vkAllocator* m_owner = nullptr;
+    vkAllocation m_allocation;
+};
+
+struct vkAllocatorStats
+{
+    uint32_t blockCount = 0;            // Live vkAllocateMemory objects
+    uint32_t allocationCount = 0;       // Live sub-allocations
+    uint64_t totalDeviceAllocations = 0;// vkAllocateMemory calls since creation
+    uint64_t totalAllocations = 0;      // Sub-allocations since creation
+    vk::DeviceSize blockBytes = 0;
+    vk::DeviceSize usedBytes = 0;
+    vk::DeviceSize freeBytes = 0;
+    vk::DeviceSize largestFreeRange = 0;
+    vk::DeviceSize peakBlockBytes = 0;
+    float fragmentation = 0.0f;         // 1 - largestFreeRange / freeBytes
+};
+
+// Block based device memory allocator.
+// Each memory type owns a list of large blocks, resources are placed with a best fit search over a
+// sorted range list per block. Buffers/linear images and optimal images are kept bufferImageGranularity
+// apart when they become neighbours. Host visible blocks are persistently mapped.
+class vkAllocator
+{
+public:
+    vkAllocator(vk::PhysicalDevice physicalDevice, vk::Device device, vk::DeviceSize blockSize = 64 * 1024 * 1024);
+    virtual ~vkAllocator();
+
+    vkAllocator(vkAllocator const&) = delete;
+    vkAllocator& operator=(vkAllocator const&) = delete;
+
+    vkUniqueAllocation allocate(const vk::MemoryRequirements& requirements, vk::MemoryPropertyFlags properties, bool linear);
+    void free(const vkAllocation& allocation);
+
+    uint32_t findMemoryType(uint32_t typeFilter, vk::MemoryPropertyFlags properties) const;
+
+    vkAllocatorStats getStats() const;
+    void logStats() const;
+
+private:
+    struct Range
+    {
+        vk::DeviceSize offset;
+        vk::DeviceSize size;
+        bool free;
+        bool linear;
+    };
+
+    struct Block
+    {
+        vk::UniqueDeviceMemory memory;
+        vk::DeviceSize size = 0;
+        vk::DeviceSize used = 0;
+        uint32_t memoryType = 0;
+        uint32_t allocationCount = 0;
+        bool dedicated = false;
+        void* pointer = nullptr;
+        std::vector<Range> ranges;
+    };
+
+    Block* createBlock(uint32_t memoryType, vk::DeviceSize size, bool dedicated);
+    bool allocateFromBlock(Block* block, vk::DeviceSize size, vk::DeviceSize alignment, bool linear, vkAllocation& allocation);
+    bool onSamePage(vk::DeviceSize endOffset, vk::DeviceSize startOffset) const;
+
+private:
+    vk::Device m_device;
+    vk::PhysicalDeviceMemoryProperties m_memProperties;
+    vk::DeviceSize m_blockSize;
+    vk::DeviceSize m_granularity;
+
+    mutable std::mutex m_mutex;
+    std::vector<std::vector<std::unique_ptr<Block>>> m_blocks;
+
+    uint64_t m_totalDeviceAllocations = 0;
+    uint64_t m_totalAllocations = 0;
+    vk::DeviceSize m_blockBytes = 0;
+    vk::DeviceSize m_peakBlockBytes = 0;
+};
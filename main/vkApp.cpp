@@ -1,7 +1,9 @@
+#include <cstdlib>
 #include <iostream>
 
 #include "Camera.h"
 #include "vkRender.h"
+#include "vkTrace.h"
 
 #include "vkApp.h"
 
@@ -21,6 +23,11 @@ vkApp::~vkApp()
 
 int vkApp::init(int width, int height)
 {
+    // Set VK_TRACE to capture startup as well, 'T' toggles capture at runtime
+    if (std::getenv("VK_TRACE")) {
+        vkTrace::instance()->setEnabled(true);
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         std::cout << "Could not initialize SDL." << std::endl;
         return -1;
@@ -80,6 +87,9 @@ int vkApp::run()
                         case SDLK_d:
                             m_pCamera->right();
                             break;
+                        case SDLK_t:
+                            toggleTrace();
+                            break;
                         }
                     }
                     //printf("type:%d, state:%d, scan_code:%d, syn:0x%x, mode:0x%x, repeat:%d\n", event.key.type, event.key.state, event.key.keysym.scancode, event.key.keysym.sym, event.key.keysym.mod, event.key.repeat);
@@ -127,10 +137,29 @@ int vkApp::run()
     return 0;
 }
 
+void vkApp::toggleTrace()
+{
+    vkTrace* trace = vkTrace::instance();
+    if (vkTrace::enabled()) {
+        trace->setEnabled(false);
+        if (trace->save(m_traceFile)) {
+            std::cout << "Trace written to " << m_traceFile << std::endl;
+        }
+    } else {
+        trace->clear();
+        trace->setEnabled(true);
+        std::cout << "Trace capture started" << std::endl;
+    }
+}
+
 void vkApp::clean()
 {
     m_pRender.reset();
 
+    if (vkTrace::enabled()) {
+        toggleTrace();
+    }
+
     SDL_DestroyWindow(m_pWindow);
     SDL_Quit();
 }
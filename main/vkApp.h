@@ -24,10 +24,12 @@ public:
 protected:
     int init(int width, int height);
     void clean();
+    void toggleTrace();
 
 protected:
     int m_width = 1200;
     int m_height = 960;
+    std::string m_traceFile = "trace.json";
 
     SDL_Window* m_pWindow;
     std::shared_ptr<Camera> m_pCamera;
@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <numeric>
+
+#include "vkCullBvh.h"
+#include "vkThreadPool.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VK_CULL_SSE 1
+#include <immintrin.h>
+#endif
+#if defined(VK_CULL_AVX) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+const uint32_t vkCullBvh::kLeafSize;
+const size_t vkCullBvh::kParallelThreshold;
+
+namespace
+{
+    // Depth below the root at which partially visible nodes are handed to the workers, up to 4^3 tasks
+    const uint32_t kSplitDepth = 3;
+
+    // Objects are padded by a full vector so leaves never load past the end
+    const size_t kObjectPadding = 8;
+
+    // Planes broadcast once per traversal
+    struct FrustumPlanes
+    {
+#if defined(VK_CULL_SSE)
+        __m128 nx[6], ny[6], nz[6], w[6];
+        __m128 ax[6], ay[6], az[6];         // Absolute normal components
+#endif
+        glm::vec4 planes[6];
+    };
+
+    void preparePlanes(FrustumPlanes& f, const glm::vec4 planes[6])
+    {
+        for (int p = 0; p < 6; ++p) {
+            f.planes[p] = planes[p];
+#if defined(VK_CULL_SSE)
+            f.nx[p] = _mm_set1_ps(planes[p].x);
+            f.ny[p] = _mm_set1_ps(planes[p].y);
+            f.nz[p] = _mm_set1_ps(planes[p].z);
+            f.w[p] = _mm_set1_ps(planes[p].w);
+            f.ax[p] = _mm_set1_ps(std::fabs(planes[p].x));
+            f.ay[p] = _mm_set1_ps(std::fabs(planes[p].y));
+            f.az[p] = _mm_set1_ps(std::fabs(planes[p].z));
+#endif
+        }
+    }
+
+    // Classifies four boxes given as center and half extent. Bit i of outside is set when box i lies
+    // behind a plane, bit i of partial when it crosses one
+    void classifyBoxes(const FrustumPlanes& f, const float* cx, const float* cy, const float* cz, const float* ex, const float* ey, const float* ez,
+                       int& outside, int& partial)
+    {
+#if defined(VK_CULL_SSE)
+        __m128 x = _mm_loadu_ps(cx), y = _mm_loadu_ps(cy), z = _mm_loadu_ps(cz);
+        __m128 hx = _mm_loadu_ps(ex), hy = _mm_loadu_ps(ey), hz = _mm_loadu_ps(ez);
+        __m128 out = _mm_setzero_ps();
+        __m128 cross = _mm_setzero_ps();
+        for (int p = 0; p < 6; ++p) {
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f.nx[p], x), _mm_mul_ps(f.ny[p], y)), _mm_add_ps(_mm_mul_ps(f.nz[p], z), f.w[p]));
+            __m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f.ax[p], hx), _mm_mul_ps(f.ay[p], hy)), _mm_mul_ps(f.az[p], hz));
+            out = _mm_or_ps(out, _mm_cmplt_ps(d, _mm_sub_ps(_mm_setzero_ps(), e)));
+            cross = _mm_or_ps(cross, _mm_cmplt_ps(d, e));
+        }
+        outside = _mm_movemask_ps(out);
+        partial = _mm_movemask_ps(cross);
+#else
+        outside = 0;
+        partial = 0;
+        for (int i = 0; i < 4; ++i) {
+            for (int p = 0; p < 6; ++p) {
+                const glm::vec4& n = f.planes[p];
+                float d = n.x * cx[i] + n.y * cy[i] + n.z * cz[i] + n.w;
+                float e = std::fabs(n.x) * ex[i] + std::fabs(n.y) * ey[i] + std::fabs(n.z) * ez[i];
+                outside |= (d < -e) ? (1 << i) : 0;
+                partial |= (d < e) ? (1 << i) : 0;
+            }
+        }
+#endif
+    }
+
+    void appendLanes(int mask, const uint32_t* ids, std::vector<uint32_t>& visible)
+    {
+        for (int lane = 0; mask != 0; ++lane, mask >>= 1) {
+            if (mask & 1) {
+                visible.push_back(ids[lane]);
+            }
+        }
+    }
+
+    void cullSpheres(const FrustumPlanes& f, const float* x, const float* y, const float* z, const float* r, const uint32_t* ids, uint32_t count,
+                     std::vector<uint32_t>& visible)
+    {
+        uint32_t i = 0;
+#if defined(VK_CULL_SSE)
+        for (; i < count; i += 4) {
+            __m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+            __m128 nr = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(r + i));
+            __m128 out = _mm_setzero_ps();
+            for (int p = 0; p < 6; ++p) {
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f.nx[p], px), _mm_mul_ps(f.ny[p], py)), _mm_add_ps(_mm_mul_ps(f.nz[p], pz), f.w[p]));
+                out = _mm_or_ps(out, _mm_cmplt_ps(d, nr));
+            }
+            int lanes = static_cast<int>(std::min(count - i, 4u));
+            appendLanes(~_mm_movemask_ps(out) & ((1 << lanes) - 1), ids + i, visible);
+        }
+#else
+        for (; i < count; ++i) {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; ++p) {
+                const glm::vec4& n = f.planes[p];
+                inside = n.x * x[i] + n.y * y[i] + n.z * z[i] + n.w >= -r[i];
+            }
+            if (inside) {
+                visible.push_back(ids[i]);
+            }
+        }
+#endif
+    }
+
+#if defined(VK_CULL_AVX)
+    // AVX needs both the CPU feature and the OS saving the upper register halves
+    bool detectAvx()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#else
+        return __builtin_cpu_supports("avx");
+#endif
+    }
+
+    const bool kAvxSupported = detectAvx();
+#endif
+}
+
+void vkCullBvh::clear()
+{
+    m_nodes.clear();
+    m_x.clear();
+    m_y.clear();
+    m_z.clear();
+    m_radius.clear();
+    m_ids.clear();
+}
+
+void vkCullBvh::build(const void* spheres, size_t count, size_t stride)
+{
+    clear();
+    if (count == 0) {
+        return;
+    }
+
+    // Copied as four floats, so any stride and alignment of the source works
+    static_assert(sizeof(glm::vec4) == 4 * sizeof(float), "spheres are read as four floats");
+    std::vector<glm::vec4> bounds(count);
+    const uint8_t* src = static_cast<const uint8_t*>(spheres);
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(&bounds[i], src + i * stride, sizeof(glm::vec4));
+    }
+
+    std::vector<uint32_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    m_nodes.reserve(count / kLeafSize + 1);
+    buildNode(order.data(), 0, static_cast<uint32_t>(count), bounds.data());
+
+    m_x.assign(count + kObjectPadding, 0.0f);
+    m_y.assign(count + kObjectPadding, 0.0f);
+    m_z.assign(count + kObjectPadding, 0.0f);
+    m_radius.assign(count + kObjectPadding, 0.0f);
+    m_ids.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        const glm::vec4& sphere = bounds[order[i]];
+        m_x[i] = sphere.x;
+        m_y[i] = sphere.y;
+        m_z[i] = sphere.z;
+        m_radius[i] = sphere.w;
+        m_ids[i] = order[i];
+    }
+}
+
+uint32_t vkCullBvh::buildNode(uint32_t* order, uint32_t first, uint32_t count, const glm::vec4* spheres)
+{
+    uint32_t index = static_cast<uint32_t>(m_nodes.size());
+    m_nodes.push_back(Node{});
+
+    // Median split along the largest extent of the centers
+    auto split = [&](uint32_t begin, uint32_t size) {
+        glm::vec3 lo(std::numeric_limits<float>::max());
+        glm::vec3 hi(-std::numeric_limits<float>::max());
+        for (uint32_t i = begin; i < begin + size; ++i) {
+            lo = glm::min(lo, glm::vec3(spheres[order[i]]));
+            hi = glm::max(hi, glm::vec3(spheres[order[i]]));
+        }
+        glm::vec3 extent = hi - lo;
+        int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+        uint32_t mid = begin + size / 2;
+        std::nth_element(order + begin, order + mid, order + begin + size,
+                         [spheres, axis](uint32_t a, uint32_t b) { return spheres[a][axis] < spheres[b][axis]; });
+        return mid;
+    };
+
+    // Two levels of binary splits give up to four children
+    uint32_t ranges[4][2];
+    uint32_t childCount = 0;
+    if (count <= kLeafSize) {
+        ranges[childCount][0] = first;
+        ranges[childCount++][1] = count;
+    } else {
+        uint32_t mid = split(first, count);
+        uint32_t halves[2][2] = { { first, mid - first }, { mid, first + count - mid } };
+        for (auto& half : halves) {
+            if (half[1] > kLeafSize) {
+                uint32_t quarter = split(half[0], half[1]);
+                ranges[childCount][0] = half[0];
+                ranges[childCount++][1] = quarter - half[0];
+                ranges[childCount][0] = quarter;
+                ranges[childCount++][1] = half[0] + half[1] - quarter;
+            } else {
+                ranges[childCount][0] = half[0];
+                ranges[childCount++][1] = half[1];
+            }
+        }
+    }
+
+    for (uint32_t c = 0; c < childCount; ++c) {
+        uint32_t begin = ranges[c][0];
+        uint32_t size = ranges[c][1];
+        glm::vec3 lo(std::numeric_limits<float>::max());
+        glm::vec3 hi(-std::numeric_limits<float>::max());
+        for (uint32_t i = begin; i < begin + size; ++i) {
+            const glm::vec4& sphere = spheres[order[i]];
+            lo = glm::min(lo, glm::vec3(sphere) - sphere.w);
+            hi = glm::max(hi, glm::vec3(sphere) + sphere.w);
+        }
+        glm::vec3 center = (lo + hi) * 0.5f;
+        glm::vec3 extent = (hi - lo) * 0.5f;
+
+        int32_t child = (size > kLeafSize) ? static_cast<int32_t>(buildNode(order, begin, size, spheres)) : -1;
+
+        // The recursion may have reallocated the node array
+        Node& node = m_nodes[index];
+        node.centerX[c] = center.x;
+        node.centerY[c] = center.y;
+        node.centerZ[c] = center.z;
+        node.extentX[c] = extent.x;
+        node.extentY[c] = extent.y;
+        node.extentZ[c] = extent.z;
+        node.child[c] = child;
+        node.first[c] = begin;
+        node.count[c] = size;
+    }
+
+    return index;
+}
+
+void vkCullBvh::traverse(uint32_t root, const glm::vec4 planes[6], std::vector<uint32_t>& visible, std::vector<uint32_t>* splits) const
+{
+    FrustumPlanes f;
+    preparePlanes(f, planes);
+
+    struct Entry
+    {
+        uint32_t node;
+        uint32_t depth;
+    };
+    Entry stack[64];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = Entry{ root, 0 };
+
+    while (stackSize > 0) {
+        Entry entry = stack[--stackSize];
+        const Node& node = m_nodes[entry.node];
+
+        int outside = 0;
+        int partial = 0;
+        classifyBoxes(f, node.centerX, node.centerY, node.centerZ, node.extentX, node.extentY, node.extentZ, outside, partial);
+
+        for (int c = 0; c < 4; ++c) {
+            uint32_t count = node.count[c];
+            if (count == 0 || (outside & (1 << c))) {
+                continue;
+            }
+
+            uint32_t first = node.first[c];
+            if (!(partial & (1 << c))) {
+                visible.insert(visible.end(), m_ids.begin() + first, m_ids.begin() + first + count);
+            } else if (node.child[c] < 0) {
+#if defined(VK_CULL_AVX)
+                if (kAvxSupported) {
+                    cullSpheresAvx(f.planes, &m_x[first], &m_y[first], &m_z[first], &m_radius[first], &m_ids[first], count, visible);
+                    continue;
+                }
+#endif
+                cullSpheres(f, &m_x[first], &m_y[first], &m_z[first], &m_radius[first], &m_ids[first], count, visible);
+            } else if (splits && entry.depth + 1 >= kSplitDepth) {
+                splits->push_back(static_cast<uint32_t>(node.child[c]));
+            } else {
+                stack[stackSize++] = Entry{ static_cast<uint32_t>(node.child[c]), entry.depth + 1 };
+            }
+        }
+    }
+}
+
+void vkCullBvh::cull(const glm::vec4 planes[6], std::vector<uint32_t>& visible, vkThreadPool* pool) const
+{
+    visible.clear();
+    if (m_nodes.empty()) {
+        return;
+    }
+    if (!pool || pool->size() < 2 || m_ids.size() < kParallelThreshold) {
+        traverse(0, planes, visible, nullptr);
+        return;
+    }
+
+    std::vector<uint32_t> splits;
+    traverse(0, planes, visible, &splits);
+
+    std::vector<std::vector<uint32_t>> results(splits.size());
+    std::vector<std::future<void>> tasks;
+    tasks.reserve(splits.size());
+    for (size_t i = 0; i < splits.size(); ++i) {
+        tasks.push_back(pool->enqueue([this, planes, &splits, &results, i]() { traverse(splits[i], planes, results[i], nullptr); }));
+    }
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        tasks[i].get();
+        visible.insert(visible.end(), results[i].begin(), results[i].end());
+    }
+}
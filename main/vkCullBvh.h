@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+// x86 builds carry an AVX leaf test in vkCullBvhAvx.cpp, picked at runtime when the CPU has AVX
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define VK_CULL_AVX 1
+#endif
+
+class vkThreadPool;
+
+// CPU frustum culling for devices without GPU driven rendering.
+// A 4-wide BVH over object bounding spheres: every node stores the boxes of its four children as
+// structure of arrays, so one SSE test classifies all of them against a plane. Objects are stored
+// in BVH order, also as structure of arrays, and leaves test 8 (AVX, when the CPU has it) or 4 (SSE)
+// spheres at a time.
+// Subtrees completely inside the frustum are accepted without further tests. Large trees are split
+// below the top levels and traversed on the worker pool.
+class vkCullBvh
+{
+public:
+    static const uint32_t kLeafSize = 16;
+    static const size_t kParallelThreshold = 16384;
+
+    // spheres points at the first glm::vec4 (center, radius), consecutive ones are stride bytes apart
+    void build(const void* spheres, size_t count, size_t stride);
+    void clear();
+
+    // Writes the indices of the objects that intersect the frustum to visible, in no particular
+    // order. Planes point inwards and are normalized, as in vkCullParams.
+    void cull(const glm::vec4 planes[6], std::vector<uint32_t>& visible, vkThreadPool* pool = nullptr) const;
+
+    size_t objectCount() const { return m_ids.size(); }
+    size_t nodeCount() const { return m_nodes.size(); }
+
+private:
+    struct Node
+    {
+        // Child boxes as center and half extent
+        float centerX[4];
+        float centerY[4];
+        float centerZ[4];
+        float extentX[4];
+        float extentY[4];
+        float extentZ[4];
+        int32_t child[4];           // Node index, -1 for a leaf
+        uint32_t first[4];          // Object range below the child, empty slots have no objects
+        uint32_t count[4];
+    };
+
+    uint32_t buildNode(uint32_t* order, uint32_t first, uint32_t count, const glm::vec4* spheres);
+    // Without splits the whole subtree is traversed, otherwise partially visible nodes below the
+    // top levels are collected in splits for the workers
+    void traverse(uint32_t root, const glm::vec4 planes[6], std::vector<uint32_t>& visible, std::vector<uint32_t>* splits) const;
+#if defined(VK_CULL_AVX)
+    static void cullSpheresAvx(const glm::vec4 planes[6], const float* x, const float* y, const float* z, const float* r, const uint32_t* ids, uint32_t count,
+                               std::vector<uint32_t>& visible);
+#endif
+
+private:
+    std::vector<Node> m_nodes;
+    // Objects in BVH order, padded so the last leaf can be loaded a full vector at a time
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<float> m_z;
+    std::vector<float> m_radius;
+    std::vector<uint32_t> m_ids;
+};
@@ -0,0 +1,39 @@
+#include <algorithm>
+
+#include "vkCullBvh.h"
+
+#if defined(VK_CULL_AVX)
+#include <immintrin.h>
+
+// The project builds this file with /arch:AVX, GCC and Clang get the target per function. Only
+// called after vkCullBvh has checked the CPU.
+#if defined(__GNUC__) && !defined(__AVX__)
+#define VK_CULL_AVX_TARGET __attribute__((target("avx")))
+#else
+#define VK_CULL_AVX_TARGET
+#endif
+
+VK_CULL_AVX_TARGET
+void vkCullBvh::cullSpheresAvx(const glm::vec4 planes[6], const float* x, const float* y, const float* z, const float* r, const uint32_t* ids, uint32_t count,
+                               std::vector<uint32_t>& visible)
+{
+    for (uint32_t i = 0; i < count; i += 8) {
+        __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+        __m256 nr = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(r + i));
+        __m256 out = _mm256_setzero_ps();
+        for (int p = 0; p < 6; ++p) {
+            const float* n = &planes[p].x;
+            __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_broadcast_ss(n), px), _mm256_mul_ps(_mm256_broadcast_ss(n + 1), py)),
+                                     _mm256_add_ps(_mm256_mul_ps(_mm256_broadcast_ss(n + 2), pz), _mm256_broadcast_ss(n + 3)));
+            out = _mm256_or_ps(out, _mm256_cmp_ps(d, nr, _CMP_LT_OQ));
+        }
+        int lanes = static_cast<int>(std::min(count - i, 8u));
+        int mask = ~_mm256_movemask_ps(out) & ((1 << lanes) - 1);
+        for (int lane = 0; mask != 0; ++lane, mask >>= 1) {
+            if (mask & 1) {
+                visible.push_back(ids[i + lane]);
+            }
+        }
+    }
+}
+#endif
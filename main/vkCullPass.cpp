@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <array>
+#include <limits>
+
+#include "vkCullPass.h"
+
+static vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Offset of the draw commands inside a frame region, the draw count comes first
+static const vk::DeviceSize kCommandOffset = 16;
+
+const uint32_t vkCullPass::kGroupSize;
+
+vkCullParams vkCullParams::fromMatrices(const glm::mat4& proj, const glm::mat4& modelView)
+{
+    vkCullParams params = {};
+
+    // Gribb/Hartmann plane extraction from the rows of the combined matrix. The near plane uses the
+    // -w <= z bound, which is also conservative for a zero to one depth range.
+    glm::mat4 m = proj * modelView;
+    glm::vec4 row[4];
+    for (int i = 0; i < 4; ++i) {
+        row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+    }
+    params.planes[0] = row[3] + row[0];
+    params.planes[1] = row[3] - row[0];
+    params.planes[2] = row[3] + row[1];
+    params.planes[3] = row[3] - row[1];
+    params.planes[4] = row[3] + row[2];
+    params.planes[5] = row[3] - row[2];
+    for (auto& plane : params.planes) {
+        float length = glm::length(glm::vec3(plane));
+        plane = (length > 0.0f) ? plane / length : plane;
+    }
+
+    params.cameraPosition = glm::inverse(modelView)[3];
+    params.clusterCount = std::numeric_limits<uint32_t>::max();     // Every meshlet unless a range is selected
+    params.coneCulling = 1;
+    return params;
+}
+
+bool vkCullParams::sphereVisible(const glm::vec3& center, float radius) const
+{
+    for (const auto& plane : planes) {
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+vkCullPass::vkCullPass(vk::PhysicalDevice physicalDevice, vk::Device device, vkAllocator& allocator, vk::PipelineCache pipelineCache, const std::vector<uint32_t>& shaderCode,
+                       vk::Buffer meshletBuffer, uint32_t meshletCount, uint32_t frameCount, bool drawIndirectCount, const vkDepthPyramid* depthPyramid)
+    : m_device(device), m_meshletCount(meshletCount), m_drawIndirectCount(drawIndirectCount), m_depthPyramid(depthPyramid), m_frameDrawCount(frameCount, 0)
+{
+    vk::DeviceSize alignment = std::max<vk::DeviceSize>(physicalDevice.getProperties().limits.minStorageBufferOffsetAlignment, 16);
+    m_regionSize = alignUp(kCommandOffset + vk::DeviceSize(meshletCount) * sizeof(vk::DrawIndexedIndirectCommand), alignment);
+
+    vk::BufferCreateInfo bufferInfo;
+    bufferInfo.setSize(m_regionSize * frameCount)
+        .setUsage(vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eTransferDst)
+        .setSharingMode(vk::SharingMode::eExclusive);
+    m_drawBuffer = device.createBufferUnique(bufferInfo);
+    m_drawMemory = allocator.allocate(device.getBufferMemoryRequirements(*m_drawBuffer), vk::MemoryPropertyFlagBits::eDeviceLocal, true);
+    device.bindBufferMemory(*m_drawBuffer, m_drawMemory->memory, m_drawMemory->offset);
+
+    std::array<vk::DescriptorSetLayoutBinding, 2> bindings;
+    bindings[0].setBinding(0).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eStorageBuffer).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    bindings[1].setBinding(1).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eStorageBufferDynamic).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    vk::DescriptorSetLayoutCreateInfo layoutInfo;
+    layoutInfo.setBindingCount(static_cast<uint32_t>(bindings.size())).setPBindings(bindings.data());
+    m_setLayout = device.createDescriptorSetLayoutUnique(layoutInfo);
+
+    std::array<vk::DescriptorPoolSize, 2> poolSize;
+    poolSize[0].setType(vk::DescriptorType::eStorageBuffer).setDescriptorCount(1);
+    poolSize[1].setType(vk::DescriptorType::eStorageBufferDynamic).setDescriptorCount(1);
+    vk::DescriptorPoolCreateInfo poolInfo;
+    poolInfo.setPoolSizeCount(static_cast<uint32_t>(poolSize.size())).setPPoolSizes(poolSize.data()).setMaxSets(1)
+        .setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
+    m_descriptorPool = device.createDescriptorPoolUnique(poolInfo);
+
+    vk::DescriptorSetAllocateInfo allocInfo;
+    allocInfo.setDescriptorPool(*m_descriptorPool).setDescriptorSetCount(1).setPSetLayouts(&*m_setLayout);
+    m_descriptorSet = std::move(device.allocateDescriptorSetsUnique(allocInfo)[0]);
+
+    vk::DescriptorBufferInfo meshletInfo(meshletBuffer, 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo drawInfo(*m_drawBuffer, 0, m_regionSize);
+    std::array<vk::WriteDescriptorSet, 2> descriptorWrite;
+    descriptorWrite[0].setDstSet(*m_descriptorSet).setDstBinding(0).setDescriptorType(vk::DescriptorType::eStorageBuffer).setDescriptorCount(1).setPBufferInfo(&meshletInfo);
+    descriptorWrite[1].setDstSet(*m_descriptorSet).setDstBinding(1).setDescriptorType(vk::DescriptorType::eStorageBufferDynamic).setDescriptorCount(1).setPBufferInfo(&drawInfo);
+    device.updateDescriptorSets(descriptorWrite, nullptr);
+
+    vk::PushConstantRange pushConstantRange(vk::ShaderStageFlagBits::eCompute, 0, sizeof(vkCullParams));
+    std::vector<vk::DescriptorSetLayout> setLayouts = { *m_setLayout };
+    if (m_depthPyramid) {
+        setLayouts.push_back(m_depthPyramid->occlusionLayout());
+    }
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo;
+    pipelineLayoutInfo.setSetLayoutCount(static_cast<uint32_t>(setLayouts.size())).setPSetLayouts(setLayouts.data())
+        .setPushConstantRangeCount(1).setPPushConstantRanges(&pushConstantRange);
+    m_pipelineLayout = device.createPipelineLayoutUnique(pipelineLayoutInfo);
+
+    auto shaderCreateInfo = vk::ShaderModuleCreateInfo{ {}, shaderCode.size() * sizeof(uint32_t), shaderCode.data() };
+    auto shaderModule = device.createShaderModuleUnique(shaderCreateInfo);
+    vk::PipelineShaderStageCreateInfo stageInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eCompute, *shaderModule, "main");
+
+    vk::ComputePipelineCreateInfo pipelineInfo;
+    pipelineInfo.setStage(stageInfo).setLayout(*m_pipelineLayout);
+    m_pipeline = device.createComputePipelineUnique(pipelineCache, pipelineInfo);
+}
+
+vkCullPass::~vkCullPass()
+{
+}
+
+void vkCullPass::record(vk::CommandBuffer commandBuffer, uint32_t frame, const vkCullParams& params)
+{
+    uint32_t regionOffset = static_cast<uint32_t>(frame * m_regionSize);
+
+    // Reset the count, without the count extension the stale commands have to go as well
+    commandBuffer.fillBuffer(*m_drawBuffer, regionOffset, m_drawIndirectCount ? sizeof(uint32_t) : m_regionSize, 0);
+
+    vk::MemoryBarrier barrier;
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite).setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(), barrier, nullptr, nullptr);
+
+    vkCullParams pushParams = params;
+    pushParams.firstCluster = std::min(params.firstCluster, m_meshletCount);
+    pushParams.clusterCount = std::min(params.clusterCount, m_meshletCount - pushParams.firstCluster);
+    m_frameDrawCount[frame] = pushParams.clusterCount;
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *m_pipeline);
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *m_pipelineLayout, 0, *m_descriptorSet, regionOffset);
+    if (m_depthPyramid) {
+        commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *m_pipelineLayout, 1, m_depthPyramid->occlusionSet(), m_depthPyramid->occlusionOffset(frame));
+    }
+    commandBuffer.pushConstants(*m_pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(pushParams), &pushParams);
+    commandBuffer.dispatch((pushParams.clusterCount + kGroupSize - 1) / kGroupSize, 1, 1);
+
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eShaderWrite).setDstAccessMask(vk::AccessFlagBits::eIndirectCommandRead);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eDrawIndirect, vk::DependencyFlags(), barrier, nullptr, nullptr);
+}
+
+void vkCullPass::draw(vk::CommandBuffer commandBuffer, uint32_t frame, const vk::DispatchLoaderDynamic& dldi)
+{
+    vk::DeviceSize regionOffset = frame * m_regionSize;
+    const uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand);
+    if (m_drawIndirectCount) {
+        commandBuffer.drawIndexedIndirectCountKHR(*m_drawBuffer, regionOffset + kCommandOffset, *m_drawBuffer, regionOffset, m_frameDrawCount[frame], stride, dldi);
+    } else {
+        commandBuffer.drawIndexedIndirect(*m_drawBuffer, regionOffset + kCommandOffset, m_frameDrawCount[frame], stride);
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstddef>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "vkAllocator.h"
+#include "vkDepthPyramid.h"
+
+// Push constants of cull.comp
+struct vkCullParams
+{
+    glm::vec4 planes[6];            // Normalized frustum planes in model space, inside when dot(plane, p) >= 0
+    glm::vec4 cameraPosition;       // Model space
+    uint32_t firstCluster;          // Meshlet range of the selected level of detail
+    uint32_t clusterCount;
+    uint32_t coneCulling;
+    uint32_t reserved;              // Keeps the size at 128 bytes, also when aligned gentypes round it up
+
+    // Frustum and camera position for the model to clip space transform proj * modelView
+    static vkCullParams fromMatrices(const glm::mat4& proj, const glm::mat4& modelView);
+    // False when the sphere lies completely outside one of the planes
+    bool sphereVisible(const glm::vec3& center, float radius) const;
+};
+
+static_assert(offsetof(vkCullParams, cameraPosition) == 96 && offsetof(vkCullParams, firstCluster) == 112
+              && offsetof(vkCullParams, coneCulling) == 120 && sizeof(vkCullParams) == 128, "vkCullParams must match CullParams in cull.comp");
+
+// Compute pass that culls meshlets against the view frustum and their normal cones and writes one
+// indirect indexed draw per surviving meshlet.
+// The draws are compacted behind a counter. With VK_KHR_draw_indirect_count the GPU consumes the
+// count directly, otherwise the command region is cleared first so the commands past the count draw
+// nothing. Every frame in flight owns a region, so recording never waits on an earlier frame.
+// Given a depth pyramid, meshlets hidden behind the previous frame's depth are dropped as well.
+class vkCullPass
+{
+public:
+    vkCullPass(vk::PhysicalDevice physicalDevice, vk::Device device, vkAllocator& allocator, vk::PipelineCache pipelineCache, const std::vector<uint32_t>& shaderCode,
+               vk::Buffer meshletBuffer, uint32_t meshletCount, uint32_t frameCount, bool drawIndirectCount, const vkDepthPyramid* depthPyramid = nullptr);
+    virtual ~vkCullPass();
+
+    vkCullPass(vkCullPass const&) = delete;
+    vkCullPass& operator=(vkCullPass const&) = delete;
+
+    // Records the culling dispatch for the meshlet range in params, must be outside of a render pass
+    void record(vk::CommandBuffer commandBuffer, uint32_t frame, const vkCullParams& params);
+    // Draws the surviving meshlets inside the render pass, with the index and vertex buffers bound
+    void draw(vk::CommandBuffer commandBuffer, uint32_t frame, const vk::DispatchLoaderDynamic& dldi);
+
+    uint32_t meshletCount() const { return m_meshletCount; }
+
+    static const uint32_t kGroupSize = 64;
+
+private:
+    vk::Device m_device;
+    uint32_t m_meshletCount;
+    bool m_drawIndirectCount;
+    const vkDepthPyramid* m_depthPyramid;       // Set when the shader was compiled with OCCLUSION
+    std::vector<uint32_t> m_frameDrawCount;     // Meshlets culled by the last record() of every frame
+
+    // Per frame region: draw count, padding to 16 bytes, then the draw commands
+    vk::DeviceSize m_regionSize;
+    vk::UniqueBuffer m_drawBuffer;
+    vkUniqueAllocation m_drawMemory;
+
+    vk::UniqueDescriptorSetLayout m_setLayout;
+    vk::UniqueDescriptorPool m_descriptorPool;
+    vk::UniqueDescriptorSet m_descriptorSet;
+    vk::UniquePipelineLayout m_pipelineLayout;
+    vk::UniquePipeline m_pipeline;
+};
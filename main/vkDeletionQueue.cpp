@@ -0,0 +1,13 @@
+#include "vkDeletionQueue.h"
+
+void vkDeletionQueue::retire(uint64_t completedFrames)
+{
+    while (!m_entries.empty() && m_entries.front().frame <= completedFrames) {
+        m_entries.pop_front();
+    }
+}
+
+void vkDeletionQueue::flush()
+{
+    m_entries.clear();
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+
+// Keeps objects alive until the GPU frames that may still reference them have completed.
+// Anything movable works, e.g. vk::Unique* handles, vkUniqueAllocation or vectors of them.
+class vkDeletionQueue
+{
+public:
+    vkDeletionQueue() = default;
+    virtual ~vkDeletionQueue() = default;
+
+    vkDeletionQueue(vkDeletionQueue const&) = delete;
+    vkDeletionQueue& operator=(vkDeletionQueue const&) = delete;
+
+    // frame: number of frames submitted so far, the object is released once that many frames completed
+    template <typename T>
+    void defer(uint64_t frame, T&& object)
+    {
+        m_entries.push_back({ frame, std::make_shared<typename std::decay<T>::type>(std::move(object)) });
+    }
+
+    void retire(uint64_t completedFrames);
+    void flush();
+
+    size_t size() const { return m_entries.size(); }
+
+private:
+    struct Entry
+    {
+        uint64_t frame;
+        std::shared_ptr<void> object;
+    };
+
+    std::deque<Entry> m_entries;
+};
@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <array>
+
+#include "vkDepthPyramid.h"
+
+const uint32_t vkDepthPyramid::kGroupSize;
+
+// Push constants of depthreduce.comp
+struct ReduceParams
+{
+    int32_t sourceWidth;
+    int32_t sourceHeight;
+    int32_t destinationWidth;
+    int32_t destinationHeight;
+};
+
+static_assert(sizeof(ReduceParams) == 16, "ReduceParams must match the push constants of depthreduce.comp");
+
+static uint32_t previousPowerOfTwo(uint32_t value)
+{
+    uint32_t result = 1;
+    while (result * 2 <= value) {
+        result *= 2;
+    }
+    return result;
+}
+
+static vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+vkDepthPyramid::vkDepthPyramid(vk::PhysicalDevice physicalDevice, vk::Device device, vkAllocator& allocator, vk::PipelineCache pipelineCache,
+                               const std::vector<uint32_t>& firstLevelCode, const std::vector<uint32_t>& reduceCode, vk::Format depthFormat, uint32_t frameCount)
+    : m_device(device), m_allocator(allocator), m_viewProj(1.0f)
+{
+    // Layout transitions of combined formats have to name both aspects
+    m_depthAspect = vk::ImageAspectFlagBits::eDepth;
+    if (depthFormat == vk::Format::eD32SfloatS8Uint || depthFormat == vk::Format::eD24UnormS8Uint) {
+        m_depthAspect |= vk::ImageAspectFlagBits::eStencil;
+    }
+
+    // Parameters and counters, written by the host and the culling shaders, one region per frame in flight
+    vk::DeviceSize alignment = std::max<vk::DeviceSize>(physicalDevice.getProperties().limits.minStorageBufferOffsetAlignment, 16);
+    m_regionSize = alignUp(sizeof(vkOcclusionRegion), alignment);
+    vk::BufferCreateInfo bufferInfo;
+    bufferInfo.setSize(m_regionSize * frameCount).setUsage(vk::BufferUsageFlagBits::eStorageBuffer).setSharingMode(vk::SharingMode::eExclusive);
+    m_regionBuffer = device.createBufferUnique(bufferInfo);
+    m_regionMemory = allocator.allocate(device.getBufferMemoryRequirements(*m_regionBuffer),
+                                        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, true);
+    device.bindBufferMemory(*m_regionBuffer, m_regionMemory->memory, m_regionMemory->offset);
+    for (uint32_t frame = 0; frame < frameCount; ++frame) {
+        *reinterpret_cast<vkOcclusionRegion*>(static_cast<char*>(m_regionMemory->pointer) + frame * m_regionSize) = vkOcclusionRegion{};
+    }
+
+    // Only texelFetch is used, the sampler just completes the combined descriptors
+    vk::SamplerCreateInfo samplerInfo;
+    samplerInfo.setMagFilter(vk::Filter::eNearest).setMinFilter(vk::Filter::eNearest).setMipmapMode(vk::SamplerMipmapMode::eNearest)
+        .setAddressModeU(vk::SamplerAddressMode::eClampToEdge).setAddressModeV(vk::SamplerAddressMode::eClampToEdge).setAddressModeW(vk::SamplerAddressMode::eClampToEdge)
+        .setMinLod(0.0f).setMaxLod(VK_LOD_CLAMP_NONE);
+    m_sampler = device.createSamplerUnique(samplerInfo);
+
+    std::array<vk::DescriptorSetLayoutBinding, 2> reduceBindings;
+    reduceBindings[0].setBinding(0).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eCombinedImageSampler).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    reduceBindings[1].setBinding(1).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eStorageImage).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    vk::DescriptorSetLayoutCreateInfo layoutInfo;
+    layoutInfo.setBindingCount(static_cast<uint32_t>(reduceBindings.size())).setPBindings(reduceBindings.data());
+    m_reduceLayout = device.createDescriptorSetLayoutUnique(layoutInfo);
+
+    std::array<vk::DescriptorSetLayoutBinding, 2> occlusionBindings;
+    occlusionBindings[0].setBinding(0).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eCombinedImageSampler).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    occlusionBindings[1].setBinding(1).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eStorageBufferDynamic).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    layoutInfo.setBindingCount(static_cast<uint32_t>(occlusionBindings.size())).setPBindings(occlusionBindings.data());
+    m_occlusionLayout = device.createDescriptorSetLayoutUnique(layoutInfo);
+
+    vk::PushConstantRange pushConstantRange(vk::ShaderStageFlagBits::eCompute, 0, sizeof(ReduceParams));
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo;
+    pipelineLayoutInfo.setSetLayoutCount(1).setPSetLayouts(&*m_reduceLayout).setPushConstantRangeCount(1).setPPushConstantRanges(&pushConstantRange);
+    m_pipelineLayout = device.createPipelineLayoutUnique(pipelineLayoutInfo);
+
+    auto createPipeline = [&](const std::vector<uint32_t>& shaderCode) {
+        auto shaderCreateInfo = vk::ShaderModuleCreateInfo{ {}, shaderCode.size() * sizeof(uint32_t), shaderCode.data() };
+        auto shaderModule = device.createShaderModuleUnique(shaderCreateInfo);
+        vk::PipelineShaderStageCreateInfo stageInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eCompute, *shaderModule, "main");
+
+        vk::ComputePipelineCreateInfo pipelineInfo;
+        pipelineInfo.setStage(stageInfo).setLayout(*m_pipelineLayout);
+        return device.createComputePipelineUnique(pipelineCache, pipelineInfo);
+    };
+    m_firstLevelPipeline = createPipeline(firstLevelCode);
+    m_reducePipeline = createPipeline(reduceCode);
+}
+
+vkDepthPyramid::~vkDepthPyramid()
+{
+}
+
+void vkDepthPyramid::resize(vk::ImageView depthView, uint32_t width, uint32_t height, vkDeletionQueue& deletionQueue, uint64_t frameNumber)
+{
+    deletionQueue.defer(frameNumber, std::move(m_descriptorPool));
+    deletionQueue.defer(frameNumber, std::move(m_levelViews));
+    deletionQueue.defer(frameNumber, std::move(m_view));
+    deletionQueue.defer(frameNumber, std::move(m_image));
+    deletionQueue.defer(frameNumber, std::move(m_imageMemory));
+    m_levelViews.clear();
+    m_reduceSets.clear();
+    m_valid = false;
+    m_layoutReady = false;
+
+    m_depthExtent = vk::Extent2D(width, height);
+    m_extent = vk::Extent2D(previousPowerOfTwo(width), previousPowerOfTwo(height));
+    uint32_t levels = 1;
+    while ((std::max(m_extent.width, m_extent.height) >> levels) > 0) {
+        ++levels;
+    }
+
+    vk::ImageCreateInfo imageInfo;
+    imageInfo.setImageType(vk::ImageType::e2D).setFormat(vk::Format::eR32Sfloat).setExtent(vk::Extent3D(m_extent.width, m_extent.height, 1))
+        .setMipLevels(levels).setArrayLayers(1).setSamples(vk::SampleCountFlagBits::e1).setTiling(vk::ImageTiling::eOptimal)
+        .setUsage(vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eStorage).setSharingMode(vk::SharingMode::eExclusive)
+        .setInitialLayout(vk::ImageLayout::eUndefined);
+    m_image = m_device.createImageUnique(imageInfo);
+    m_imageMemory = m_allocator.allocate(m_device.getImageMemoryRequirements(*m_image), vk::MemoryPropertyFlagBits::eDeviceLocal, false);
+    m_device.bindImageMemory(*m_image, m_imageMemory->memory, m_imageMemory->offset);
+
+    vk::ImageViewCreateInfo viewInfo;
+    viewInfo.setImage(*m_image).setViewType(vk::ImageViewType::e2D).setFormat(vk::Format::eR32Sfloat)
+        .setSubresourceRange(vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, levels, 0, 1));
+    m_view = m_device.createImageViewUnique(viewInfo);
+    for (uint32_t level = 0; level < levels; ++level) {
+        viewInfo.setSubresourceRange(vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, level, 1, 0, 1));
+        m_levelViews.push_back(m_device.createImageViewUnique(viewInfo));
+    }
+
+    // One reduction set per level and the occlusion set
+    std::array<vk::DescriptorPoolSize, 3> poolSize;
+    poolSize[0].setType(vk::DescriptorType::eCombinedImageSampler).setDescriptorCount(levels + 1);
+    poolSize[1].setType(vk::DescriptorType::eStorageImage).setDescriptorCount(levels);
+    poolSize[2].setType(vk::DescriptorType::eStorageBufferDynamic).setDescriptorCount(1);
+    vk::DescriptorPoolCreateInfo poolInfo;
+    poolInfo.setPoolSizeCount(static_cast<uint32_t>(poolSize.size())).setPPoolSizes(poolSize.data()).setMaxSets(levels + 1);
+    m_descriptorPool = m_device.createDescriptorPoolUnique(poolInfo);
+
+    std::vector<vk::DescriptorSetLayout> setLayouts(levels, *m_reduceLayout);
+    setLayouts.push_back(*m_occlusionLayout);
+    vk::DescriptorSetAllocateInfo allocInfo;
+    allocInfo.setDescriptorPool(*m_descriptorPool).setDescriptorSetCount(static_cast<uint32_t>(setLayouts.size())).setPSetLayouts(setLayouts.data());
+    m_reduceSets = m_device.allocateDescriptorSets(allocInfo);
+    m_occlusionSet = m_reduceSets.back();
+    m_reduceSets.pop_back();
+
+    std::vector<vk::DescriptorImageInfo> sourceInfos(levels);
+    std::vector<vk::DescriptorImageInfo> destinationInfos(levels);
+    std::vector<vk::WriteDescriptorSet> descriptorWrites;
+    for (uint32_t level = 0; level < levels; ++level) {
+        if (level == 0) {
+            sourceInfos[level].setSampler(*m_sampler).setImageView(depthView).setImageLayout(vk::ImageLayout::eDepthStencilReadOnlyOptimal);
+        } else {
+            sourceInfos[level].setSampler(*m_sampler).setImageView(*m_levelViews[level - 1]).setImageLayout(vk::ImageLayout::eGeneral);
+        }
+        destinationInfos[level].setImageView(*m_levelViews[level]).setImageLayout(vk::ImageLayout::eGeneral);
+        descriptorWrites.push_back(vk::WriteDescriptorSet().setDstSet(m_reduceSets[level]).setDstBinding(0)
+                                   .setDescriptorType(vk::DescriptorType::eCombinedImageSampler).setDescriptorCount(1).setPImageInfo(&sourceInfos[level]));
+        descriptorWrites.push_back(vk::WriteDescriptorSet().setDstSet(m_reduceSets[level]).setDstBinding(1)
+                                   .setDescriptorType(vk::DescriptorType::eStorageImage).setDescriptorCount(1).setPImageInfo(&destinationInfos[level]));
+    }
+    vk::DescriptorImageInfo pyramidInfo(*m_sampler, *m_view, vk::ImageLayout::eGeneral);
+    vk::DescriptorBufferInfo regionInfo(*m_regionBuffer, 0, sizeof(vkOcclusionRegion));
+    descriptorWrites.push_back(vk::WriteDescriptorSet().setDstSet(m_occlusionSet).setDstBinding(0)
+                               .setDescriptorType(vk::DescriptorType::eCombinedImageSampler).setDescriptorCount(1).setPImageInfo(&pyramidInfo));
+    descriptorWrites.push_back(vk::WriteDescriptorSet().setDstSet(m_occlusionSet).setDstBinding(1)
+                               .setDescriptorType(vk::DescriptorType::eStorageBufferDynamic).setDescriptorCount(1).setPBufferInfo(&regionInfo));
+    m_device.updateDescriptorSets(descriptorWrites, nullptr);
+}
+
+void vkDepthPyramid::collect(uint32_t frame)
+{
+    auto region = reinterpret_cast<const vkOcclusionRegion*>(static_cast<const char*>(m_regionMemory->pointer) + frame * m_regionSize);
+    m_stats = region->stats;
+}
+
+void vkDepthPyramid::prepare(vk::CommandBuffer commandBuffer, uint32_t frame, const glm::mat4& model)
+{
+    transitionPyramid(commandBuffer);
+
+    // The region is not in use by the GPU once the frame's fence passed, and host coherent
+    auto region = reinterpret_cast<vkOcclusionRegion*>(static_cast<char*>(m_regionMemory->pointer) + frame * m_regionSize);
+    region->viewProj = m_viewProj * model;
+    region->pyramidSize = glm::vec2(float(m_extent.width), float(m_extent.height));
+    region->pyramidLevels = levelCount();
+    region->valid = m_valid ? 1 : 0;
+    region->stats = vkCullStats{};
+}
+
+void vkDepthPyramid::build(vk::CommandBuffer commandBuffer, vk::Image depthImage, const glm::mat4& viewProj)
+{
+    transitionPyramid(commandBuffer);
+
+    // Depth writes of the render pass before the reads, and this frame's culling reads of the
+    // pyramid before it is overwritten
+    vk::ImageMemoryBarrier depthBarrier;
+    depthBarrier.setSrcAccessMask(vk::AccessFlagBits::eDepthStencilAttachmentWrite).setDstAccessMask(vk::AccessFlagBits::eShaderRead)
+        .setOldLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal).setNewLayout(vk::ImageLayout::eDepthStencilReadOnlyOptimal)
+        .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED).setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+        .setImage(depthImage).setSubresourceRange(vk::ImageSubresourceRange(m_depthAspect, 0, 1, 0, 1));
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests | vk::PipelineStageFlagBits::eComputeShader,
+                                  vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(), nullptr, nullptr, depthBarrier);
+
+    vk::MemoryBarrier levelBarrier;
+    levelBarrier.setSrcAccessMask(vk::AccessFlagBits::eShaderWrite).setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+
+    vk::Extent2D source = m_depthExtent;
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *m_firstLevelPipeline);
+    for (uint32_t level = 0; level < levelCount(); ++level) {
+        if (level == 1) {
+            commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *m_reducePipeline);
+        }
+        vk::Extent2D destination(std::max(m_extent.width >> level, 1u), std::max(m_extent.height >> level, 1u));
+        ReduceParams params = { int32_t(source.width), int32_t(source.height), int32_t(destination.width), int32_t(destination.height) };
+        commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *m_pipelineLayout, 0, m_reduceSets[level], nullptr);
+        commandBuffer.pushConstants(*m_pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(params), &params);
+        commandBuffer.dispatch((destination.width + kGroupSize - 1) / kGroupSize, (destination.height + kGroupSize - 1) / kGroupSize, 1);
+
+        // Also orders the last level before the next frame's culling
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(), levelBarrier, nullptr, nullptr);
+        source = destination;
+    }
+
+    // Back to an attachment before the next frame clears it
+    depthBarrier.setSrcAccessMask(vk::AccessFlagBits::eShaderRead)
+        .setDstAccessMask(vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite)
+        .setOldLayout(vk::ImageLayout::eDepthStencilReadOnlyOptimal).setNewLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests,
+                                  vk::DependencyFlags(), nullptr, nullptr, depthBarrier);
+
+    // Counters of this frame's culling, read by collect() after the fence
+    vk::MemoryBarrier hostBarrier;
+    hostBarrier.setSrcAccessMask(vk::AccessFlagBits::eShaderWrite).setDstAccessMask(vk::AccessFlagBits::eHostRead);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eHost, vk::DependencyFlags(), hostBarrier, nullptr, nullptr);
+
+    m_viewProj = viewProj;
+    m_valid = true;
+}
+
+void vkDepthPyramid::transitionPyramid(vk::CommandBuffer commandBuffer)
+{
+    // The pyramid stays in the general layout, for storage writes and sampled reads alike
+    if (m_layoutReady) {
+        return;
+    }
+    vk::ImageMemoryBarrier barrier;
+    barrier.setSrcAccessMask(vk::AccessFlags()).setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite)
+        .setOldLayout(vk::ImageLayout::eUndefined).setNewLayout(vk::ImageLayout::eGeneral)
+        .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED).setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+        .setImage(*m_image).setSubresourceRange(vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, levelCount(), 0, 1));
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(), nullptr, nullptr, barrier);
+    m_layoutReady = true;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstddef>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "vkAllocator.h"
+#include "vkDeletionQueue.h"
+
+// Counters of one culling dispatch, objects or meshlets depending on the pass that ran
+struct vkCullStats
+{
+    uint32_t culled = 0;            // Outside the frustum, or facing away for meshlets
+    uint32_t occluded = 0;          // Behind the depth pyramid
+    uint32_t drawn = 0;
+    uint32_t reserved = 0;
+};
+
+// Per frame region read by occlusion.glsl, laid out to match its Occlusion block
+struct vkOcclusionRegion
+{
+    glm::mat4 viewProj;
+    glm::vec2 pyramidSize;
+    uint32_t pyramidLevels;
+    uint32_t valid;
+    vkCullStats stats;
+};
+
+static_assert(offsetof(vkOcclusionRegion, pyramidSize) == 64 && offsetof(vkOcclusionRegion, pyramidLevels) == 72 && offsetof(vkOcclusionRegion, stats) == 80
+              && sizeof(vkOcclusionRegion) == 96, "vkOcclusionRegion must match the Occlusion block of occlusion.glsl");
+
+// Hierarchical depth buffer for occlusion culling.
+// After the main pass the depth attachment is reduced into a mip chain whose texels hold the
+// farthest depth they cover. The culling shaders of the next frame project their bounds with the
+// view projection the pyramid was built with, which reprojects the previous frame's depth onto
+// the current one, and drop everything behind it. Objects that become visible by camera motion
+// appear one frame late. The pyramid also carries the culled/occluded/drawn counters, which are
+// read back once the frame's fence has passed.
+class vkDepthPyramid
+{
+public:
+    // firstLevelCode reads the depth attachment, with DEPTH_SAMPLES when it is multisampled
+    vkDepthPyramid(vk::PhysicalDevice physicalDevice, vk::Device device, vkAllocator& allocator, vk::PipelineCache pipelineCache,
+                   const std::vector<uint32_t>& firstLevelCode, const std::vector<uint32_t>& reduceCode, vk::Format depthFormat, uint32_t frameCount);
+    virtual ~vkDepthPyramid();
+
+    vkDepthPyramid(vkDepthPyramid const&) = delete;
+    vkDepthPyramid& operator=(vkDepthPyramid const&) = delete;
+
+    // (Re)creates the pyramid for a depth attachment of the given size. Frames in flight may still
+    // use the previous one, it goes through the deletion queue.
+    void resize(vk::ImageView depthView, uint32_t width, uint32_t height, vkDeletionQueue& deletionQueue, uint64_t frameNumber);
+
+    // Reads the counters of the last submission of frame, its fence must have been waited on
+    void collect(uint32_t frame);
+    // Sets up the occlusion region of frame for bounds in the space of model, before the culling dispatches
+    void prepare(vk::CommandBuffer commandBuffer, uint32_t frame, const glm::mat4& model);
+    // Reduces the depth attachment rendered with viewProj, after the render pass ended
+    void build(vk::CommandBuffer commandBuffer, vk::Image depthImage, const glm::mat4& viewProj);
+
+    // Set 1 of the culling shaders compiled with OCCLUSION, the frame region is a dynamic offset
+    vk::DescriptorSetLayout occlusionLayout() const { return *m_occlusionLayout; }
+    vk::DescriptorSet occlusionSet() const { return m_occlusionSet; }
+    uint32_t occlusionOffset(uint32_t frame) const { return static_cast<uint32_t>(frame * m_regionSize); }
+
+    const vkCullStats& stats() const { return m_stats; }
+    uint32_t levelCount() const { return static_cast<uint32_t>(m_levelViews.size()); }
+
+    static const uint32_t kGroupSize = 8;
+
+private:
+    void transitionPyramid(vk::CommandBuffer commandBuffer);
+
+private:
+    vk::Device m_device;
+    vkAllocator& m_allocator;
+    vk::ImageAspectFlags m_depthAspect;
+    vk::Extent2D m_depthExtent;
+    vk::Extent2D m_extent;          // Level 0, the attachment size rounded down to powers of two
+
+    glm::mat4 m_viewProj;
+    bool m_valid = false;
+    bool m_layoutReady = false;
+    vkCullStats m_stats;
+
+    vk::DeviceSize m_regionSize;
+    vk::UniqueBuffer m_regionBuffer;
+    vkUniqueAllocation m_regionMemory;
+
+    vk::UniqueImage m_image;
+    vkUniqueAllocation m_imageMemory;
+    vk::UniqueImageView m_view;
+    std::vector<vk::UniqueImageView> m_levelViews;
+    vk::UniqueSampler m_sampler;
+
+    // Recreated with the pyramid, the sets are owned by the pool
+    vk::UniqueDescriptorPool m_descriptorPool;
+    std::vector<vk::DescriptorSet> m_reduceSets;
+    vk::DescriptorSet m_occlusionSet;
+
+    vk::UniqueDescriptorSetLayout m_reduceLayout;
+    vk::UniqueDescriptorSetLayout m_occlusionLayout;
+    vk::UniquePipelineLayout m_pipelineLayout;
+    vk::UniquePipeline m_firstLevelPipeline;
+    vk::UniquePipeline m_reducePipeline;
+};
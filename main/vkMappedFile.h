@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read only memory mapping of a whole file. The view stays valid for the lifetime of the object.
+class vkMappedFile
+{
+public:
+    vkMappedFile() = default;
+    explicit vkMappedFile(const std::string& fileName);
+    virtual ~vkMappedFile();
+
+    vkMappedFile(vkMappedFile const&) = delete;
+    vkMappedFile& operator=(vkMappedFile const&) = delete;
+
+    bool open(const std::string& fileName);
+    void close();
+
+    bool isOpen() const { return m_opened; }
+    const char* data() const { return static_cast<const char*>(m_data); }
+    size_t size() const { return m_size; }
+
+private:
+    void* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_opened = false;     // Empty files open fine but have nothing to map
+#if defined(_WIN32)
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+#endif
+};
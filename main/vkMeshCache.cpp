@@ -0,0 +1,191 @@
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <direct.h>
+#define mesh_mkdir(path) _mkdir(path)
+#else
+#define mesh_mkdir(path) mkdir(path, 0755)
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "vkMeshCache.h"
+
+const uint32_t vkMeshLayout::kMaxAttributes;
+
+vkMeshLayout vkMeshLayout::make(const vk::VertexInputBindingDescription& binding, const vk::VertexInputAttributeDescription* attributes, uint32_t count)
+{
+    vkMeshLayout layout;
+    layout.stride = binding.stride;
+    layout.attributeCount = std::min(count, kMaxAttributes);
+    for (uint32_t i = 0; i < layout.attributeCount; ++i) {
+        layout.attributes[i].location = attributes[i].location;
+        layout.attributes[i].format = static_cast<uint32_t>(attributes[i].format);
+        layout.attributes[i].offset = attributes[i].offset;
+    }
+    return layout;
+}
+
+bool vkMeshLayout::operator==(const vkMeshLayout& other) const
+{
+    if (stride != other.stride || attributeCount != other.attributeCount) {
+        return false;
+    }
+    for (uint32_t i = 0; i < attributeCount; ++i) {
+        const vkMeshAttribute& a = attributes[i];
+        const vkMeshAttribute& b = other.attributes[i];
+        if (a.location != b.location || a.format != b.format || a.offset != b.offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+vkMeshSource vkMeshSource::fromFile(const std::string& fileName)
+{
+    vkMeshSource source;
+    struct stat buffer;
+    if (stat(fileName.c_str(), &buffer) == 0) {
+        source.size = static_cast<uint64_t>(buffer.st_size);
+        source.time = static_cast<uint64_t>(buffer.st_mtime);
+    }
+    return source;
+}
+
+vkMeshCache::~vkMeshCache()
+{
+    close();
+}
+
+bool vkMeshCache::open(const std::string& fileName, const vkMeshLayout& layout, const vkMeshSource& source, uint32_t flags, uint64_t settings)
+{
+    close();
+
+    if (!m_file.open(fileName) || m_file.size() < sizeof(vkMeshCacheHeader)) {
+        m_file.close();
+        return false;
+    }
+
+    const vkMeshCacheHeader* header = reinterpret_cast<const vkMeshCacheHeader*>(m_file.data());
+    uint64_t fileSize = m_file.size();
+    bool valid = header->magic == kMagic && header->version == kVersion && header->headerSize == sizeof(vkMeshCacheHeader)
+        && header->flags == flags && header->settings == settings
+        && header->sourceSize == source.size && header->sourceTime == source.time
+        && header->layout == layout
+        && (header->indexSize == 2 || header->indexSize == 4)
+        && header->vertexBytes == uint64_t(header->vertexCount) * layout.stride
+        && header->indexBytes == uint64_t(header->indexCount) * header->indexSize
+        && header->vertexOffset + header->vertexBytes <= fileSize
+        && header->indexOffset + header->indexBytes <= fileSize
+        && header->blobCount <= sizeof(header->blobs) / sizeof(header->blobs[0]);
+    for (uint32_t i = 0; valid && i < header->blobCount; ++i) {
+        valid = header->blobs[i].offset + header->blobs[i].bytes <= fileSize;
+    }
+    if (!valid) {
+        m_file.close();
+        return false;
+    }
+
+    m_header = header;
+    return true;
+}
+
+const void* vkMeshCache::blobData(uint32_t id, uint64_t& bytes) const
+{
+    for (uint32_t i = 0; i < m_header->blobCount; ++i) {
+        if (m_header->blobs[i].id == id) {
+            bytes = m_header->blobs[i].bytes;
+            return m_file.data() + m_header->blobs[i].offset;
+        }
+    }
+    bytes = 0;
+    return nullptr;
+}
+
+void vkMeshCache::close()
+{
+    m_header = nullptr;
+    m_file.close();
+}
+
+bool vkMeshCache::write(const std::string& fileName, const vkMeshLayout& layout, const vkMeshSource& source, uint32_t flags, uint64_t settings,
+                        const void* vertices, uint32_t vertexCount, const void* indices, uint32_t indexCount, uint32_t indexSize,
+                        const glm::vec3& boundsMin, const glm::vec3& boundsMax, const std::vector<vkMeshCacheBlobData>& blobs)
+{
+    const uint32_t maxBlobs = sizeof(vkMeshCacheHeader::blobs) / sizeof(vkMeshCacheHeader::blobs[0]);
+    if (blobs.size() > maxBlobs) {
+        return false;
+    }
+
+    auto align = [](uint64_t offset) { return (offset + kBlobAlignment - 1) & ~(kBlobAlignment - 1); };
+
+    vkMeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.flags = flags;
+    header.headerSize = sizeof(vkMeshCacheHeader);
+    header.sourceSize = source.size;
+    header.sourceTime = source.time;
+    header.settings = settings;
+    header.layout = layout;
+    header.vertexCount = vertexCount;
+    header.indexCount = indexCount;
+    header.indexSize = indexSize;
+    header.vertexBytes = uint64_t(vertexCount) * layout.stride;
+    header.indexBytes = uint64_t(indexCount) * indexSize;
+    header.vertexOffset = align(sizeof(vkMeshCacheHeader));
+    header.indexOffset = align(header.vertexOffset + header.vertexBytes);
+    for (int i = 0; i < 3; ++i) {
+        header.boundsMin[i] = boundsMin[i];
+        header.boundsMax[i] = boundsMax[i];
+    }
+    uint64_t end = header.indexOffset + header.indexBytes;
+    header.blobCount = static_cast<uint32_t>(blobs.size());
+    for (uint32_t i = 0; i < header.blobCount; ++i) {
+        header.blobs[i].id = blobs[i].id;
+        header.blobs[i].offset = align(end);
+        header.blobs[i].bytes = blobs[i].bytes;
+        end = header.blobs[i].offset + header.blobs[i].bytes;
+    }
+
+    size_t slash = fileName.find_last_of("/\\");
+    if (slash != std::string::npos) {
+        struct stat buffer;
+        std::string dir = fileName.substr(0, slash);
+        if (stat(dir.c_str(), &buffer) != 0) {
+            mesh_mkdir(dir.c_str());
+        }
+    }
+
+    // Written next to the target and renamed, so a crash never leaves a half written cache behind
+    std::string tempName = fileName + ".tmp";
+    {
+        std::ofstream file(tempName, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            return false;
+        }
+        const char padding[kBlobAlignment] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(padding, header.vertexOffset - sizeof(header));
+        file.write(static_cast<const char*>(vertices), header.vertexBytes);
+        file.write(padding, header.indexOffset - (header.vertexOffset + header.vertexBytes));
+        file.write(static_cast<const char*>(indices), header.indexBytes);
+        end = header.indexOffset + header.indexBytes;
+        for (uint32_t i = 0; i < header.blobCount; ++i) {
+            file.write(padding, header.blobs[i].offset - end);
+            file.write(static_cast<const char*>(blobs[i].data), header.blobs[i].bytes);
+            end = header.blobs[i].offset + header.blobs[i].bytes;
+        }
+        if (!file) {
+            file.close();
+            std::remove(tempName.c_str());
+            return false;
+        }
+    }
+
+    std::remove(fileName.c_str());
+    return std::rename(tempName.c_str(), fileName.c_str()) == 0;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "vkMappedFile.h"
+
+struct vkMeshAttribute
+{
+    uint32_t location;
+    uint32_t format;        // VkFormat
+    uint32_t offset;
+};
+
+struct vkMeshLayout
+{
+    static const uint32_t kMaxAttributes = 8;
+
+    uint32_t stride = 0;
+    uint32_t attributeCount = 0;
+    vkMeshAttribute attributes[kMaxAttributes] = {};
+
+    static vkMeshLayout make(const vk::VertexInputBindingDescription& binding, const vk::VertexInputAttributeDescription* attributes, uint32_t count);
+    bool operator==(const vkMeshLayout& other) const;
+};
+
+// Optional data stored after the vertex and index blobs, e.g. meshlets
+struct vkMeshCacheBlob
+{
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+struct vkMeshCacheBlobData
+{
+    uint32_t id;
+    const void* data;
+    uint64_t bytes;
+};
+
+// On disk header, every blob offset is a multiple of kBlobAlignment from the file start
+struct vkMeshCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t headerSize;
+    uint64_t sourceSize;        // Size and modification time of the imported file
+    uint64_t sourceTime;
+    uint64_t settings;          // Hash of the processing parameters, e.g. LOD and meshlet limits
+    vkMeshLayout layout;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t indexSize;         // 2 or 4 bytes
+    uint32_t reserved;
+    uint64_t vertexOffset;
+    uint64_t vertexBytes;
+    uint64_t indexOffset;
+    uint64_t indexBytes;
+    float boundsMin[3];
+    float boundsMax[3];
+    uint32_t blobCount;
+    vkMeshCacheBlob blobs[4];
+};
+
+struct vkMeshSource
+{
+    uint64_t size = 0;
+    uint64_t time = 0;
+
+    static vkMeshSource fromFile(const std::string& fileName);
+};
+
+// Binary mesh cache written once after a model import.
+// Later runs map the file and hand the vertex and index blobs straight to the staging copy, so a
+// cached model needs neither parsing nor an intermediate CPU copy. A cache is only accepted when
+// magic, version, vertex layout, processing flags and settings and the source file stamp all match.
+class vkMeshCache
+{
+public:
+    static const uint32_t kMagic = 0x434d4b56;   // "VKMC"
+    static const uint32_t kVersion = 5;
+    static const uint64_t kBlobAlignment = 64;
+
+    // Optional blob ids
+    static const uint32_t kBlobMeshlets = 1;
+    static const uint32_t kBlobLods = 2;
+
+    // Processing applied before the mesh was written, part of the cache validity check
+    static const uint32_t kFlagOptimized = 1 << 0;
+    static const uint32_t kFlagLods = 1 << 1;
+
+    vkMeshCache() = default;
+    virtual ~vkMeshCache();
+
+    vkMeshCache(vkMeshCache const&) = delete;
+    vkMeshCache& operator=(vkMeshCache const&) = delete;
+
+    bool open(const std::string& fileName, const vkMeshLayout& layout, const vkMeshSource& source, uint32_t flags, uint64_t settings);
+    void close();
+
+    static bool write(const std::string& fileName, const vkMeshLayout& layout, const vkMeshSource& source, uint32_t flags, uint64_t settings,
+                      const void* vertices, uint32_t vertexCount, const void* indices, uint32_t indexCount, uint32_t indexSize,
+                      const glm::vec3& boundsMin, const glm::vec3& boundsMax, const std::vector<vkMeshCacheBlobData>& blobs = {});
+
+    bool isOpen() const { return m_header != nullptr; }
+    const vkMeshCacheHeader& header() const { return *m_header; }
+    const void* vertexData() const { return m_file.data() + m_header->vertexOffset; }
+    const void* indexData() const { return m_file.data() + m_header->indexOffset; }
+    // nullptr when the cache has no blob with this id
+    const void* blobData(uint32_t id, uint64_t& bytes) const;
+    glm::vec3 boundsMin() const { return glm::vec3(m_header->boundsMin[0], m_header->boundsMin[1], m_header->boundsMin[2]); }
+    glm::vec3 boundsMax() const { return glm::vec3(m_header->boundsMax[0], m_header->boundsMax[1], m_header->boundsMax[2]); }
+
+private:
+    vkMappedFile m_file;
+    const vkMeshCacheHeader* m_header = nullptr;
+};
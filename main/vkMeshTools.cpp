@@ -0,0 +1,769 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <limits>
+
+#include "glm/glm.hpp"
+
+#include "vkMeshTools.h"
+#include "vkThreadPool.h"
+
+namespace
+{
+    const uint32_t kEmptySlot = 0xffffffffu;
+
+    struct DedupSlot
+    {
+        uint32_t index;
+        uint32_t hash;      // Low hash bits, rejects most mismatches without touching the vertex
+    };
+
+    inline uint64_t rotl64(uint64_t x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t mix64(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+
+    size_t tableCapacity(size_t count)
+    {
+        // A load factor of at most one half keeps linear probe sequences short
+        size_t capacity = 16;
+        while (capacity < count * 2) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    template <typename F>
+    void parallelRange(size_t count, size_t taskCount, F func)
+    {
+        std::vector<std::future<void>> tasks;
+        size_t step = (count + taskCount - 1) / taskCount;
+        for (size_t begin = 0; begin < count; begin += step) {
+            size_t end = std::min(count, begin + step);
+            tasks.push_back(vkThreadPool::instance()->enqueue([begin, end, &func]() { func(begin, end); }));
+        }
+        for (auto& task : tasks) {
+            task.get();
+        }
+    }
+
+    // Symmetric plane quadric, the error of a point is its weighted squared distance to the planes
+    struct Quadric
+    {
+        float a2, b2, c2, d2;
+        float ab, ac, ad, bc, bd, cd;
+        float weight;
+    };
+
+    Quadric planeQuadric(const glm::vec3& n, float d, float weight)
+    {
+        Quadric q;
+        q.a2 = n.x * n.x * weight;
+        q.b2 = n.y * n.y * weight;
+        q.c2 = n.z * n.z * weight;
+        q.d2 = d * d * weight;
+        q.ab = n.x * n.y * weight;
+        q.ac = n.x * n.z * weight;
+        q.ad = n.x * d * weight;
+        q.bc = n.y * n.z * weight;
+        q.bd = n.y * d * weight;
+        q.cd = n.z * d * weight;
+        q.weight = weight;
+        return q;
+    }
+
+    void quadricAdd(Quadric& q, const Quadric& r)
+    {
+        q.a2 += r.a2; q.b2 += r.b2; q.c2 += r.c2; q.d2 += r.d2;
+        q.ab += r.ab; q.ac += r.ac; q.ad += r.ad;
+        q.bc += r.bc; q.bd += r.bd; q.cd += r.cd;
+        q.weight += r.weight;
+    }
+
+    // Mean squared distance to the planes of the quadric
+    float quadricError(const Quadric& q, const glm::vec3& p)
+    {
+        float rx = q.a2 * p.x + q.ab * p.y + q.ac * p.z + q.ad;
+        float ry = q.ab * p.x + q.b2 * p.y + q.bc * p.z + q.bd;
+        float rz = q.ac * p.x + q.bc * p.y + q.c2 * p.z + q.cd;
+        float r = rx * p.x + ry * p.y + rz * p.z + q.ad * p.x + q.bd * p.y + q.cd * p.z + q.d2;
+        return (q.weight > 0.0f) ? std::fabs(r) / q.weight : 0.0f;
+    }
+
+    // Finds the first occurrence of every vertex in `order` (ascending input indices).
+    // representative[i] is set to that first index for every i in order.
+    void findRepresentatives(const uint8_t* vertices, size_t stride, const uint64_t* hashes, const uint32_t* order, size_t count, uint32_t* representative)
+    {
+        // Meshes typically have far fewer unique vertices than corners, start small and grow
+        std::vector<DedupSlot> table(tableCapacity(count / 8), DedupSlot{ kEmptySlot, 0 });
+        size_t mask = table.size() - 1;
+        size_t filled = 0;
+
+        for (size_t n = 0; n < count; ++n) {
+            uint32_t i = order[n];
+            uint64_t hash = hashes[i];
+            uint32_t shortHash = static_cast<uint32_t>(hash);
+            for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+                DedupSlot& entry = table[slot];
+                if (entry.index == kEmptySlot) {
+                    entry.index = i;
+                    entry.hash = shortHash;
+                    representative[i] = i;
+                    ++filled;
+                    break;
+                }
+                if (entry.hash == shortHash && memcmp(vertices + size_t(entry.index) * stride, vertices + size_t(i) * stride, stride) == 0) {
+                    representative[i] = entry.index;
+                    break;
+                }
+            }
+
+            if (filled * 2 > table.size()) {
+                std::vector<DedupSlot> grown(table.size() * 2, DedupSlot{ kEmptySlot, 0 });
+                mask = grown.size() - 1;
+                for (const auto& entry : table) {
+                    if (entry.index != kEmptySlot) {
+                        size_t slot = hashes[entry.index] & mask;
+                        while (grown[slot].index != kEmptySlot) {
+                            slot = (slot + 1) & mask;
+                        }
+                        grown[slot] = entry;
+                    }
+                }
+                table.swap(grown);
+            }
+        }
+    }
+}
+
+const uint32_t vkMeshTools::kVertexCacheSize;
+const size_t vkMeshTools::kParallelDedupThreshold;
+const uint32_t vkMeshTools::kUnused;
+const uint32_t vkMeshTools::kMeshletMaxVertices;
+const uint32_t vkMeshTools::kMeshletMaxTriangles;
+
+uint64_t vkMeshTools::hashBytes(const void* data, size_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ (size * 0xff51afd7ed558ccdull);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = rotl64(hash ^ mix64(word), 29) * 0x9e3779b97f4a7c15ull;
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, size - i);
+        hash = rotl64(hash ^ mix64(word), 29) * 0x9e3779b97f4a7c15ull;
+    }
+
+    return mix64(hash);
+}
+
+uint32_t vkMeshTools::generateVertexRemap(const void* vertices, size_t vertexCount, size_t vertexStride, std::vector<uint32_t>& remap)
+{
+    const uint8_t* data = static_cast<const uint8_t*>(vertices);
+    remap.resize(vertexCount);
+
+    std::vector<uint64_t> hashes(vertexCount);
+    std::vector<uint32_t> representative(vertexCount);
+    uint32_t workers = vkThreadPool::instance()->size();
+
+    if (vertexCount < kParallelDedupThreshold || workers < 2) {
+        for (size_t i = 0; i < vertexCount; ++i) {
+            hashes[i] = hashBytes(data + i * vertexStride, vertexStride);
+        }
+        std::vector<uint32_t> order(vertexCount);
+        for (size_t i = 0; i < vertexCount; ++i) {
+            order[i] = static_cast<uint32_t>(i);
+        }
+        findRepresentatives(data, vertexStride, hashes.data(), order.data(), vertexCount, representative.data());
+    } else {
+        parallelRange(vertexCount, workers * 4, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                hashes[i] = hashBytes(data + i * vertexStride, vertexStride);
+            }
+        });
+
+        // Equal vertices hash alike, so shards keyed by the top hash bits never share a vertex.
+        // A counting sort keeps every shard in ascending input order.
+        const uint32_t shardBits = 6;
+        const uint32_t shardCount = 1u << shardBits;
+        std::vector<size_t> shardBegin(shardCount + 1, 0);
+        for (size_t i = 0; i < vertexCount; ++i) {
+            ++shardBegin[(hashes[i] >> (64 - shardBits)) + 1];
+        }
+        for (uint32_t s = 0; s < shardCount; ++s) {
+            shardBegin[s + 1] += shardBegin[s];
+        }
+        std::vector<uint32_t> order(vertexCount);
+        std::vector<size_t> cursor(shardBegin.begin(), shardBegin.end() - 1);
+        for (size_t i = 0; i < vertexCount; ++i) {
+            order[cursor[hashes[i] >> (64 - shardBits)]++] = static_cast<uint32_t>(i);
+        }
+
+        parallelRange(shardCount, shardCount, [&](size_t begin, size_t end) {
+            for (size_t s = begin; s < end; ++s) {
+                findRepresentatives(data, vertexStride, hashes.data(), order.data() + shardBegin[s], shardBegin[s + 1] - shardBegin[s], representative.data());
+            }
+        });
+    }
+
+    // Representatives always precede their duplicates, so one ordered pass assigns final indices
+    uint32_t uniqueCount = 0;
+    for (size_t i = 0; i < vertexCount; ++i) {
+        remap[i] = (representative[i] == i) ? uniqueCount++ : remap[representative[i]];
+    }
+
+    return uniqueCount;
+}
+
+void vkMeshTools::remapVertexBuffer(void* destination, const void* vertices, size_t vertexCount, size_t vertexStride, const std::vector<uint32_t>& remap)
+{
+    uint8_t* dst = static_cast<uint8_t*>(destination);
+    const uint8_t* src = static_cast<const uint8_t*>(vertices);
+    for (size_t i = 0; i < vertexCount; ++i) {
+        if (remap[i] != kUnused) {
+            memcpy(dst + size_t(remap[i]) * vertexStride, src + i * vertexStride, vertexStride);
+        }
+    }
+}
+
+void vkMeshTools::remapIndexBuffer(uint32_t* indices, size_t indexCount, const std::vector<uint32_t>& remap)
+{
+    for (size_t i = 0; i < indexCount; ++i) {
+        indices[i] = remap[indices[i]];
+    }
+}
+
+vkVertexCacheStats vkMeshTools::analyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, uint32_t cacheSize)
+{
+    vkVertexCacheStats stats;
+    if (indexCount < 3 || vertexCount == 0) {
+        return stats;
+    }
+
+    // A vertex is in the FIFO when it was pushed less than cacheSize pushes ago
+    std::vector<uint64_t> pushTime(vertexCount, 0);
+    uint64_t time = uint64_t(cacheSize) + 1;
+    size_t misses = 0;
+    std::vector<bool> referenced(vertexCount, false);
+    size_t referencedCount = 0;
+
+    for (size_t i = 0; i < indexCount; ++i) {
+        uint32_t v = indices[i];
+        if (time - pushTime[v] > cacheSize) {
+            pushTime[v] = time++;
+            ++misses;
+        }
+        if (!referenced[v]) {
+            referenced[v] = true;
+            ++referencedCount;
+        }
+    }
+
+    stats.acmr = float(misses) / float(indexCount / 3);
+    stats.atvr = referencedCount ? float(misses) / float(referencedCount) : 0.0f;
+    return stats;
+}
+
+void vkMeshTools::optimizeVertexCache(uint32_t* destination, const uint32_t* indices, size_t indexCount, size_t vertexCount,
+                                      uint32_t cacheSize, std::vector<uint32_t>* clusters, float threshold)
+{
+    size_t triangleCount = indexCount / 3;
+    std::vector<uint32_t> output;
+    output.reserve(indexCount);
+
+    // Vertex to triangle adjacency
+    std::vector<uint32_t> live(vertexCount, 0);
+    for (size_t i = 0; i < indexCount; ++i) {
+        ++live[indices[i]];
+    }
+    std::vector<uint32_t> adjacencyOffset(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; ++v) {
+        adjacencyOffset[v + 1] = adjacencyOffset[v] + live[v];
+    }
+    std::vector<uint32_t> adjacency(indexCount);
+    {
+        std::vector<uint32_t> cursor(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+        for (size_t i = 0; i < indexCount; ++i) {
+            adjacency[cursor[indices[i]]++] = static_cast<uint32_t>(i / 3);
+        }
+    }
+
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> hardBoundaries;
+    uint32_t time = cacheSize + 1;
+    size_t cursor = 0;
+
+    auto skipDeadEnd = [&]() -> int64_t {
+        while (!deadEnd.empty()) {
+            uint32_t v = deadEnd.back();
+            deadEnd.pop_back();
+            if (live[v] > 0) {
+                return v;
+            }
+        }
+        while (cursor < vertexCount) {
+            if (live[cursor] > 0) {
+                return static_cast<int64_t>(cursor);
+            }
+            ++cursor;
+        }
+        return -1;
+    };
+
+    int64_t fanning = skipDeadEnd();
+    while (fanning >= 0) {
+        candidates.clear();
+        uint32_t f = static_cast<uint32_t>(fanning);
+        for (uint32_t a = adjacencyOffset[f]; a < adjacencyOffset[f + 1]; ++a) {
+            uint32_t t = adjacency[a];
+            if (emitted[t]) {
+                continue;
+            }
+            emitted[t] = true;
+            for (int k = 0; k < 3; ++k) {
+                uint32_t v = indices[t * 3 + k];
+                output.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                if (time - cacheTime[v] > cacheSize) {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        // Prefer the candidate that stays in cache longest while it still has triangles left
+        int64_t next = -1;
+        int64_t best = -1;
+        for (uint32_t v : candidates) {
+            if (live[v] == 0) {
+                continue;
+            }
+            int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize) {
+                priority = time - cacheTime[v];
+            }
+            if (priority > best) {
+                best = priority;
+                next = v;
+            }
+        }
+        if (next < 0) {
+            next = skipDeadEnd();
+            hardBoundaries.push_back(static_cast<uint32_t>(output.size() / 3));
+        }
+        fanning = next;
+    }
+
+    std::copy(output.begin(), output.end(), destination);
+    if (!clusters) {
+        return;
+    }
+
+    // Split hard clusters further wherever their ACMR is already good enough
+    float meshAcmr = analyzeVertexCache(destination, indexCount, vertexCount, cacheSize).acmr;
+    const uint32_t minClusterTriangles = 32;
+    clusters->clear();
+    std::vector<uint32_t> pushTime(vertexCount, 0);
+    uint32_t clusterTime = cacheSize + 1;
+    uint32_t start = 0;
+    uint32_t misses = 0;
+    size_t hard = 0;
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        if (t == start) {
+            clusters->push_back(t);
+            clusterTime += cacheSize + 1;   // Start every cluster with a cold cache
+        }
+        for (int k = 0; k < 3; ++k) {
+            uint32_t v = destination[t * 3 + k];
+            if (clusterTime - pushTime[v] > cacheSize) {
+                pushTime[v] = clusterTime++;
+                ++misses;
+            }
+        }
+        while (hard < hardBoundaries.size() && hardBoundaries[hard] <= t) {
+            ++hard;
+        }
+        uint32_t size = t + 1 - start;
+        bool hardBoundary = hard < hardBoundaries.size() && hardBoundaries[hard] == t + 1;
+        if (hardBoundary || (size >= minClusterTriangles && float(misses) / size <= threshold * meshAcmr)) {
+            start = t + 1;
+            misses = 0;
+        }
+    }
+}
+
+void vkMeshTools::optimizeOverdraw(uint32_t* destination, const uint32_t* indices, size_t indexCount, const float* positions, size_t vertexStride,
+                                   const std::vector<uint32_t>& clusters)
+{
+    size_t triangleCount = indexCount / 3;
+    auto position = [&](uint32_t v) {
+        const float* p = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(positions) + size_t(v) * vertexStride);
+        return glm::vec3(p[0], p[1], p[2]);
+    };
+
+    struct ClusterKey
+    {
+        float sort;
+        uint32_t begin;
+        uint32_t end;
+    };
+    std::vector<ClusterKey> keys(clusters.size());
+
+    glm::vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+    std::vector<glm::vec3> centroids(clusters.size());
+    std::vector<glm::vec3> normals(clusters.size());
+    for (size_t c = 0; c < clusters.size(); ++c) {
+        keys[c].begin = clusters[c];
+        keys[c].end = (c + 1 < clusters.size()) ? clusters[c + 1] : static_cast<uint32_t>(triangleCount);
+
+        glm::vec3 centroid(0.0f);
+        glm::vec3 normal(0.0f);
+        float area = 0.0f;
+        for (uint32_t t = keys[c].begin; t < keys[c].end; ++t) {
+            glm::vec3 p0 = position(indices[t * 3 + 0]);
+            glm::vec3 p1 = position(indices[t * 3 + 1]);
+            glm::vec3 p2 = position(indices[t * 3 + 2]);
+            glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+            float a = glm::length(n);
+            centroid += (p0 + p1 + p2) * (a / 3.0f);
+            normal += n;
+            area += a;
+        }
+        centroids[c] = area > 0.0f ? centroid / area : position(indices[keys[c].begin * 3]);
+        float length = glm::length(normal);
+        normals[c] = length > 0.0f ? normal / length : glm::vec3(0.0f);
+        meshCentroid += centroid;
+        meshArea += area;
+    }
+    if (meshArea > 0.0f) {
+        meshCentroid /= meshArea;
+    }
+
+    for (size_t c = 0; c < clusters.size(); ++c) {
+        keys[c].sort = glm::dot(centroids[c] - meshCentroid, normals[c]);
+    }
+    std::stable_sort(keys.begin(), keys.end(), [](const ClusterKey& a, const ClusterKey& b) { return a.sort > b.sort; });
+
+    std::vector<uint32_t> output;
+    output.reserve(indexCount);
+    for (const auto& key : keys) {
+        output.insert(output.end(), indices + key.begin * 3, indices + key.end * 3);
+    }
+    std::copy(output.begin(), output.end(), destination);
+}
+
+uint32_t vkMeshTools::optimizeVertexFetchRemap(std::vector<uint32_t>& remap, const uint32_t* indices, size_t indexCount, size_t vertexCount)
+{
+    remap.assign(vertexCount, kUnused);
+    uint32_t next = 0;
+    for (size_t i = 0; i < indexCount; ++i) {
+        if (remap[indices[i]] == kUnused) {
+            remap[indices[i]] = next++;
+        }
+    }
+    return next;
+}
+
+void vkMeshTools::buildMeshlets(std::vector<vkMeshlet>& meshlets, const uint32_t* indices, size_t indexCount, const float* positions, size_t vertexCount,
+                                size_t vertexStride, uint32_t maxVertices, uint32_t maxTriangles)
+{
+    auto position = [&](uint32_t v) {
+        const float* p = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(positions) + size_t(v) * vertexStride);
+        return glm::vec3(p[0], p[1], p[2]);
+    };
+
+    meshlets.clear();
+
+    // Unique vertex count per meshlet, a vertex belongs to the current one when its stamp matches
+    std::vector<uint32_t> stamp(vertexCount, kUnused);
+    vkMeshlet current = {};
+    auto flush = [&](size_t end) {
+        if (end > current.firstIndex) {
+            current.indexCount = static_cast<uint32_t>(end) - current.firstIndex;
+            meshlets.push_back(current);
+        }
+        current = {};
+        current.firstIndex = static_cast<uint32_t>(end);
+    };
+
+    for (size_t t = 0; t + 2 < indexCount; t += 3) {
+        uint32_t meshlet = static_cast<uint32_t>(meshlets.size());
+        uint32_t added = (stamp[indices[t]] != meshlet) + (stamp[indices[t + 1]] != meshlet) + (stamp[indices[t + 2]] != meshlet);
+        if (current.vertexCount + added > maxVertices || (t - current.firstIndex) / 3 + 1 > maxTriangles) {
+            flush(t);
+            meshlet = static_cast<uint32_t>(meshlets.size());
+        }
+        for (size_t i = t; i < t + 3; ++i) {
+            if (stamp[indices[i]] != meshlet) {
+                stamp[indices[i]] = meshlet;
+                ++current.vertexCount;
+            }
+        }
+    }
+    flush(indexCount - indexCount % 3);
+
+    for (auto& meshlet : meshlets) {
+        const uint32_t* begin = indices + meshlet.firstIndex;
+        const uint32_t* end = begin + meshlet.indexCount;
+
+        glm::vec3 boundsMin(std::numeric_limits<float>::max());
+        glm::vec3 boundsMax(-std::numeric_limits<float>::max());
+        for (const uint32_t* i = begin; i < end; ++i) {
+            boundsMin = glm::min(boundsMin, position(*i));
+            boundsMax = glm::max(boundsMax, position(*i));
+        }
+        glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+        float radius = 0.0f;
+        for (const uint32_t* i = begin; i < end; ++i) {
+            radius = std::max(radius, glm::length(position(*i) - center));
+        }
+
+        // Cone around the average face normal, the half angle is set by the furthest normal
+        std::vector<glm::vec3> normals;
+        normals.reserve(meshlet.indexCount / 3);
+        glm::vec3 axis(0.0f);
+        for (const uint32_t* i = begin; i < end; i += 3) {
+            glm::vec3 p0 = position(i[0]);
+            glm::vec3 n = glm::cross(position(i[1]) - p0, position(i[2]) - p0);
+            float length = glm::length(n);
+            if (length > 0.0f) {
+                normals.push_back(n / length);
+                axis += normals.back();
+            }
+        }
+        float axisLength = glm::length(axis);
+        float minDot = -1.0f;
+        if (axisLength > 0.0f) {
+            axis /= axisLength;
+            minDot = 1.0f;
+            for (const auto& n : normals) {
+                minDot = std::min(minDot, glm::dot(axis, n));
+            }
+        }
+
+        for (int c = 0; c < 3; ++c) {
+            meshlet.center[c] = center[c];
+            meshlet.coneAxis[c] = axis[c];
+        }
+        meshlet.radius = radius;
+        meshlet.coneCutoff = (minDot > 0.0f) ? std::sqrt(1.0f - minDot * minDot) : 1.0f;
+    }
+}
+
+size_t vkMeshTools::simplify(uint32_t* destination, const uint32_t* indices, size_t indexCount, const float* positions, size_t vertexCount, size_t vertexStride,
+                             size_t targetIndexCount, float targetError, float* resultError)
+{
+    auto position = [&](uint32_t v) {
+        const float* p = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(positions) + size_t(v) * vertexStride);
+        return glm::vec3(p[0], p[1], p[2]);
+    };
+
+    std::vector<uint32_t> result(indices, indices + indexCount - indexCount % 3);
+    float maxError = 0.0f;
+
+    // Vertices that only differ in attributes share a position id and a quadric
+    std::vector<uint32_t> order(vertexCount);
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+        order[v] = v;
+    }
+    auto positionLess = [&](uint32_t a, uint32_t b) {
+        glm::vec3 pa = position(a);
+        glm::vec3 pb = position(b);
+        return pa.x < pb.x || (pa.x == pb.x && (pa.y < pb.y || (pa.y == pb.y && pa.z < pb.z)));
+    };
+    std::sort(order.begin(), order.end(), positionLess);
+    std::vector<uint32_t> positionId(vertexCount);
+    std::vector<uint32_t> wedgeCount;
+    for (size_t i = 0; i < vertexCount; ++i) {
+        if (i == 0 || positionLess(order[i - 1], order[i])) {
+            wedgeCount.push_back(0);
+        }
+        positionId[order[i]] = static_cast<uint32_t>(wedgeCount.size() - 1);
+        ++wedgeCount.back();
+    }
+
+    std::vector<Quadric> quadrics(wedgeCount.size(), Quadric{});
+    std::vector<uint64_t> edges;
+    edges.reserve(result.size());
+    for (size_t t = 0; t < result.size(); t += 3) {
+        glm::vec3 p0 = position(result[t]);
+        glm::vec3 n = glm::cross(position(result[t + 1]) - p0, position(result[t + 2]) - p0);
+        float length = glm::length(n);
+        if (length > 0.0f) {
+            n /= length;
+            Quadric q = planeQuadric(n, -glm::dot(n, p0), length * 0.5f);
+            for (int k = 0; k < 3; ++k) {
+                quadricAdd(quadrics[positionId[result[t + k]]], q);
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            uint64_t a = positionId[result[t + k]];
+            uint64_t b = positionId[result[t + (k + 1) % 3]];
+            edges.push_back((a << 32) | b);
+        }
+    }
+
+    // An edge without its opposite half edge lies on an open border
+    std::sort(edges.begin(), edges.end());
+    std::vector<uint8_t> locked(vertexCount, 0);
+    std::vector<uint8_t> border(wedgeCount.size(), 0);
+    for (uint64_t edge : edges) {
+        uint64_t opposite = (edge << 32) | (edge >> 32);
+        if (!std::binary_search(edges.begin(), edges.end(), opposite)) {
+            border[edge >> 32] = 1;
+            border[edge & 0xffffffffu] = 1;
+        }
+    }
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+        locked[v] = border[positionId[v]] || wedgeCount[positionId[v]] > 1;
+    }
+
+    struct Collapse
+    {
+        float error;
+        uint32_t source;
+        uint32_t target;
+    };
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> remap(vertexCount);
+    std::vector<uint8_t> touched(vertexCount);
+    std::vector<uint32_t> adjacencyOffset(vertexCount + 1);
+    std::vector<uint32_t> adjacency;
+    const float errorLimit = targetError * targetError;
+
+    while (result.size() > targetIndexCount) {
+        size_t triangleCount = result.size() / 3;
+
+        // Triangles around every vertex
+        std::fill(adjacencyOffset.begin(), adjacencyOffset.end(), 0);
+        for (uint32_t v : result) {
+            ++adjacencyOffset[v + 1];
+        }
+        for (size_t v = 0; v < vertexCount; ++v) {
+            adjacencyOffset[v + 1] += adjacencyOffset[v];
+        }
+        adjacency.resize(result.size());
+        std::vector<uint32_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+        for (size_t i = 0; i < result.size(); ++i) {
+            adjacency[fill[result[i]]++] = static_cast<uint32_t>(i / 3);
+        }
+
+        // Cheapest collapse of every free vertex along one of its edges
+        collapses.clear();
+        std::vector<Collapse> best(vertexCount, Collapse{ std::numeric_limits<float>::max(), kUnused, kUnused });
+        for (size_t t = 0; t < result.size(); t += 3) {
+            for (int k = 0; k < 3; ++k) {
+                uint32_t a = result[t + k];
+                uint32_t b = result[t + (k + 1) % 3];
+                uint32_t pair[2][2] = { { a, b }, { b, a } };
+                for (auto& edge : pair) {
+                    uint32_t source = edge[0];
+                    uint32_t target = edge[1];
+                    if (locked[source] || positionId[source] == positionId[target]) {
+                        continue;
+                    }
+                    float error = quadricError(quadrics[positionId[source]], position(target));
+                    if (error < best[source].error) {
+                        best[source] = Collapse{ error, source, target };
+                    }
+                }
+            }
+        }
+        for (const auto& collapse : best) {
+            if (collapse.source != kUnused && collapse.error <= errorLimit) {
+                collapses.push_back(collapse);
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+        // Independent collapses only, each removes about two triangles
+        size_t budget = (triangleCount - targetIndexCount / 3) / 2 + 1;
+        for (uint32_t v = 0; v < vertexCount; ++v) {
+            remap[v] = v;
+        }
+        std::fill(touched.begin(), touched.end(), 0);
+        size_t collapsed = 0;
+        for (const auto& collapse : collapses) {
+            if (collapsed >= budget) {
+                break;
+            }
+            uint32_t source = collapse.source;
+            uint32_t target = collapse.target;
+            if (touched[source] || touched[target]) {
+                continue;
+            }
+
+            // Reject collapses that flip a remaining triangle
+            glm::vec3 sourcePos = position(source);
+            glm::vec3 targetPos = position(target);
+            bool flips = false;
+            for (uint32_t a = adjacencyOffset[source]; a < adjacencyOffset[source + 1] && !flips; ++a) {
+                const uint32_t* tri = &result[adjacency[a] * 3];
+                if (tri[0] == target || tri[1] == target || tri[2] == target) {
+                    continue;
+                }
+                int k = (tri[0] == source) ? 0 : (tri[1] == source) ? 1 : 2;
+                glm::vec3 p1 = position(tri[(k + 1) % 3]);
+                glm::vec3 p2 = position(tri[(k + 2) % 3]);
+                glm::vec3 before = glm::cross(p1 - sourcePos, p2 - sourcePos);
+                glm::vec3 after = glm::cross(p1 - targetPos, p2 - targetPos);
+                flips = glm::dot(before, after) <= 0.0f;
+            }
+            if (flips) {
+                continue;
+            }
+
+            remap[source] = target;
+            for (uint32_t a = adjacencyOffset[source]; a < adjacencyOffset[source + 1]; ++a) {
+                const uint32_t* tri = &result[adjacency[a] * 3];
+                touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+            }
+            quadricAdd(quadrics[positionId[target]], quadrics[positionId[source]]);
+            maxError = std::max(maxError, collapse.error);
+            ++collapsed;
+        }
+        if (collapsed == 0) {
+            break;
+        }
+
+        size_t write = 0;
+        for (size_t t = 0; t < result.size(); t += 3) {
+            uint32_t a = remap[result[t]];
+            uint32_t b = remap[result[t + 1]];
+            uint32_t c = remap[result[t + 2]];
+            if (a != b && b != c && c != a) {
+                result[write++] = a;
+                result[write++] = b;
+                result[write++] = c;
+            }
+        }
+        result.resize(write);
+    }
+
+    std::copy(result.begin(), result.end(), destination);
+    if (resultError) {
+        *resultError = std::sqrt(maxError);
+    }
+    return result.size();
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct vkVertexCacheStats
+{
+    float acmr = 0.0f;      // Transformed vertices per triangle, 0.5 is ideal for large regular meshes
+    float atvr = 0.0f;      // Transformed vertices per vertex, 1.0 is ideal
+};
+
+// Contiguous run of triangles in the index buffer with culling bounds, laid out to match the
+// std430 Meshlet struct of cull.comp
+struct vkMeshlet
+{
+    float center[3];
+    float radius;
+    float coneAxis[3];
+    float coneCutoff;       // Sine of the normal cone half angle, 1 when the cone is too wide to cull
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    uint32_t vertexCount;
+    uint32_t reserved;
+};
+
+static_assert(offsetof(vkMeshlet, coneAxis) == 16 && offsetof(vkMeshlet, firstIndex) == 32 && sizeof(vkMeshlet) == 48,
+              "vkMeshlet must match Meshlet in cull.comp");
+
+// One level of detail: an index range into the shared index buffer and the meshlets covering it
+struct vkMeshLod
+{
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    uint32_t firstMeshlet;
+    uint32_t meshletCount;
+    float error;            // Largest deviation from the full resolution mesh in model units
+    uint32_t reserved[3];
+};
+
+static_assert(sizeof(vkMeshLod) == 32, "vkMeshLod is stored in the mesh cache");
+
+// Offline mesh processing used by the model import path.
+class vkMeshTools
+{
+public:
+    // Vertex deduplication on the raw vertex bytes.
+    // remap[i] receives the output index of input vertex i, output indices are assigned in order of
+    // first occurrence. Returns the number of unique vertices.
+    // Uses a single probe sequence per vertex in an open addressing table keyed by a 64-bit hash;
+    // large inputs are hashed in parallel and split by hash into shards that are deduplicated
+    // independently, which gives the same result as the serial path.
+    static uint32_t generateVertexRemap(const void* vertices, size_t vertexCount, size_t vertexStride, std::vector<uint32_t>& remap);
+
+    // destination[remap[i]] = vertices[i], destination must hold the unique vertex count.
+    // Entries set to kUnused are skipped.
+    static void remapVertexBuffer(void* destination, const void* vertices, size_t vertexCount, size_t vertexStride, const std::vector<uint32_t>& remap);
+
+    static void remapIndexBuffer(uint32_t* indices, size_t indexCount, const std::vector<uint32_t>& remap);
+
+    static uint64_t hashBytes(const void* data, size_t size);
+
+    // FIFO post-transform cache simulation
+    static vkVertexCacheStats analyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, uint32_t cacheSize = kVertexCacheSize);
+
+    // Tipsify triangle reordering (Sander et al. 2007). When clusters is given it receives the first
+    // triangle of every cluster: hard boundaries where Tipsify hits a dead end plus soft ones
+    // wherever the running ACMR is already within `threshold` of the whole mesh, so the clusters
+    // can later be reordered for overdraw at little vertex cache cost.
+    static void optimizeVertexCache(uint32_t* destination, const uint32_t* indices, size_t indexCount, size_t vertexCount,
+                                    uint32_t cacheSize = kVertexCacheSize, std::vector<uint32_t>* clusters = nullptr, float threshold = 1.05f);
+
+    // Orders the clusters from optimizeVertexCache so outward facing ones come first, approximating
+    // front to back order from any viewpoint. positions point at the first float3 of each vertex.
+    static void optimizeOverdraw(uint32_t* destination, const uint32_t* indices, size_t indexCount, const float* positions, size_t vertexStride,
+                                 const std::vector<uint32_t>& clusters);
+
+    // Remap that stores vertices in order of first use, apply with remapVertexBuffer/remapIndexBuffer.
+    // Unreferenced vertices are dropped, returns the referenced vertex count.
+    static uint32_t optimizeVertexFetchRemap(std::vector<uint32_t>& remap, const uint32_t* indices, size_t indexCount, size_t vertexCount);
+
+    // Splits the index buffer into meshlets of at most maxVertices unique vertices and maxTriangles
+    // triangles without reordering it, so run it after optimizeVertexCache for local clusters.
+    // Each meshlet gets a bounding sphere and a normal cone for backface culling.
+    static void buildMeshlets(std::vector<vkMeshlet>& meshlets, const uint32_t* indices, size_t indexCount, const float* positions, size_t vertexCount,
+                              size_t vertexStride, uint32_t maxVertices = kMeshletMaxVertices, uint32_t maxTriangles = kMeshletMaxTriangles);
+
+    // Quadric error metric simplification (Garland and Heckbert 1997) with half edge collapses onto
+    // existing vertices, so every level indexes the original vertex buffer. Vertices on open borders
+    // and attribute seams are never moved. Stops at targetIndexCount or when the next collapse would
+    // move the surface further than targetError. Writes the indices to destination, which must hold
+    // indexCount entries, and returns their count; resultError receives the largest error.
+    static size_t simplify(uint32_t* destination, const uint32_t* indices, size_t indexCount, const float* positions, size_t vertexCount, size_t vertexStride,
+                           size_t targetIndexCount, float targetError, float* resultError = nullptr);
+
+    static const uint32_t kVertexCacheSize = 16;
+    static const uint32_t kMeshletMaxVertices = 64;
+    static const uint32_t kMeshletMaxTriangles = 124;
+
+    // Inputs at least this large take the parallel path when more than one worker is available
+    static const size_t kParallelDedupThreshold = 1 << 20;
+
+    static const uint32_t kUnused = 0xffffffffu;
+};
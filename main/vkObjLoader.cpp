@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+
+#include "vkMappedFile.h"
+#include "vkObjLoader.h"
+#include "vkThreadPool.h"
+
+namespace
+{
+    const size_t kMinChunkSize = 256 * 1024;
+
+    struct ObjChunk
+    {
+        const char* begin;
+        const char* end;
+
+        uint32_t positionCount = 0;
+        uint32_t texCoordCount = 0;
+        uint32_t positionBase = 0;
+        uint32_t texCoordBase = 0;
+
+        std::vector<vkObjCorner> corners;
+        std::string error;
+    };
+
+    inline bool isBlank(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    inline bool isDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    inline const char* skipBlank(const char* p, const char* end)
+    {
+        while (p < end && isBlank(*p)) {
+            ++p;
+        }
+        return p;
+    }
+
+    inline const char* nextLine(const char* p, const char* end)
+    {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        return eol ? eol + 1 : end;
+    }
+
+    // Keyword at the start of a line: 'v', 't' for vt, 'f', or 0 for anything that is skipped
+    inline char lineKind(const char*& p, const char* end)
+    {
+        p = skipBlank(p, end);
+        if (end - p < 2) {
+            return 0;
+        }
+        if (p[0] == 'v' && isBlank(p[1])) {
+            p += 2;
+            return 'v';
+        }
+        if (p[0] == 'f' && isBlank(p[1])) {
+            p += 2;
+            return 'f';
+        }
+        if (p[0] == 'v' && p[1] == 't' && end - p > 2 && isBlank(p[2])) {
+            p += 3;
+            return 't';
+        }
+        return 0;
+    }
+
+    double pow10(int exponent)
+    {
+        static const double table[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        if (exponent >= 0 && exponent <= 22) {
+            return table[exponent];
+        }
+        return std::pow(10.0, exponent);
+    }
+
+    // Decimal float parser for the plain [-+]digits[.digits][e[-+]digits] form OBJ exporters write.
+    // Up to 19 significant digits are accumulated in an integer and scaled once, which is exact
+    // enough for float results and several times faster than strtod.
+    bool parseFloat(const char*& p, const char* end, float& value)
+    {
+        const char* s = skipBlank(p, end);
+        bool negative = false;
+        if (s < end && (*s == '-' || *s == '+')) {
+            negative = (*s == '-');
+            ++s;
+        }
+
+        uint64_t mantissa = 0;
+        int exponent = 0;
+        int digits = 0;
+        bool any = false;
+        for (; s < end && isDigit(*s); ++s, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                digits += (mantissa != 0);
+            } else {
+                ++exponent;
+            }
+        }
+        if (s < end && *s == '.') {
+            for (++s; s < end && isDigit(*s); ++s, any = true) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*s - '0');
+                    digits += (mantissa != 0);
+                    --exponent;
+                }
+            }
+        }
+        if (!any) {
+            return false;
+        }
+        if (s < end && (*s == 'e' || *s == 'E')) {
+            const char* e = s + 1;
+            bool negativeExp = false;
+            if (e < end && (*e == '-' || *e == '+')) {
+                negativeExp = (*e == '-');
+                ++e;
+            }
+            if (e < end && isDigit(*e)) {
+                int exp = 0;
+                for (; e < end && isDigit(*e); ++e) {
+                    exp = std::min(exp * 10 + (*e - '0'), 1000);
+                }
+                exponent += negativeExp ? -exp : exp;
+                s = e;
+            }
+        }
+
+        double result = static_cast<double>(mantissa);
+        result = (exponent < 0) ? result / pow10(-exponent) : result * pow10(exponent);
+        value = static_cast<float>(negative ? -result : result);
+        p = s;
+        return true;
+    }
+
+    bool parseInt(const char*& p, const char* end, int64_t& value)
+    {
+        const char* s = p;
+        bool negative = false;
+        if (s < end && (*s == '-' || *s == '+')) {
+            negative = (*s == '-');
+            ++s;
+        }
+        if (s >= end || !isDigit(*s)) {
+            return false;
+        }
+        int64_t result = 0;
+        for (; s < end && isDigit(*s); ++s) {
+            result = std::min<int64_t>(result * 10 + (*s - '0'), 0xffffffffll);
+        }
+        value = negative ? -result : result;
+        p = s;
+        return true;
+    }
+
+    // 1-based absolute or negative relative index to a 0-based global one
+    inline bool resolveIndex(int64_t index, int64_t localCount, uint32_t base, uint32_t total, uint32_t& result)
+    {
+        int64_t resolved = (index > 0) ? index - 1 : base + localCount + index;
+        if (index == 0 || resolved < 0 || resolved >= total) {
+            return false;
+        }
+        result = static_cast<uint32_t>(resolved);
+        return true;
+    }
+
+    void countChunk(ObjChunk& chunk)
+    {
+        for (const char* p = chunk.begin; p < chunk.end; p = nextLine(p, chunk.end)) {
+            const char* s = p;
+            char kind = lineKind(s, chunk.end);
+            chunk.positionCount += (kind == 'v');
+            chunk.texCoordCount += (kind == 't');
+        }
+    }
+
+    void parseChunk(ObjChunk& chunk, vkObjMesh& mesh)
+    {
+        const char* end = chunk.end;
+        const uint32_t positionTotal = static_cast<uint32_t>(mesh.positions.size());
+        const uint32_t texCoordTotal = static_cast<uint32_t>(mesh.texCoords.size());
+        glm::vec3* positions = mesh.positions.data() + chunk.positionBase;
+        glm::vec2* texCoords = mesh.texCoords.data() + chunk.texCoordBase;
+        uint32_t positionCount = 0;
+        uint32_t texCoordCount = 0;
+
+        std::vector<vkObjCorner> polygon;
+        for (const char* p = chunk.begin; p < end; p = nextLine(p, end)) {
+            const char* s = p;
+            switch (lineKind(s, end)) {
+            case 'v': {
+                glm::vec3& pos = positions[positionCount++];
+                if (!parseFloat(s, end, pos.x) || !parseFloat(s, end, pos.y) || !parseFloat(s, end, pos.z)) {
+                    chunk.error = "malformed vertex position";
+                    return;
+                }
+                break;
+            }
+            case 't': {
+                glm::vec2& uv = texCoords[texCoordCount++];
+                if (!parseFloat(s, end, uv.x)) {
+                    chunk.error = "malformed texture coordinate";
+                    return;
+                }
+                if (!parseFloat(s, end, uv.y)) {
+                    uv.y = 0.0f;
+                }
+                break;
+            }
+            case 'f': {
+                polygon.clear();
+                for (s = skipBlank(s, end); s < end && *s != '\n' && *s != '#'; s = skipBlank(s, end)) {
+                    vkObjCorner corner = { 0, vkObjLoader::kNoIndex };
+                    int64_t index;
+                    if (!parseInt(s, end, index) || !resolveIndex(index, positionCount, chunk.positionBase, positionTotal, corner.position)) {
+                        chunk.error = "invalid face position index";
+                        return;
+                    }
+                    if (s < end && *s == '/') {
+                        ++s;
+                        if (parseInt(s, end, index) && !resolveIndex(index, texCoordCount, chunk.texCoordBase, texCoordTotal, corner.texCoord)) {
+                            chunk.error = "invalid face texture coordinate index";
+                            return;
+                        }
+                        // Normal indices are not used
+                        if (s < end && *s == '/') {
+                            ++s;
+                            parseInt(s, end, index);
+                        }
+                    }
+                    polygon.push_back(corner);
+                }
+                for (size_t i = 2; i < polygon.size(); ++i) {
+                    chunk.corners.push_back(polygon[0]);
+                    chunk.corners.push_back(polygon[i - 1]);
+                    chunk.corners.push_back(polygon[i]);
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    template <typename F>
+    void forEachChunk(std::vector<ObjChunk>& chunks, F func)
+    {
+        if (chunks.size() == 1) {
+            func(chunks[0]);
+            return;
+        }
+        std::vector<std::future<void>> tasks;
+        tasks.reserve(chunks.size());
+        for (auto& chunk : chunks) {
+            ObjChunk* pChunk = &chunk;
+            tasks.push_back(vkThreadPool::instance()->enqueue([pChunk, &func]() { func(*pChunk); }));
+        }
+        for (auto& task : tasks) {
+            task.get();
+        }
+    }
+}
+
+bool vkObjLoader::load(const std::string& fileName, vkObjMesh& mesh, std::string& error)
+{
+    mesh = vkObjMesh();
+
+    vkMappedFile file;
+    if (!file.open(fileName)) {
+        error = "cannot open " + fileName;
+        return false;
+    }
+
+    const char* data = file.data();
+    const char* end = data + file.size();
+
+    // Line aligned chunks, a few per worker so uneven regions (attributes vs faces) balance out
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(vkThreadPool::instance()->size() * 4, file.size() / kMinChunkSize));
+    size_t chunkSize = file.size() / chunkCount + 1;
+    std::vector<ObjChunk> chunks;
+    for (const char* p = data; p < end;) {
+        ObjChunk chunk;
+        chunk.begin = p;
+        chunk.end = (static_cast<size_t>(end - p) > chunkSize) ? nextLine(p + chunkSize, end) : end;
+        p = chunk.end;
+        chunks.push_back(std::move(chunk));
+    }
+    if (chunks.empty()) {
+        return true;
+    }
+
+    forEachChunk(chunks, countChunk);
+
+    uint32_t positionTotal = 0;
+    uint32_t texCoordTotal = 0;
+    for (auto& chunk : chunks) {
+        chunk.positionBase = positionTotal;
+        chunk.texCoordBase = texCoordTotal;
+        positionTotal += chunk.positionCount;
+        texCoordTotal += chunk.texCoordCount;
+    }
+    mesh.positions.resize(positionTotal);
+    mesh.texCoords.resize(texCoordTotal);
+
+    forEachChunk(chunks, [&mesh](ObjChunk& chunk) { parseChunk(chunk, mesh); });
+
+    size_t cornerTotal = 0;
+    for (const auto& chunk : chunks) {
+        if (!chunk.error.empty()) {
+            error = fileName + ": " + chunk.error + " near offset " + std::to_string(chunk.begin - data);
+            mesh = vkObjMesh();
+            return false;
+        }
+        cornerTotal += chunk.corners.size();
+    }
+
+    mesh.corners.reserve(cornerTotal);
+    for (const auto& chunk : chunks) {
+        mesh.corners.insert(mesh.corners.end(), chunk.corners.begin(), chunk.corners.end());
+    }
+
+    return true;
+}
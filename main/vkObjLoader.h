@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+struct vkObjCorner
+{
+    uint32_t position;
+    uint32_t texCoord;      // vkObjLoader::kNoIndex when the face has no texture coordinate
+};
+
+struct vkObjMesh
+{
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec2> texCoords;
+    std::vector<vkObjCorner> corners;   // Three per triangle, polygons are fan triangulated
+};
+
+// Wavefront OBJ reader for v/vt/f data.
+// The file is memory mapped and split into line aligned chunks. A first parallel pass counts the
+// attribute lines of every chunk so each chunk knows its global attribute base, a second one
+// parses straight into the shared attribute arrays and resolves (also relative) face indices
+// locally. Only the per chunk face streams are concatenated at the end.
+class vkObjLoader
+{
+public:
+    static const uint32_t kNoIndex = 0xffffffffu;
+
+    static bool load(const std::string& fileName, vkObjMesh& mesh, std::string& error);
+};
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+
+#include "vkCullPass.h"
+#include "vkObjectCullPass.h"
+
+static vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Visible count of every level of detail, after the draw count and its padding
+static const vk::DeviceSize kLodCountOffset = 16;
+
+const uint32_t vkObjectCullPass::kGroupSize;
+
+// Specialization constants of objectcull.comp
+struct CullSpecialization
+{
+    uint32_t pass;              // 0 culls the objects, 1 writes the draws
+    uint32_t compact;
+    uint32_t commandBase;       // In uints from the region start
+    uint32_t instanceBase;
+};
+
+vkObjectCullParams vkObjectCullParams::fromMatrices(const glm::mat4& proj, const glm::mat4& modelView, float viewportHeight, float pixelError)
+{
+    vkCullParams frustum = vkCullParams::fromMatrices(proj, modelView);
+
+    vkObjectCullParams params = {};
+    std::copy(std::begin(frustum.planes), std::end(frustum.planes), params.planes);
+    params.cameraPosition = frustum.cameraPosition;
+    params.pixelScale = proj[1][1] * 0.5f * viewportHeight;
+    params.pixelError = pixelError;
+    return params;
+}
+
+std::vector<vkLodDraw> vkObjectCullPass::makeLodDraws(const vkScene& scene, const std::vector<vkMeshLod>& lods, uint32_t& instanceCapacity)
+{
+    std::vector<vkLodDraw> draws(lods.size(), vkLodDraw{});
+    std::vector<uint32_t> instanceCounts = scene.meshInstanceCounts();
+
+    instanceCapacity = 0;
+    for (size_t m = 0; m < scene.meshes().size(); ++m) {
+        const vkSceneMesh& mesh = scene.meshes()[m];
+        for (uint32_t level = 0; level < mesh.lodCount; ++level) {
+            const vkMeshLod& lod = lods[mesh.firstLod + level];
+            vkLodDraw& draw = draws[mesh.firstLod + level];
+            draw.indexCount = lod.indexCount;
+            draw.firstIndex = lod.firstIndex;
+            draw.vertexOffset = mesh.vertexOffset;
+            draw.firstInstance = instanceCapacity;
+            draw.error = lod.error;
+            instanceCapacity += instanceCounts[m];
+        }
+    }
+
+    return draws;
+}
+
+vkObjectCullPass::vkObjectCullPass(vk::PhysicalDevice physicalDevice, vk::Device device, vkAllocator& allocator, vk::PipelineCache pipelineCache, const std::vector<uint32_t>& shaderCode,
+                                   vk::Buffer objectBuffer, uint32_t objectCount, vk::Buffer lodDrawBuffer, uint32_t lodCount, uint32_t instanceCapacity,
+                                   uint32_t frameCount, bool multiDrawIndirect, bool drawIndirectCount, const vkDepthPyramid* depthPyramid)
+    : m_device(device), m_objectCount(objectCount), m_lodCount(lodCount), m_multiDrawIndirect(multiDrawIndirect), m_drawIndirectCount(drawIndirectCount && multiDrawIndirect),
+      m_depthPyramid(depthPyramid)
+{
+    vk::DeviceSize alignment = std::max<vk::DeviceSize>(physicalDevice.getProperties().limits.minStorageBufferOffsetAlignment, 16);
+    m_commandOffset = alignUp(kLodCountOffset + vk::DeviceSize(lodCount) * sizeof(uint32_t), 16);
+    m_instanceOffset = alignUp(m_commandOffset + vk::DeviceSize(lodCount) * sizeof(vk::DrawIndexedIndirectCommand), 16);
+    m_regionSize = alignUp(m_instanceOffset + vk::DeviceSize(std::max(instanceCapacity, 1u)) * sizeof(uint32_t), alignment);
+
+    vk::BufferCreateInfo bufferInfo;
+    bufferInfo.setSize(m_regionSize * frameCount)
+        .setUsage(vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst)
+        .setSharingMode(vk::SharingMode::eExclusive);
+    m_drawBuffer = device.createBufferUnique(bufferInfo);
+    m_drawMemory = allocator.allocate(device.getBufferMemoryRequirements(*m_drawBuffer), vk::MemoryPropertyFlagBits::eDeviceLocal, true);
+    device.bindBufferMemory(*m_drawBuffer, m_drawMemory->memory, m_drawMemory->offset);
+
+    std::array<vk::DescriptorSetLayoutBinding, 3> bindings;
+    bindings[0].setBinding(0).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eStorageBuffer).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    bindings[1].setBinding(1).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eStorageBuffer).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    bindings[2].setBinding(2).setDescriptorCount(1).setDescriptorType(vk::DescriptorType::eStorageBufferDynamic).setStageFlags(vk::ShaderStageFlagBits::eCompute);
+    vk::DescriptorSetLayoutCreateInfo layoutInfo;
+    layoutInfo.setBindingCount(static_cast<uint32_t>(bindings.size())).setPBindings(bindings.data());
+    m_setLayout = device.createDescriptorSetLayoutUnique(layoutInfo);
+
+    std::array<vk::DescriptorPoolSize, 2> poolSize;
+    poolSize[0].setType(vk::DescriptorType::eStorageBuffer).setDescriptorCount(2);
+    poolSize[1].setType(vk::DescriptorType::eStorageBufferDynamic).setDescriptorCount(1);
+    vk::DescriptorPoolCreateInfo poolInfo;
+    poolInfo.setPoolSizeCount(static_cast<uint32_t>(poolSize.size())).setPPoolSizes(poolSize.data()).setMaxSets(1)
+        .setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
+    m_descriptorPool = device.createDescriptorPoolUnique(poolInfo);
+
+    vk::DescriptorSetAllocateInfo allocInfo;
+    allocInfo.setDescriptorPool(*m_descriptorPool).setDescriptorSetCount(1).setPSetLayouts(&*m_setLayout);
+    m_descriptorSet = std::move(device.allocateDescriptorSetsUnique(allocInfo)[0]);
+
+    vk::DescriptorBufferInfo objectInfo(objectBuffer, 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo lodInfo(lodDrawBuffer, 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo drawInfo(*m_drawBuffer, 0, m_regionSize);
+    std::array<vk::WriteDescriptorSet, 3> descriptorWrite;
+    descriptorWrite[0].setDstSet(*m_descriptorSet).setDstBinding(0).setDescriptorType(vk::DescriptorType::eStorageBuffer).setDescriptorCount(1).setPBufferInfo(&objectInfo);
+    descriptorWrite[1].setDstSet(*m_descriptorSet).setDstBinding(1).setDescriptorType(vk::DescriptorType::eStorageBuffer).setDescriptorCount(1).setPBufferInfo(&lodInfo);
+    descriptorWrite[2].setDstSet(*m_descriptorSet).setDstBinding(2).setDescriptorType(vk::DescriptorType::eStorageBufferDynamic).setDescriptorCount(1).setPBufferInfo(&drawInfo);
+    device.updateDescriptorSets(descriptorWrite, nullptr);
+
+    vk::PushConstantRange pushConstantRange(vk::ShaderStageFlagBits::eCompute, 0, sizeof(vkObjectCullParams));
+    std::vector<vk::DescriptorSetLayout> setLayouts = { *m_setLayout };
+    if (m_depthPyramid) {
+        setLayouts.push_back(m_depthPyramid->occlusionLayout());
+    }
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo;
+    pipelineLayoutInfo.setSetLayoutCount(static_cast<uint32_t>(setLayouts.size())).setPSetLayouts(setLayouts.data())
+        .setPushConstantRangeCount(1).setPPushConstantRanges(&pushConstantRange);
+    m_pipelineLayout = device.createPipelineLayoutUnique(pipelineLayoutInfo);
+
+    auto shaderCreateInfo = vk::ShaderModuleCreateInfo{ {}, shaderCode.size() * sizeof(uint32_t), shaderCode.data() };
+    auto shaderModule = device.createShaderModuleUnique(shaderCreateInfo);
+
+    // Both passes come from the same shader, specialized on the pass and the region layout
+    std::array<vk::SpecializationMapEntry, 4> specEntries = {
+        vk::SpecializationMapEntry(0, offsetof(CullSpecialization, pass), sizeof(uint32_t)),
+        vk::SpecializationMapEntry(1, offsetof(CullSpecialization, compact), sizeof(uint32_t)),
+        vk::SpecializationMapEntry(2, offsetof(CullSpecialization, commandBase), sizeof(uint32_t)),
+        vk::SpecializationMapEntry(3, offsetof(CullSpecialization, instanceBase), sizeof(uint32_t)),
+    };
+    auto createPipeline = [&](uint32_t pass) {
+        CullSpecialization specData = { pass, m_drawIndirectCount ? 1u : 0u, static_cast<uint32_t>(m_commandOffset / sizeof(uint32_t)),
+                                        static_cast<uint32_t>(m_instanceOffset / sizeof(uint32_t)) };
+        vk::SpecializationInfo specInfo(static_cast<uint32_t>(specEntries.size()), specEntries.data(), sizeof(specData), &specData);
+        vk::PipelineShaderStageCreateInfo stageInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eCompute, *shaderModule, "main", &specInfo);
+
+        vk::ComputePipelineCreateInfo pipelineInfo;
+        pipelineInfo.setStage(stageInfo).setLayout(*m_pipelineLayout);
+        return device.createComputePipelineUnique(pipelineCache, pipelineInfo);
+    };
+    m_cullPipeline = createPipeline(0);
+    m_drawPipeline = createPipeline(1);
+}
+
+vkObjectCullPass::~vkObjectCullPass()
+{
+}
+
+void vkObjectCullPass::record(vk::CommandBuffer commandBuffer, uint32_t frame, const vkObjectCullParams& params)
+{
+    uint32_t regionOffset = static_cast<uint32_t>(frame * m_regionSize);
+
+    // Reset the draw count and the per level counts, the draw pass rewrites every command it uses
+    commandBuffer.fillBuffer(*m_drawBuffer, regionOffset, m_commandOffset, 0);
+
+    vk::MemoryBarrier barrier;
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite).setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(), barrier, nullptr, nullptr);
+
+    vkObjectCullParams pushParams = params;
+    pushParams.objectCount = m_objectCount;
+    pushParams.lodCount = m_lodCount;
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *m_pipelineLayout, 0, *m_descriptorSet, regionOffset);
+    if (m_depthPyramid) {
+        commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *m_pipelineLayout, 1, m_depthPyramid->occlusionSet(), m_depthPyramid->occlusionOffset(frame));
+    }
+    commandBuffer.pushConstants(*m_pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(pushParams), &pushParams);
+
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *m_cullPipeline);
+    commandBuffer.dispatch((m_objectCount + kGroupSize - 1) / kGroupSize, 1, 1);
+
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eShaderWrite).setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(), barrier, nullptr, nullptr);
+
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *m_drawPipeline);
+    commandBuffer.dispatch((m_lodCount + kGroupSize - 1) / kGroupSize, 1, 1);
+
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eShaderWrite).setDstAccessMask(vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eVertexAttributeRead);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexInput,
+                                  vk::DependencyFlags(), barrier, nullptr, nullptr);
+}
+
+void vkObjectCullPass::draw(vk::CommandBuffer commandBuffer, uint32_t frame, const vk::DispatchLoaderDynamic& dldi)
+{
+    vk::DeviceSize regionOffset = frame * m_regionSize;
+    vk::DeviceSize instanceOffset = regionOffset + m_instanceOffset;
+    commandBuffer.bindVertexBuffers(vkScene::kBinding, 1, &*m_drawBuffer, &instanceOffset);
+
+    vk::DeviceSize commandOffset = regionOffset + m_commandOffset;
+    const uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand);
+    if (m_drawIndirectCount) {
+        commandBuffer.drawIndexedIndirectCountKHR(*m_drawBuffer, commandOffset, *m_drawBuffer, regionOffset, m_lodCount, stride, dldi);
+    } else if (m_multiDrawIndirect) {
+        commandBuffer.drawIndexedIndirect(*m_drawBuffer, commandOffset, m_lodCount, stride);
+    } else {
+        // Still independent of the instance count, one draw per level of detail
+        for (uint32_t i = 0; i < m_lodCount; ++i) {
+            commandBuffer.drawIndexedIndirect(*m_drawBuffer, commandOffset + i * stride, 1, stride);
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstddef>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "vkAllocator.h"
+#include "vkDepthPyramid.h"
+#include "vkMeshTools.h"
+#include "vkScene.h"
+
+// Draw of one level of detail of one mesh, laid out to match the std430 LodDraw struct of
+// objectcull.comp. firstInstance is the start of its region in the visible instance list, which
+// holds room for every instance of the mesh.
+struct vkLodDraw
+{
+    uint32_t indexCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+    float error;
+    uint32_t reserved[3];
+};
+
+static_assert(offsetof(vkLodDraw, firstInstance) == 12 && offsetof(vkLodDraw, error) == 16 && sizeof(vkLodDraw) == 32,
+              "vkLodDraw must match LodDraw in objectcull.comp");
+
+// Push constants of objectcull.comp
+struct vkObjectCullParams
+{
+    glm::vec4 planes[6];            // Normalized world space frustum planes
+    glm::vec4 cameraPosition;       // World space
+    float pixelScale;               // Pixels per world unit at distance one
+    float pixelError;               // Coarsest level whose projected error stays below this
+    uint32_t objectCount;
+    uint32_t lodCount;
+
+    static vkObjectCullParams fromMatrices(const glm::mat4& proj, const glm::mat4& modelView, float viewportHeight, float pixelError);
+};
+
+static_assert(offsetof(vkObjectCullParams, cameraPosition) == 96 && offsetof(vkObjectCullParams, pixelScale) == 112
+              && offsetof(vkObjectCullParams, lodCount) == 124 && sizeof(vkObjectCullParams) == 128, "vkObjectCullParams must match CullParams in objectcull.comp");
+
+// GPU driven scene rendering.
+// A compute pass tests every instance against the frustum, picks its level of detail and appends it
+// to the visible list of that level. A second pass turns the per level counts into one indirect
+// instanced draw per level; with VK_KHR_draw_indirect_count the empty ones are compacted away and
+// the GPU consumes the count, otherwise every level is drawn. The recorded commands are the same
+// for any number of instances. Every frame in flight owns a region, the visible list of a region is
+// bound as the instance rate stream of vkScene. Given a depth pyramid, instances hidden behind the
+// previous frame's depth are dropped as well.
+class vkObjectCullPass
+{
+public:
+    vkObjectCullPass(vk::PhysicalDevice physicalDevice, vk::Device device, vkAllocator& allocator, vk::PipelineCache pipelineCache, const std::vector<uint32_t>& shaderCode,
+                     vk::Buffer objectBuffer, uint32_t objectCount, vk::Buffer lodDrawBuffer, uint32_t lodCount, uint32_t instanceCapacity,
+                     uint32_t frameCount, bool multiDrawIndirect, bool drawIndirectCount, const vkDepthPyramid* depthPyramid = nullptr);
+    virtual ~vkObjectCullPass();
+
+    vkObjectCullPass(vkObjectCullPass const&) = delete;
+    vkObjectCullPass& operator=(vkObjectCullPass const&) = delete;
+
+    // Records the culling dispatches, must be outside of a render pass
+    void record(vk::CommandBuffer commandBuffer, uint32_t frame, const vkObjectCullParams& params);
+    // Binds the visible instances and draws them inside the render pass, with the index and mesh vertex buffers bound
+    void draw(vk::CommandBuffer commandBuffer, uint32_t frame, const vk::DispatchLoaderDynamic& dldi);
+
+    // One draw per level of detail of every mesh, firstInstance leaves room for all instances of that mesh
+    static std::vector<vkLodDraw> makeLodDraws(const vkScene& scene, const std::vector<vkMeshLod>& lods, uint32_t& instanceCapacity);
+
+    static const uint32_t kGroupSize = 64;
+
+private:
+    vk::Device m_device;
+    uint32_t m_objectCount;
+    uint32_t m_lodCount;
+    bool m_multiDrawIndirect;
+    bool m_drawIndirectCount;
+    const vkDepthPyramid* m_depthPyramid;       // Set when the shader was compiled with OCCLUSION
+
+    // Per frame region: draw count and the visible count of every level, the draw commands, then
+    // the visible instance list
+    vk::DeviceSize m_commandOffset;
+    vk::DeviceSize m_instanceOffset;
+    vk::DeviceSize m_regionSize;
+    vk::UniqueBuffer m_drawBuffer;
+    vkUniqueAllocation m_drawMemory;
+
+    vk::UniqueDescriptorSetLayout m_setLayout;
+    vk::UniqueDescriptorPool m_descriptorPool;
+    vk::UniqueDescriptorSet m_descriptorSet;
+    vk::UniquePipelineLayout m_pipelineLayout;
+    vk::UniquePipeline m_cullPipeline;
+    vk::UniquePipeline m_drawPipeline;
+};
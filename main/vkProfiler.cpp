@@ -0,0 +1,151 @@
+#include <algorithm>
+
+#include "vkProfiler.h"
+
+#include "spdlog/spdlog.h"
+
+vkProfiler::vkProfiler(uint32_t windowSize, double summaryInterval)
+{
+    m_windowSize = std::max(windowSize, 1u);
+    m_summaryInterval = summaryInterval;
+    for (auto& stage : m_stages) {
+        stage.samples.resize(m_windowSize);
+    }
+}
+
+vkProfiler::~vkProfiler()
+{
+}
+
+const char* vkProfiler::stageName(vkStage stage)
+{
+    static const char* names[] = { "frame", "waitFence", "acquire", "updateUniform", "cull", "record", "submit", "present", "gpuRenderPass" };
+    static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(vkStage::eCount), "stage name table out of sync");
+
+    return names[static_cast<uint32_t>(stage)];
+}
+
+void vkProfiler::initGpu(vk::PhysicalDevice physicalDevice, vk::Device device, uint32_t queueFamilyIndex, uint32_t frameCount)
+{
+    auto properties = physicalDevice.getProperties();
+    uint32_t validBits = physicalDevice.getQueueFamilyProperties()[queueFamilyIndex].timestampValidBits;
+    if (validBits == 0 || properties.limits.timestampPeriod == 0.0f) {
+        spdlog::info("vkProfiler: timestamps not supported on queue family {}, GPU timing disabled", queueFamilyIndex);
+        return;
+    }
+
+    m_device = device;
+    m_timestampPeriod = properties.limits.timestampPeriod;
+    m_timestampMask = (validBits >= 64) ? ~0ull : ((1ull << validBits) - 1);
+    m_gpuPending.assign(frameCount, false);
+
+    vk::QueryPoolCreateInfo poolInfo;
+    poolInfo.setQueryType(vk::QueryType::eTimestamp).setQueryCount(frameCount * 2);
+    m_queryPool = m_device.createQueryPoolUnique(poolInfo);
+}
+
+void vkProfiler::beginFrame()
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    if (m_firstFrame) {
+        m_firstFrame = false;
+        m_lastSummary = now;
+    } else {
+        addSample(vkStage::eFrame, std::chrono::duration<double, std::milli>(now - m_lastFrame).count());
+    }
+    m_lastFrame = now;
+
+    if (m_summaryInterval > 0.0 && std::chrono::duration<double>(now - m_lastSummary).count() >= m_summaryInterval) {
+        m_lastSummary = now;
+        logSummary();
+    }
+}
+
+void vkProfiler::addSample(vkStage stage, double ms)
+{
+    StageSamples& s = m_stages[static_cast<uint32_t>(stage)];
+    s.samples[s.head] = ms;
+    s.head = (s.head + 1) % m_windowSize;
+    s.count = std::min(s.count + 1, m_windowSize);
+    s.last = ms;
+}
+
+void vkProfiler::addInitStage(const std::string& name, double ms)
+{
+    m_initStages.emplace_back(name, ms);
+}
+
+void vkProfiler::writeGpuBegin(vk::CommandBuffer commandBuffer, uint32_t frame)
+{
+    if (!m_queryPool) {
+        return;
+    }
+    commandBuffer.resetQueryPool(*m_queryPool, frame * 2, 2);
+    commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *m_queryPool, frame * 2);
+}
+
+void vkProfiler::writeGpuEnd(vk::CommandBuffer commandBuffer, uint32_t frame)
+{
+    if (!m_queryPool) {
+        return;
+    }
+    commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *m_queryPool, frame * 2 + 1);
+    m_gpuPending[frame] = true;
+}
+
+void vkProfiler::collectGpu(uint32_t frame)
+{
+    if (!m_queryPool || !m_gpuPending[frame]) {
+        return;
+    }
+
+    // Called after the frame's fence was waited on, without the wait flag this never blocks
+    uint64_t timestamps[2] = {};
+    vk::Result result = m_device.getQueryPoolResults(*m_queryPool, frame * 2, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+    if (result == vk::Result::eSuccess) {
+        uint64_t ticks = ((timestamps[1] & m_timestampMask) - (timestamps[0] & m_timestampMask)) & m_timestampMask;
+        addSample(vkStage::eGpuRenderPass, ticks * m_timestampPeriod / 1000000.0);
+        m_gpuPending[frame] = false;
+    }
+}
+
+vkStageStats vkProfiler::getStats(vkStage stage) const
+{
+    const StageSamples& s = m_stages[static_cast<uint32_t>(stage)];
+
+    vkStageStats stats;
+    stats.count = s.count;
+    stats.last = s.last;
+    if (s.count == 0) {
+        return stats;
+    }
+
+    std::vector<double> sorted(s.samples.begin(), s.samples.begin() + s.count);
+    std::sort(sorted.begin(), sorted.end());
+
+    double sum = 0.0;
+    for (double v : sorted) {
+        sum += v;
+    }
+    auto percentile = [&](double p) { return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))]; };
+
+    stats.avg = sum / sorted.size();
+    stats.p50 = percentile(0.50);
+    stats.p95 = percentile(0.95);
+    stats.p99 = percentile(0.99);
+
+    return stats;
+}
+
+void vkProfiler::logSummary() const
+{
+    for (uint32_t i = 0; i < static_cast<uint32_t>(vkStage::eCount); ++i) {
+        vkStage stage = static_cast<vkStage>(i);
+        auto stats = getStats(stage);
+        if (stats.count == 0) {
+            continue;
+        }
+        spdlog::info("{:>14}: avg {:7.3f} ms  p50 {:7.3f}  p95 {:7.3f}  p99 {:7.3f}  ({} samples)",
+                     stageName(stage), stats.avg, stats.p50, stats.p95, stats.p99, stats.count);
+    }
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <array>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vkTrace.h"
+
+enum class vkStage : uint32_t
+{
+    eFrame = 0,         // Interval between consecutive drawFrame calls
+    eWaitFence,
+    eAcquire,
+    eUpdateUniform,
+    eCull,              // CPU frustum culling, when the GPU path is unavailable
+    eRecord,
+    eSubmit,
+    ePresent,
+    eGpuRenderPass,     // Timestamp queries around the render pass
+    eCount,
+};
+
+struct vkStageStats
+{
+    uint32_t count = 0;
+    double last = 0.0;
+    double avg = 0.0;
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+};
+
+// Rolling per-stage timing in milliseconds. CPU stages are fed by vkCpuTimer scopes, the GPU
+// stage by a timestamp query pair per frame in flight that is read back once the frame's fence
+// has already been waited on, so collection never stalls.
+class vkProfiler
+{
+public:
+    vkProfiler(uint32_t windowSize = 240, double summaryInterval = 5.0);
+    virtual ~vkProfiler();
+
+    vkProfiler(vkProfiler const&) = delete;
+    vkProfiler& operator=(vkProfiler const&) = delete;
+
+    void initGpu(vk::PhysicalDevice physicalDevice, vk::Device device, uint32_t queueFamilyIndex, uint32_t frameCount);
+
+    void beginFrame();
+    void addSample(vkStage stage, double ms);
+    void addInitStage(const std::string& name, double ms);
+
+    void writeGpuBegin(vk::CommandBuffer commandBuffer, uint32_t frame);
+    void writeGpuEnd(vk::CommandBuffer commandBuffer, uint32_t frame);
+    void collectGpu(uint32_t frame);
+
+    vkStageStats getStats(vkStage stage) const;
+    const std::vector<std::pair<std::string, double>>& getInitStages() const { return m_initStages; }
+    void logSummary() const;
+
+    static const char* stageName(vkStage stage);
+
+private:
+    struct StageSamples
+    {
+        std::vector<double> samples;
+        uint32_t head = 0;
+        uint32_t count = 0;
+        double last = 0.0;
+    };
+
+private:
+    uint32_t m_windowSize;
+    double m_summaryInterval;
+    std::array<StageSamples, static_cast<size_t>(vkStage::eCount)> m_stages;
+    std::vector<std::pair<std::string, double>> m_initStages;
+
+    std::chrono::high_resolution_clock::time_point m_lastFrame;
+    std::chrono::high_resolution_clock::time_point m_lastSummary;
+    bool m_firstFrame = true;
+
+    vk::Device m_device;
+    vk::UniqueQueryPool m_queryPool;
+    std::vector<bool> m_gpuPending;
+    double m_timestampPeriod = 1.0;
+    uint64_t m_timestampMask = ~0ull;
+};
+
+class vkCpuTimer
+{
+public:
+    vkCpuTimer(vkProfiler& profiler, vkStage stage) : m_profiler(profiler), m_stage(stage), m_start(std::chrono::high_resolution_clock::now())
+    {
+        m_traced = vkTrace::enabled();
+        m_traceStart = m_traced ? vkTrace::nowUs() : 0;
+    }
+    ~vkCpuTimer()
+    {
+        auto end = std::chrono::high_resolution_clock::now();
+        m_profiler.addSample(m_stage, std::chrono::duration<double, std::milli>(end - m_start).count());
+        if (m_traced) {
+            vkTrace::instance()->addEvent(vkProfiler::stageName(m_stage), "frame", m_traceStart, vkTrace::nowUs() - m_traceStart);
+        }
+    }
+
+    vkCpuTimer(vkCpuTimer const&) = delete;
+    vkCpuTimer& operator=(vkCpuTimer const&) = delete;
+
+private:
+    vkProfiler& m_profiler;
+    vkStage m_stage;
+    std::chrono::high_resolution_clock::time_point m_start;
+    bool m_traced;
+    uint64_t m_traceStart;
+};
@@ -11,18 +11,21 @@
 //#define SDL_MAIN_HANDLED
 
 #include <chrono>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <numeric>
 
 #include "Camera.h"
+#include "vkMeshTools.h"
+#include "vkObjLoader.h"
 #include "vkRender.h"
+#include "vkThreadPool.h"
 #include "vku.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
-
 #include "shaderc/shaderc.hpp"
 
 //#include <SDL2/SDL.h>
@@ -47,19 +50,28 @@ constexpr const T& clamp(const T& v, const T& lo, const T& hi)
     return clamp(v, lo, hi, std::less<>());
 }
 
-static std::vector<char const*> getDeviceExtensions()
+static std::vector<char const*> getDeviceExtensions(bool headless)
 {
     std::vector<char const*> extensions;
 
-    extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    if (!headless) {
+        extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
 
     return extensions;
 }
 
-static std::vector<char const*> getInstanceExtensions()
+static std::vector<char const*> getInstanceExtensions(bool headless)
 {
     std::vector<char const*> extensions;
 
+#if defined(_DEBUG)
+    extensions.push_back("VK_EXT_debug_utils");
+#endif
+    if (headless) {
+        return extensions;
+    }
+
     extensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
 #if  defined(VK_USE_PLATFORM_ANDROID_KHR)
     extensions.push_back(VK_KHR_ANDROID_SURFACE_EXTENSION_NAME);
@@ -83,10 +95,6 @@ static std::vector<char const*> getInstanceExtensions()
     extensions.push_back(VK_EXT_ACQUIRE_XLIB_DISPLAY_EXTENSION_NAME);
 #endif
 
-#if defined(_DEBUG)
-    extensions.push_back("VK_EXT_debug_utils");
-#endif
-
     return extensions;
 }
 
@@ -114,12 +122,15 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
     return VK_FALSE;
 }
 
-vkRender::vkRender(SDL_Window* window, std::shared_ptr<Camera> pTrackBall, uint32_t width, uint32_t height)
+vkRender::vkRender(SDL_Window* window, std::shared_ptr<Camera> pTrackBall, uint32_t width, uint32_t height, uint32_t sceneInstances, bool depthPrepass)
 {
     m_vulkan.window = window;
+    m_headless = (window == nullptr);
     m_pCamera = pTrackBall;
     m_width = width;
     m_height = height;
+    m_sceneInstances = std::max(sceneInstances, 1u);
+    m_depthPrepass = depthPrepass;
 
     initVulkan(width, height);
 }
@@ -127,89 +138,145 @@ vkRender::vkRender(SDL_Window* window, std::shared_ptr<Camera> pTrackBall, uint3
 
 vkRender::~vkRender()
 {
+    savePipelineCache();
+    m_vulkan.deletionQueue.flush();
     m_vulkan.instance->destroyDebugUtilsMessengerEXT(m_vulkan.dbgMessenger, nullptr, m_vulkan.dldi);
 }
 
 int vkRender::initVulkan(uint32_t width, uint32_t height)
 {
-    createInstance();
-    setupDebugMessenger();
-    createSurface();
-    pickPhysicalDevice();
-    createLogicalDevice();
-
-    createSwapChain(width, height);
-    createRenderPass();
-    createDescriptorSetLayout();
-    createGraphicsPipeline();
-    createCommandPool();
-
-    createColorResources();
-    createDepthResources();
-    createFrameBuffers();
-
-    loadModel();
-
-    createTextureImage();
-    createTextureSampler();
-    createVertexBuffer();
-    createIndexBuffer();
-    
-    createUniformBuffer();
-    createDescriptorPool();
-    createDescriptorSets();
-    createCommandBuffers();
+    VK_TRACE_FUNCTION();
+    // Each step is timed into the profiler so startup cost can be broken down per stage
+    auto initStage = [this](const char* name, auto&& step) {
+        auto start = std::chrono::high_resolution_clock::now();
+        step();
+        m_profiler.addInitStage(name, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+    };
 
-    createSyncObjects();
+    initStage("instance", [&] {
+        createInstance();
+        setupDebugMessenger();
+        createSurface();
+    });
+    initStage("device", [&] {
+        pickPhysicalDevice();
+        createLogicalDevice();
+        selectVertexFormat();
+    });
+    initStage("pipelineCache", [&] { createPipelineCache(); });
+
+    // The scene decides which culling passes come up, and with them whether the depth attachment feeds a pyramid
+    initStage("loadModel", [&] { loadModel(); });
+    initStage("scene", [&] {
+        createScene();
+        selectCulling();
+    });
+
+    initStage("swapChain", [&] { createSwapChain(width, height); });
+    initStage("renderPass", [&] { createRenderPass(); });
+    initStage("descriptorSetLayout", [&] { createDescriptorSetLayout(); });
+    initStage("graphicsPipeline", [&] { createGraphicsPipeline(); });
+    initStage("commandPool", [&] { createCommandPool(); });
+
+    initStage("attachments", [&] {
+        createColorResources();
+        createDepthResources();
+        createFrameBuffers();
+    });
+
+    initStage("textureImage", [&] { createTextureImage(); });
+    initStage("textureSampler", [&] { createTextureSampler(); });
+    initStage("vertexBuffer", [&] { createVertexBuffer(); });
+    initStage("indexBuffer", [&] { createIndexBuffer(); });
+    initStage("instanceBuffer", [&] {
+        createInstanceBuffer();
+        createObjectBuffers();
+        createCpuCulling();
+    });
+    initStage("meshletBuffer", [&] { createMeshletBuffer(); });
+    initStage("uploadSubmit", [&] {
+        m_vulkan.upload->submit();
+        // Everything has been copied into staging memory, the mapped and packed mesh are no longer needed
+        m_vulkan.meshCache.close();
+        std::vector<uint8_t>().swap(m_vulkan.vertexData);
+        std::vector<uint8_t>().swap(m_vulkan.indexData);
+    });
+
+    initStage("descriptors", [&] {
+        createUniformBuffer();
+        createDescriptorPool();
+        createDescriptorSets();
+    });
+    initStage("cullPass", [&] {
+        createDepthPyramid();
+        createCullPass();
+        createObjectCullPass();
+    });
+    initStage("commandBuffers", [&] { createCommandBuffers(); });
+
+    initStage("syncObjects", [&] {
+        createSyncObjects();
+        m_profiler.initGpu(m_vulkan.physicalDevice, *m_vulkan.device, m_vulkan.gQueue.familyIndex, m_max_frame_in_flight);
+    });
+
+    m_vulkan.allocator->logStats();
 
     return 0;
 }
 
 void vkRender::cleanupSwapChain()
 {
-    for (auto& swapChainBuffer : m_vulkan.swapChain.frameBuffers) {
-        swapChainBuffer.reset();
-        // m_vulkan.device->destroyFramebuffer(*swapChainBuffer);
-    }
-    for (size_t i = 0; i < m_vulkan.commandBuffers.size(); ++i) {
-        m_vulkan.commandBuffers[i].reset();
-        //m_vulkan.uniformBuffer[i].reset();
-        //m_vulkan.uniformBufferMemory[i].reset();
-        m_vulkan.descriptorSets[i].reset();
-    }
-
-    m_vulkan.pipeLine.reset();
-    m_vulkan.pipelineLayout.reset();
-    m_vulkan.renderPass.reset();
-
-    for (auto& imageView : m_vulkan.swapChain.views) {
-        imageView.reset();
-    }
+    // Frames already submitted may still render into these, hand them to the deletion queue
+    // instead of draining the device; they are released once the in-flight fences pass them
+    auto& deletionQueue = m_vulkan.deletionQueue;
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.swapChain.frameBuffers));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.swapChain.views));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.swapChain.offscreenImages));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.swapChain.offscreenMemory));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.colorImageView));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.colorImage));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.colorImageMemory));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.depthImageView));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.depthImage));
+    deletionQueue.defer(m_frameNumber, std::move(m_vulkan.depthImageMemory));
+    m_vulkan.swapChain.frameBuffers.clear();
     m_vulkan.swapChain.views.clear();
-    m_vulkan.swapChain.swapChainKHR.reset();
+    m_vulkan.swapChain.offscreenImages.clear();
+    m_vulkan.swapChain.offscreenMemory.clear();
 }
 
 void vkRender::recreateSwapChain(uint32_t width, uint32_t height)
 {
-    m_vulkan.device->waitIdle();
-
+    VK_TRACE_FUNCTION();
+    vk::Format oldFormat = m_vulkan.swapChain.format;
     cleanupSwapChain();
 
     createSwapChain(width, height);
-    createRenderPass();
-    createGraphicsPipeline();
+    if (m_vulkan.swapChain.format != oldFormat) {
+        m_vulkan.device->waitIdle();
+
+        // Only a surface format change invalidates the render pass and the pipelines built against it
+        m_vulkan.pipeLine.reset();
+        m_vulkan.prepassPipeline.reset();
+        m_vulkan.pipelineLayout.reset();
+        m_vulkan.renderPass.reset();
+        createRenderPass();
+        createGraphicsPipeline();
+    }
     createColorResources();
     createDepthResources();
     createFrameBuffers();
-
-    //createUniformBuffer();
-    createDescriptorPool();
-    createDescriptorSets();
-    createCommandBuffers();
+    if (m_vulkan.depthPyramid) {
+        m_vulkan.depthPyramid->resize(*m_vulkan.depthImageView, m_vulkan.swapChain.extent.width, m_vulkan.swapChain.extent.height,
+                                      m_vulkan.deletionQueue, m_frameNumber);
+    }
+    m_vulkan.upload->submit();
 }
 
 int vkRender::resizeWindow(int32_t width, int32_t height)
 {
+    m_width = width;
+    m_height = height;
     recreateSwapChain(width, height);
 
     return 0;
@@ -236,16 +303,37 @@ void vkRender::findQueueFamilies(bool presentSupport = true)
             break;
         }
     }
+    if (!presentSupport) {
+        // Nothing is presented, route the (unused) present queue to graphics
+        m_vulkan.pQueue.familyIndex = m_vulkan.gQueue.familyIndex;
+    }
+
+    // Prefer a transfer-only family (DMA engine), then any non-graphics family that can copy,
+    // and fall back to the graphics family itself
+    m_vulkan.tQueue.familyIndex = m_vulkan.gQueue.familyIndex;
+    int bestScore = 0;
+    for (auto& qFamily : qFamilies) {
+        uint32_t qIdx = static_cast<uint32_t>(&qFamily - &qFamilies[0]);
+        if (!(qFamily.queueFlags & (vk::QueueFlagBits::eTransfer | vk::QueueFlagBits::eCompute)) || (qFamily.queueFlags & vk::QueueFlagBits::eGraphics)) {
+            continue;
+        }
+        int score = (qFamily.queueFlags & vk::QueueFlagBits::eCompute) ? 1 : 2;
+        if (score > bestScore) {
+            bestScore = score;
+            m_vulkan.tQueue.familyIndex = qIdx;
+        }
+    }
 
     return;
 }
 
 void vkRender::createInstance()
 {
+    VK_TRACE_FUNCTION();
     std::vector<vk::ExtensionProperties> availExtensions = vk::enumerateInstanceExtensionProperties();
     std::vector<vk::LayerProperties> availableLayers = vk::enumerateInstanceLayerProperties();
 
-    std::vector<const char *> extensions = getInstanceExtensions();
+    std::vector<const char *> extensions = getInstanceExtensions(m_headless);
     std::vector<const char *> layers = getInstanceLayers();
 
     vk::ApplicationInfo appInfo = vk::ApplicationInfo()
@@ -271,7 +359,7 @@ void vkRender::createInstance()
 
 void vkRender::setupDebugMessenger()
 {
-
+    VK_TRACE_FUNCTION();
     vk::DebugUtilsMessengerCreateInfoEXT debugCreateInfo = vk::DebugUtilsMessengerCreateInfoEXT()
         .setMessageSeverity(vk::DebugUtilsMessageSeverityFlagBitsEXT::eError | vk::DebugUtilsMessageSeverityFlagBitsEXT::eVerbose | vk::DebugUtilsMessageSeverityFlagBitsEXT::eWarning)
         .setMessageType(vk::DebugUtilsMessageTypeFlagBitsEXT::eGeneral | vk::DebugUtilsMessageTypeFlagBitsEXT::eValidation | vk::DebugUtilsMessageTypeFlagBitsEXT::ePerformance)
@@ -283,6 +371,11 @@ void vkRender::setupDebugMessenger()
 
 void vkRender::createSurface()
 {
+    VK_TRACE_FUNCTION();
+    if (m_headless) {
+        return;
+    }
+
     VkSurfaceKHR c_surface;
     if (!SDL_Vulkan_CreateSurface(m_vulkan.window, static_cast<VkInstance>(*m_vulkan.instance), &c_surface)) {
         std::cout << "Could not create a Vulkan surface." << std::endl;
@@ -293,54 +386,211 @@ void vkRender::createSurface()
 
 void vkRender::pickPhysicalDevice()
 {
+    VK_TRACE_FUNCTION();
     std::vector<vk::PhysicalDevice> phyDevices = m_vulkan.instance->enumeratePhysicalDevices(m_vulkan.dldi);
 
     vk::PhysicalDevice physicalDevice;
     uint32_t pqIdx = -1;
     uint32_t gqIdx = -1;
+    int bestScore = 0;
     for (auto dev : phyDevices) {
         vk::PhysicalDeviceProperties deviceProperties = dev.getProperties();
         vk::PhysicalDeviceFeatures deviceFeatures = dev.getFeatures();
         //vk::PhysicalDeviceProperties2 deviceProperties2 = device.getProperties2(dldi);
         //vk::PhysicalDeviceFeatures2 deviceFeatures2 = device.getFeatures2(dldi);
-        if (deviceProperties.deviceType == vk::PhysicalDeviceType::eDiscreteGpu || deviceProperties.deviceType == vk::PhysicalDeviceType::eIntegratedGpu) {
-            m_vulkan.physicalDevice = dev;
-            m_vulkan.sampleCount = getMaxUsableSampleCount();
-            return;
-        } else {
-            continue;
+        // Real GPUs first; CPU/virtual implementations (e.g. lavapipe) are accepted for headless runs
+        int score = 0;
+        switch (deviceProperties.deviceType) {
+        case vk::PhysicalDeviceType::eDiscreteGpu: score = 4; break;
+        case vk::PhysicalDeviceType::eIntegratedGpu: score = 3; break;
+        case vk::PhysicalDeviceType::eVirtualGpu: score = m_headless ? 2 : 0; break;
+        case vk::PhysicalDeviceType::eCpu: score = m_headless ? 1 : 0; break;
+        default: break;
+        }
+        if (score > bestScore) {
+            bestScore = score;
+            physicalDevice = dev;
         }
     }
-    //"Cant find right physicalDevice";
+    if (!physicalDevice) {
+        throw std::runtime_error("Cant find a suitable physical device");
+    }
+
+    m_vulkan.physicalDevice = physicalDevice;
+    m_vulkan.sampleCount = getMaxUsableSampleCount();
+    spdlog::info("Using physical device {}", physicalDevice.getProperties().deviceName);
     return;
 }
 
 void vkRender::createLogicalDevice()
 {
-    findQueueFamilies();
-    float queuePriority = 1.0f;
+    VK_TRACE_FUNCTION();
+    findQueueFamilies(!m_headless);
+    float queuePriority[2] = { 1.0f, 1.0f };
     std::vector<vk::DeviceQueueCreateInfo> dqCreateInfoArray;
     vk::DeviceQueueCreateInfo deviceQueueCreateInfo;
-    deviceQueueCreateInfo.setPQueuePriorities(&queuePriority).setQueueCount(1).setQueueFamilyIndex(m_vulkan.gQueue.familyIndex);
+
+    // Without a dedicated transfer family use a second queue of the graphics family when it has one
+    uint32_t tQueueIndex = 0;
+    if (m_vulkan.tQueue.familyIndex == m_vulkan.gQueue.familyIndex &&
+        m_vulkan.physicalDevice.getQueueFamilyProperties()[m_vulkan.gQueue.familyIndex].queueCount > 1) {
+        tQueueIndex = 1;
+    }
+
+    deviceQueueCreateInfo.setPQueuePriorities(queuePriority).setQueueCount(1 + tQueueIndex).setQueueFamilyIndex(m_vulkan.gQueue.familyIndex);
     dqCreateInfoArray.push_back(deviceQueueCreateInfo);
 
+    deviceQueueCreateInfo.setQueueCount(1);
     if (m_vulkan.pQueue.familyIndex != m_vulkan.gQueue.familyIndex) {
         deviceQueueCreateInfo.setQueueFamilyIndex(m_vulkan.pQueue.familyIndex);
         dqCreateInfoArray.push_back(deviceQueueCreateInfo);
     }
+    if (m_vulkan.tQueue.familyIndex != m_vulkan.gQueue.familyIndex && m_vulkan.tQueue.familyIndex != m_vulkan.pQueue.familyIndex) {
+        deviceQueueCreateInfo.setQueueFamilyIndex(m_vulkan.tQueue.familyIndex);
+        dqCreateInfoArray.push_back(deviceQueueCreateInfo);
+    }
 
     vk::DeviceCreateInfo deviceCreateInfo = vk::DeviceCreateInfo(vk::DeviceCreateFlags(), static_cast<uint32_t>(dqCreateInfoArray.size()), dqCreateInfoArray.data());
-    auto deviceExtensions = getDeviceExtensions();
+    auto deviceExtensions = getDeviceExtensions(m_headless);
+
+    // Optional, meshlet culling needs multi draw indirect and GPU culling compacts its draws better with a GPU side count
+    m_vulkan.drawIndirectCount = false;
+    for (const auto& extension : m_vulkan.physicalDevice.enumerateDeviceExtensionProperties()) {
+        if (strcmp(extension.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0) {
+            deviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+            m_vulkan.drawIndirectCount = true;
+        }
+    }
+    // GPU object culling writes indirect draws that start at the instance range of their level
+    vk::PhysicalDeviceFeatures supportedFeatures = m_vulkan.physicalDevice.getFeatures();
+    vk::PhysicalDeviceFeatures deviceFeatures;
+    deviceFeatures.setMultiDrawIndirect(supportedFeatures.multiDrawIndirect);
+    deviceFeatures.setDrawIndirectFirstInstance(supportedFeatures.drawIndirectFirstInstance);
+    m_vulkan.multiDrawIndirect = deviceFeatures.multiDrawIndirect != 0;
+    m_vulkan.drawIndirectFirstInstance = deviceFeatures.drawIndirectFirstInstance != 0;
+
     deviceCreateInfo.setEnabledExtensionCount(static_cast<uint32_t>(deviceExtensions.size()));
     deviceCreateInfo.setPpEnabledExtensionNames(deviceExtensions.data());
+    deviceCreateInfo.setPEnabledFeatures(&deviceFeatures);
     m_vulkan.device = m_vulkan.physicalDevice.createDeviceUnique(deviceCreateInfo);
+    // Device level entry points of the extensions
+    m_vulkan.dldi.init(*m_vulkan.instance, *m_vulkan.device);
 
     m_vulkan.gQueue.queue = m_vulkan.device->getQueue(m_vulkan.gQueue.familyIndex, 0);
     m_vulkan.pQueue.queue = m_vulkan.device->getQueue(m_vulkan.pQueue.familyIndex, 0);
+    m_vulkan.tQueue.queue = m_vulkan.device->getQueue(m_vulkan.tQueue.familyIndex, tQueueIndex);
+    spdlog::info("Upload queue family {} index {} (graphics family {})", m_vulkan.tQueue.familyIndex, tQueueIndex, m_vulkan.gQueue.familyIndex);
+
+    m_vulkan.allocator = std::make_unique<vkAllocator>(m_vulkan.physicalDevice, *m_vulkan.device);
+}
+
+void vkRender::selectVertexFormat()
+{
+    // The compact formats are near universal for vertex fetch, fall back to floats where they are not
+    auto supported = [this](vk::Format format) {
+        return bool(m_vulkan.physicalDevice.getFormatProperties(format).bufferFeatures & vk::FormatFeatureFlagBits::eVertexBuffer);
+    };
+    if (!supported(m_vertexFormat.positionFormat())) {
+        spdlog::warn("Quantized vertex positions not supported, using floats");
+        m_vertexFormat.position = vkVertexFormat::Position::eFloat32;
+    }
+    if (!supported(m_vertexFormat.texCoordFormat())) {
+        spdlog::warn("Compact texture coordinates not supported, using floats");
+        m_vertexFormat.texCoord = vkVertexFormat::TexCoord::eFloat32;
+    }
+    if (m_vertexFormat.color && !supported(m_vertexFormat.colorFormat())) {
+        spdlog::warn("Packed vertex colors not supported, using white");
+        m_vertexFormat.color = false;
+    }
+    spdlog::info("Vertex format: {} bytes per vertex", m_vertexFormat.stride());
+}
+
+void vkRender::createPipelineCache()
+{
+    VK_TRACE_FUNCTION();
+    std::vector<char> cacheData;
+
+    std::ifstream file(m_pipelineCacheFile, std::ios::binary | std::ios::ate);
+    if (file.is_open()) {
+        cacheData.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(cacheData.data(), cacheData.size());
+    }
+
+    // Only hand the blob to the driver if the header matches this device, a stale cache from
+    // another GPU or driver build is simply discarded
+    struct PipelineCacheHeader
+    {
+        uint32_t length;
+        uint32_t version;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint8_t uuid[VK_UUID_SIZE];
+    };
+
+    bool valid = false;
+    if (cacheData.size() >= sizeof(PipelineCacheHeader)) {
+        PipelineCacheHeader header;
+        memcpy(&header, cacheData.data(), sizeof(header));
+        auto properties = m_vulkan.physicalDevice.getProperties();
+        valid = header.length >= sizeof(PipelineCacheHeader) &&
+                header.version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+                header.vendorID == properties.vendorID &&
+                header.deviceID == properties.deviceID &&
+                memcmp(header.uuid, &properties.pipelineCacheUUID[0], VK_UUID_SIZE) == 0;
+    }
+    if (!valid) {
+        if (!cacheData.empty()) {
+            spdlog::info("Discarding pipeline cache {}, it was built for another device or driver", m_pipelineCacheFile);
+        }
+        cacheData.clear();
+    }
+
+    vk::PipelineCacheCreateInfo cacheInfo;
+    cacheInfo.setInitialDataSize(cacheData.size()).setPInitialData(cacheData.empty() ? nullptr : cacheData.data());
+    m_vulkan.pipelineCache = m_vulkan.device->createPipelineCacheUnique(cacheInfo);
+}
+
+void vkRender::savePipelineCache()
+{
+    if (!m_vulkan.pipelineCache) {
+        return;
+    }
+
+    auto cacheData = m_vulkan.device->getPipelineCacheData(*m_vulkan.pipelineCache);
+    std::ofstream file(m_pipelineCacheFile, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        spdlog::warn("Could not write pipeline cache {}", m_pipelineCacheFile);
+        return;
+    }
+    file.write(reinterpret_cast<const char*>(cacheData.data()), cacheData.size());
+}
+
+void vkRender::createOffscreenImages(uint32_t width, uint32_t height)
+{
+    m_vulkan.swapChain.format = vk::Format::eR8G8B8A8Unorm;
+    m_vulkan.swapChain.extent = vk::Extent2D(std::max(width, 1u), std::max(height, 1u));
+    m_vulkan.swapChain.images.clear();
+    m_vulkan.swapChain.offscreenImages.resize(m_offscreenImageCount);
+    m_vulkan.swapChain.offscreenMemory.resize(m_offscreenImageCount);
+
+    for (uint32_t i = 0; i < m_offscreenImageCount; ++i) {
+        utilCreateImage(m_vulkan.swapChain.extent.width, m_vulkan.swapChain.extent.height, 1, vk::SampleCountFlagBits::e1, m_vulkan.swapChain.format, vk::ImageTiling::eOptimal,
+                        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                        m_vulkan.swapChain.offscreenImages[i], m_vulkan.swapChain.offscreenMemory[i]);
+        m_vulkan.swapChain.images.push_back(*m_vulkan.swapChain.offscreenImages[i]);
+        m_vulkan.swapChain.views.emplace_back(utilCreateImageView(m_vulkan.swapChain.images.back(), m_vulkan.swapChain.format, vk::ImageAspectFlagBits::eColor, 1));
+    }
 }
 
 void vkRender::createSwapChain(uint32_t width, uint32_t height)
 {
+    VK_TRACE_FUNCTION();
+    if (m_headless) {
+        createOffscreenImages(width, height);
+        return;
+    }
+
     SwapChainSupportDetails swapchainSupportDetails;
     swapchainSupportDetails.capabilities = m_vulkan.physicalDevice.getSurfaceCapabilitiesKHR(m_vulkan.surfaceKHR);
     swapchainSupportDetails.presentModes = m_vulkan.physicalDevice.getSurfacePresentModesKHR(m_vulkan.surfaceKHR);
@@ -391,8 +641,10 @@ void vkRender::createSwapChain(uint32_t width, uint32_t height)
         imageCount = swapchainSupportDetails.capabilities.maxImageCount;
     }
 
+    // Hand the current swapchain over so the presentation engine can keep showing its images while we switch
+    vk::SwapchainKHR oldSwapchain = m_vulkan.swapChain.swapChainKHR ? *m_vulkan.swapChain.swapChainKHR : vk::SwapchainKHR();
     vk::SwapchainCreateInfoKHR swapChainCreateInfo(vk::SwapchainCreateFlagsKHR(), m_vulkan.surfaceKHR, imageCount, surfaceFormatKHR.format, surfaceFormatKHR.colorSpace,
-                                                   swapchainExtent, 1, vk::ImageUsageFlagBits::eColorAttachment, vk::SharingMode::eExclusive, 0, nullptr, preTransform, compositeAlpha, swapchainPresentMode, true, nullptr);
+                                                   swapchainExtent, 1, vk::ImageUsageFlagBits::eColorAttachment, vk::SharingMode::eExclusive, 0, nullptr, preTransform, compositeAlpha, swapchainPresentMode, true, oldSwapchain);
 
     if (m_vulkan.gQueue.familyIndex !=m_vulkan.pQueue.familyIndex) {
         uint32_t queueFamilyIndices[2] = { m_vulkan.pQueue.familyIndex, m_vulkan.gQueue.familyIndex};
@@ -403,7 +655,11 @@ void vkRender::createSwapChain(uint32_t width, uint32_t height)
         swapChainCreateInfo.pQueueFamilyIndices = queueFamilyIndices;
     }
 
-    m_vulkan.swapChain.swapChainKHR = m_vulkan.device->createSwapchainKHRUnique(swapChainCreateInfo);
+    auto swapChainKHR = m_vulkan.device->createSwapchainKHRUnique(swapChainCreateInfo);
+    if (m_vulkan.swapChain.swapChainKHR) {
+        m_vulkan.deletionQueue.defer(m_frameNumber, std::move(m_vulkan.swapChain.swapChainKHR));
+    }
+    m_vulkan.swapChain.swapChainKHR = std::move(swapChainKHR);
     m_vulkan.swapChain.images = m_vulkan.device->getSwapchainImagesKHR(*m_vulkan.swapChain.swapChainKHR);
     m_vulkan.swapChain.format = surfaceFormatKHR.format;
     m_vulkan.swapChain.extent = swapchainExtent;
@@ -419,11 +675,12 @@ void vkRender::createSwapChain(uint32_t width, uint32_t height)
 
 void vkRender::createRenderPass()
 {
+    VK_TRACE_FUNCTION();
     vk::AttachmentDescription depthAttachment;
     depthAttachment.setFormat(findDepthFormat())
         .setSamples(m_vulkan.sampleCount)
         .setLoadOp(vk::AttachmentLoadOp::eClear)
-        .setStoreOp(vk::AttachmentStoreOp::eDontCare)
+        .setStoreOp(m_occlusionCulling ? vk::AttachmentStoreOp::eStore : vk::AttachmentStoreOp::eDontCare)
         .setStencilLoadOp(vk::AttachmentLoadOp::eDontCare)
         .setStencilStoreOp(vk::AttachmentStoreOp::eDontCare)
         .setInitialLayout(vk::ImageLayout::eUndefined)
@@ -448,7 +705,7 @@ void vkRender::createRenderPass()
         .setSamples(vk::SampleCountFlagBits::e1)
         .setLoadOp(vk::AttachmentLoadOp::eDontCare)
         .setStoreOp(vk::AttachmentStoreOp::eStore)
-        .setFinalLayout(vk::ImageLayout::ePresentSrcKHR);
+        .setFinalLayout(m_headless ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR);
     
     vk::AttachmentReference colorAttachmentResolveRef;
     colorAttachmentResolveRef.setAttachment(2).setLayout(vk::ImageLayout::eColorAttachmentOptimal);
@@ -481,11 +738,12 @@ void vkRender::createRenderPass()
 
 void vkRender::createDescriptorSetLayout()
 {
+    VK_TRACE_FUNCTION();
 
     vk::DescriptorSetLayoutBinding uboLaytoutBinding;
     uboLaytoutBinding.setBinding(0)
         .setDescriptorCount(1)
-        .setDescriptorType(vk::DescriptorType::eUniformBuffer)
+        .setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
         .setStageFlags(vk::ShaderStageFlagBits::eVertex);
 
     vk::DescriptorSetLayoutBinding samplerLayoutBinding;
@@ -494,7 +752,13 @@ void vkRender::createDescriptorSetLayout()
         .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
         .setStageFlags(vk::ShaderStageFlagBits::eFragment);
 
-    std::array<vk::DescriptorSetLayoutBinding, 2> bindings = { uboLaytoutBinding, samplerLayoutBinding };
+    vk::DescriptorSetLayoutBinding instanceLayoutBinding;
+    instanceLayoutBinding.setBinding(2)
+        .setDescriptorCount(1)
+        .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+        .setStageFlags(vk::ShaderStageFlagBits::eVertex);
+
+    std::array<vk::DescriptorSetLayoutBinding, 3> bindings = { uboLaytoutBinding, samplerLayoutBinding, instanceLayoutBinding };
 
     vk::DescriptorSetLayoutCreateInfo layoutInfo;
     layoutInfo.setBindingCount(static_cast<uint32_t>(bindings.size()))
@@ -505,13 +769,22 @@ void vkRender::createDescriptorSetLayout()
 
 void vkRender::createGraphicsPipeline()
 {
-    size_t shaderSize;
-    auto vertShaderCode = vku::instance()->glslCompile("simple.vert", shaderSize, shaderc_vertex_shader);
-    auto vertShaderCreateInfo = vk::ShaderModuleCreateInfo{ vk::ShaderModuleCreateFlags(), shaderSize, vertShaderCode.data() };
+    VK_TRACE_FUNCTION();
+    std::vector<vkuShaderDesc> shaders = {
+        { "simple.vert", shaderc_vertex_shader, m_vertexFormat.getShaderMacros() },
+        { "simple.frag", shaderc_fragment_shader },
+    };
+    if (m_depthPrepass) {
+        shaders.push_back({ "depth.vert", shaderc_vertex_shader });
+    }
+    auto shaderCode = vku::instance()->glslCompileBatch(shaders);
+
+    auto vertShaderCode = shaderCode[0].get();
+    auto vertShaderCreateInfo = vk::ShaderModuleCreateInfo{ vk::ShaderModuleCreateFlags(), vertShaderCode.size() * sizeof(uint32_t), vertShaderCode.data() };
     auto vertShaderModule = m_vulkan.device->createShaderModuleUnique(vertShaderCreateInfo);
 
-    auto fragShaderCode = vku::instance()->glslCompile("simple.frag", shaderSize, shaderc_fragment_shader);
-    auto fragShaderCreateInfo = vk::ShaderModuleCreateInfo{ {}, shaderSize, fragShaderCode.data() };
+    auto fragShaderCode = shaderCode[1].get();
+    auto fragShaderCreateInfo = vk::ShaderModuleCreateInfo{ {}, fragShaderCode.size() * sizeof(uint32_t), fragShaderCode.data() };
     auto fragShaderModule = m_vulkan.device->createShaderModuleUnique(fragShaderCreateInfo);
 
     vk::PipelineShaderStageCreateInfo vertShaderStageInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eVertex,*vertShaderModule, "main");
@@ -519,15 +792,20 @@ void vkRender::createGraphicsPipeline()
 
     vk::PipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
 
+    // Binding 0 is the mesh vertex buffer, binding 1 the per instance transforms
     vk::PipelineVertexInputStateCreateInfo vertexInputInfo;
-    vertexInputInfo.setVertexBindingDescriptionCount(1).setPVertexBindingDescriptions(&Vertex::getBindingDescription());
-    auto vtxAttrDesc = Vertex::getAttributeDescription();
+    std::array<vk::VertexInputBindingDescription, 2> vtxBindingDesc = { m_vertexFormat.getBindingDescription(), vkScene::getBindingDescription() };
+    vertexInputInfo.setVertexBindingDescriptionCount(static_cast<uint32_t>(vtxBindingDesc.size())).setPVertexBindingDescriptions(vtxBindingDesc.data());
+    auto vtxAttrDesc = m_vertexFormat.getAttributeDescription();
+    auto instanceAttrDesc = vkScene::getAttributeDescription();
+    vtxAttrDesc.insert(vtxAttrDesc.end(), instanceAttrDesc.begin(), instanceAttrDesc.end());
     vertexInputInfo.setVertexAttributeDescriptionCount(static_cast<uint32_t>(vtxAttrDesc.size())).setPVertexAttributeDescriptions(vtxAttrDesc.data());
     vk::PipelineInputAssemblyStateCreateInfo inputAssembly(vk::PipelineInputAssemblyStateCreateFlags(), vk::PrimitiveTopology::eTriangleList);
 
-    vk::Viewport viewport(0, 0, float(m_vulkan.swapChain.extent.width), float(m_vulkan.swapChain.extent.height), 0.0, 1.0);
-    vk::Rect2D scissor(vk::Offset2D(0, 0), vk::Extent2D(m_vulkan.swapChain.extent));
-    vk::PipelineViewportStateCreateInfo viewportState(vk::PipelineViewportStateCreateFlags(), 1, &viewport, 1, &scissor);
+    // Viewport and scissor are dynamic so the pipeline survives swapchain resizes
+    vk::PipelineViewportStateCreateInfo viewportState(vk::PipelineViewportStateCreateFlags(), 1, nullptr, 1, nullptr);
+    std::array<vk::DynamicState, 2> dynamicStates = { vk::DynamicState::eViewport, vk::DynamicState::eScissor };
+    vk::PipelineDynamicStateCreateInfo dynamicState(vk::PipelineDynamicStateCreateFlags(), static_cast<uint32_t>(dynamicStates.size()), dynamicStates.data());
 
     vk::PipelineRasterizationStateCreateInfo rasterizer(vk::PipelineRasterizationStateCreateFlags(), 0, 0, vk::PolygonMode::eFill, vk::CullModeFlagBits::eBack, vk::FrontFace::eClockwise, 0, 0, 0, 0, 1.0);
 
@@ -535,11 +813,12 @@ void vkRender::createGraphicsPipeline()
     vk::PipelineMultisampleStateCreateInfo multisampling;
     multisampling.setRasterizationSamples(m_vulkan.sampleCount);
 
+    // After a depth prepass only the nearest surface passes, and depth is already final
     vk::PipelineDepthStencilStateCreateInfo depthStencil;
     depthStencil.setStencilTestEnable(0)
         .setDepthTestEnable(1)
-        .setDepthWriteEnable(1)
-        .setDepthCompareOp(vk::CompareOp::eLessOrEqual)
+        .setDepthWriteEnable(m_depthPrepass ? 0 : 1)
+        .setDepthCompareOp(m_depthPrepass ? vk::CompareOp::eEqual : vk::CompareOp::eLessOrEqual)
         .setDepthBoundsTestEnable(0)
         .setMinDepthBounds(0.0f)
         .setMaxDepthBounds(1.0f);
@@ -564,17 +843,37 @@ void vkRender::createGraphicsPipeline()
         .setPMultisampleState(&multisampling)
         .setPDepthStencilState(&depthStencil)
         .setPColorBlendState(&colorBlending)
+        .setPDynamicState(&dynamicState)
         .setLayout(*m_vulkan.pipelineLayout)
         .setRenderPass(*m_vulkan.renderPass)
         .setSubpass(0);
 
-    m_vulkan.pipeLine = m_vulkan.device->createGraphicsPipelineUnique(vk::PipelineCache(), pipelineCreateInfo);
+    m_vulkan.pipeLine = m_vulkan.device->createGraphicsPipelineUnique(*m_vulkan.pipelineCache, pipelineCreateInfo);
+
+    if (m_depthPrepass) {
+        // Depth only: the position stream and the instance stream, no fragment shader, no color writes
+        auto depthShaderCode = shaderCode[2].get();
+        auto depthShaderCreateInfo = vk::ShaderModuleCreateInfo{ {}, depthShaderCode.size() * sizeof(uint32_t), depthShaderCode.data() };
+        auto depthShaderModule = m_vulkan.device->createShaderModuleUnique(depthShaderCreateInfo);
+        vk::PipelineShaderStageCreateInfo depthShaderStageInfo(vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eVertex, *depthShaderModule, "main");
 
+        vtxBindingDesc[0] = m_vertexFormat.getPositionBindingDescription();
+        std::vector<vk::VertexInputAttributeDescription> depthAttrDesc = { m_vertexFormat.getPositionAttributeDescription() };
+        depthAttrDesc.insert(depthAttrDesc.end(), instanceAttrDesc.begin(), instanceAttrDesc.end());
+        vertexInputInfo.setVertexAttributeDescriptionCount(static_cast<uint32_t>(depthAttrDesc.size())).setPVertexAttributeDescriptions(depthAttrDesc.data());
+
+        depthStencil.setDepthWriteEnable(1).setDepthCompareOp(vk::CompareOp::eLessOrEqual);
+        colorBlendAttachment.setColorWriteMask(vk::ColorComponentFlags());
+
+        pipelineCreateInfo.setStageCount(1).setPStages(&depthShaderStageInfo);
+        m_vulkan.prepassPipeline = m_vulkan.device->createGraphicsPipelineUnique(*m_vulkan.pipelineCache, pipelineCreateInfo);
+    }
 }
 
 
 void vkRender::createFrameBuffers()
 {
+    VK_TRACE_FUNCTION();
     m_vulkan.swapChain.frameBuffers.resize(m_vulkan.swapChain.views.size());
 
     for (size_t i = 0; i < m_vulkan.swapChain.views.size(); ++i) {
@@ -598,18 +897,28 @@ void vkRender::createFrameBuffers()
 
 void vkRender::createCommandPool()
 {
+    VK_TRACE_FUNCTION();
     vk::CommandPoolCreateInfo poolInfo;
-    poolInfo.setQueueFamilyIndex(m_vulkan.gQueue.familyIndex);
+    poolInfo.setQueueFamilyIndex(m_vulkan.gQueue.familyIndex).setFlags(vk::CommandPoolCreateFlagBits::eResetCommandBuffer);
     m_vulkan.commandPool = m_vulkan.device->createCommandPoolUnique(poolInfo);
 
+    m_vulkan.upload = std::make_unique<vkUploadBatch>(*m_vulkan.device, *m_vulkan.allocator, m_vulkan.tQueue.queue, m_vulkan.tQueue.familyIndex,
+                                                      m_vulkan.gQueue.queue, m_vulkan.gQueue.familyIndex);
+
 }
 
 void vkRender::createDepthResources()
 {
+    VK_TRACE_FUNCTION();
     auto depthFormat = findDepthFormat();
 
+    // Sampled as well when the depth pyramid is built from it
+    vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eDepthStencilAttachment;
+    if (m_occlusionCulling) {
+        usage |= vk::ImageUsageFlagBits::eSampled;
+    }
     utilCreateImage(m_vulkan.swapChain.extent.width, m_vulkan.swapChain.extent.height, 1, m_vulkan.sampleCount, depthFormat, vk::ImageTiling::eOptimal,
-                    vk::ImageUsageFlagBits::eDepthStencilAttachment, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                    usage, vk::MemoryPropertyFlagBits::eDeviceLocal,
                     m_vulkan.depthImage, m_vulkan.depthImageMemory);
     m_vulkan.depthImageView = utilCreateImageView(*m_vulkan.depthImage, depthFormat, vk::ImageAspectFlagBits::eDepth, 1);
     
@@ -618,6 +927,7 @@ void vkRender::createDepthResources()
 
 void vkRender::createColorResources()
 {
+    VK_TRACE_FUNCTION();
     auto colorFormat = m_vulkan.swapChain.format;
 
     utilCreateImage(m_vulkan.swapChain.extent.width, m_vulkan.swapChain.extent.height, 1, m_vulkan.sampleCount, colorFormat, vk::ImageTiling::eOptimal,
@@ -631,6 +941,7 @@ void vkRender::createColorResources()
 
 void vkRender::createTextureImage()
 {
+    VK_TRACE_FUNCTION();
     std::string texName = "chalet.jpg";
     int texWidth, texHeight, texChannel;
     std::string fname = vku::instance()->getTextureFileName(texName.c_str());
@@ -643,14 +954,7 @@ void vkRender::createTextureImage()
     }
     m_vulkan.mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
     vk::DeviceSize imageSize = texWidth * texHeight * 4;
-    vk::UniqueBuffer stagingBuffer;
-    vk::UniqueDeviceMemory stagingBufferMemory;
-
-    utilCreateBuffer(imageSize, vk::BufferUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-                 stagingBuffer, stagingBufferMemory);
-    auto data = m_vulkan.device->mapMemory(*stagingBufferMemory, 0, imageSize);
-    memcpy(data, pixels, imageSize);
-    m_vulkan.device->unmapMemory(*stagingBufferMemory);
+    vk::Buffer stagingBuffer = m_vulkan.upload->stage(pixels, imageSize);
     stbi_image_free(pixels);
 
     utilCreateImage(texWidth, texHeight, m_vulkan.mipLevels, vk::SampleCountFlagBits::e1, vk::Format::eR8G8B8A8Unorm, vk::ImageTiling::eOptimal, vk::ImageUsageFlagBits::eTransferDst| vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eSampled, vk::MemoryPropertyFlagBits::eDeviceLocal, m_vulkan.textureImage, m_vulkan.textureImageMemory);
@@ -665,6 +969,7 @@ void vkRender::createTextureImage()
 
 void vkRender::createTextureSampler()
 {
+    VK_TRACE_FUNCTION();
     vk::SamplerCreateInfo samplerInfo;
     samplerInfo.setMinFilter(vk::Filter::eLinear)
         .setMagFilter(vk::Filter::eLinear)
@@ -687,99 +992,372 @@ void vkRender::createTextureSampler()
 
 void vkRender::loadModel()
 {
-    m_vulkan.vertices = {
-        {{-0.3f, -0.3f, 0.0f}, {1.0f, 0.0f, 0.0f}, {0.0f, 0.0f}},
-        {{0.3f, -0.3f, 0.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}},
-        {{0.3f, 0.3f, 0.0f}, {0.0f, 0.0f, 1.0f}, {1.0f, 1.0f}},
-        {{-0.3f, 0.3f, 0.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f}},
-
-        {{-0.5f, -0.5f, 0.5f}, {1.0f, 0.0f, 0.0f}, {0.0f, 0.0f}},
-        {{0.5f, -0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}},
-        {{0.5f, 0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}, {1.0f, 1.0f}},
-        {{-0.5f, 0.5f, 0.5f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f}}
-    };
-
-    m_vulkan.indices = {
-        0, 2, 1, 0, 3, 2,
-        4, 6, 5, 4, 7, 6
-    }; 
-
-    return; 
+    VK_TRACE_FUNCTION();
     m_vulkan.vertices.clear();
     m_vulkan.indices.clear();
+    m_vulkan.meshCache.close();
+    m_vulkan.lods.clear();
+    m_vulkan.meshlets.clear();
+
+    std::string model_path = vku::instance()->getModelFileName(m_modelFileName.c_str());
+    if (model_path.empty()) {
+        // No model around, fall back to the built-in quads
+        m_vulkan.vertices = {
+            {{-0.3f, -0.3f, 0.0f}, {1.0f, 0.0f, 0.0f}, {0.0f, 0.0f}},
+            {{0.3f, -0.3f, 0.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}},
+            {{0.3f, 0.3f, 0.0f}, {0.0f, 0.0f, 1.0f}, {1.0f, 1.0f}},
+            {{-0.3f, 0.3f, 0.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f}},
+
+            {{-0.5f, -0.5f, 0.5f}, {1.0f, 0.0f, 0.0f}, {0.0f, 0.0f}},
+            {{0.5f, -0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}},
+            {{0.5f, 0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}, {1.0f, 1.0f}},
+            {{-0.5f, 0.5f, 0.5f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f}}
+        };
 
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string warn, err;
+        m_vulkan.indices = {
+            0, 2, 1, 0, 3, 2,
+            4, 6, 5, 4, 7, 6
+        };
+        m_vulkan.boundsMin = glm::vec3(-0.5f, -0.5f, 0.0f);
+        m_vulkan.boundsMax = glm::vec3(0.5f, 0.5f, 0.5f);
+        generateLods();
+        buildMeshlets();
+        packMesh();
+        return;
+    }
 
-    std::string model_path = vku::instance()->getModelFileName("chalet.obj");
+    vkMeshSource source = vkMeshSource::fromFile(model_path);
+    std::string cachePath = m_meshCacheDir + m_modelFileName + ".vkmesh";
+    uint32_t cacheFlags = (m_optimizeMesh ? vkMeshCache::kFlagOptimized : 0) | (m_generateLods ? vkMeshCache::kFlagLods : 0);
+    // Parameters the cached levels of detail and meshlets were built with
+    uint32_t settings[] = { m_lodLevels, 0, vkMeshTools::kMeshletMaxVertices, vkMeshTools::kMeshletMaxTriangles };
+    memcpy(&settings[1], &m_lodMaxError, sizeof(float));
+    uint64_t cacheSettings = vkMeshTools::hashBytes(settings, sizeof(settings));
+    vkMeshLayout layout = m_vertexFormat.getMeshLayout();
+    if (m_vulkan.meshCache.open(cachePath, layout, source, cacheFlags, cacheSettings)) {
+        const vkMeshCacheHeader& header = m_vulkan.meshCache.header();
+        uint64_t meshletBytes = 0;
+        auto meshlets = static_cast<const vkMeshlet*>(m_vulkan.meshCache.blobData(vkMeshCache::kBlobMeshlets, meshletBytes));
+        if (meshlets) {
+            m_vulkan.meshlets.assign(meshlets, meshlets + meshletBytes / sizeof(vkMeshlet));
+        }
+        uint64_t lodBytes = 0;
+        auto lods = static_cast<const vkMeshLod*>(m_vulkan.meshCache.blobData(vkMeshCache::kBlobLods, lodBytes));
+        if (lods && lodBytes >= sizeof(vkMeshLod)) {
+            m_vulkan.lods.assign(lods, lods + lodBytes / sizeof(vkMeshLod));
+        } else {
+            m_vulkan.lods.assign(1, vkMeshLod{ 0, header.indexCount, 0, static_cast<uint32_t>(m_vulkan.meshlets.size()), 0.0f, {} });
+        }
+
+        // The cache only checks the vertex and index blobs, the ranges inside the others are checked here
+        bool valid = meshletBytes % sizeof(vkMeshlet) == 0 && lodBytes % sizeof(vkMeshLod) == 0;
+        for (const auto& lod : m_vulkan.lods) {
+            valid = valid && uint64_t(lod.firstIndex) + lod.indexCount <= header.indexCount
+                && uint64_t(lod.firstMeshlet) + lod.meshletCount <= m_vulkan.meshlets.size();
+        }
+        for (const auto& meshlet : m_vulkan.meshlets) {
+            valid = valid && uint64_t(meshlet.firstIndex) + meshlet.indexCount <= header.indexCount && meshlet.vertexCount <= header.vertexCount;
+        }
+        if (valid) {
+            m_vulkan.indexCount = header.indexCount;
+            m_vulkan.indexType = vkVertexFormat::indexType(header.indexSize);
+            m_vulkan.boundsMin = m_vulkan.meshCache.boundsMin();
+            m_vulkan.boundsMax = m_vulkan.meshCache.boundsMax();
+            m_vulkan.positionTransform = m_vertexFormat.positionTransform(m_vulkan.boundsMin, m_vulkan.boundsMax);
+            spdlog::info("Loaded {} from {}: {} vertices, {} triangles, {} levels of detail", model_path, cachePath, header.vertexCount, m_vulkan.lods[0].indexCount / 3,
+                         m_vulkan.lods.size());
+            return;
+        }
 
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, model_path.c_str())) {
-        throw std::runtime_error(warn + err);
+        spdlog::warn("Mesh cache {} has out of range levels of detail or meshlets, importing {} again", cachePath, model_path);
+        m_vulkan.meshCache.close();
+        m_vulkan.lods.clear();
+        m_vulkan.meshlets.clear();
     }
 
-    std::unordered_map<Vertex, uint32_t> uniqueVertices = {};
+    vkObjMesh mesh;
+    std::string err;
+    if (!vkObjLoader::load(model_path, mesh, err)) {
+        throw std::runtime_error(err);
+    }
 
-    for (const auto& shape : shapes) {
-        for (const auto& index : shape.mesh.indices) {
-            Vertex vertex = {};
+    std::vector<Vertex> corners(mesh.corners.size());
+    for (size_t i = 0; i < mesh.corners.size(); ++i) {
+        const vkObjCorner& corner = mesh.corners[i];
+        Vertex& vertex = corners[i];
 
-            vertex.pos = {
-                attrib.vertices[3 * index.vertex_index + 0],
-                attrib.vertices[3 * index.vertex_index + 1],
-                attrib.vertices[3 * index.vertex_index + 2],
-            };
+        vertex.pos = mesh.positions[corner.position];
 
+        if (corner.texCoord != vkObjLoader::kNoIndex) {
             vertex.texCoord = {
-                attrib.texcoords[2 * index.texcoord_index + 0],
-                1.0 - attrib.texcoords[2 * index.texcoord_index + 1],
+                mesh.texCoords[corner.texCoord].x,
+                1.0f - mesh.texCoords[corner.texCoord].y,
             };
+        } else {
+            vertex.texCoord = { 0.0f, 0.0f };
+        }
+
+        vertex.color = { 1.0f, 1.0f, 1.0f };
+    }
+
+    // The remap table of the unindexed corner stream is exactly the index buffer
+    uint32_t vertexCount = vkMeshTools::generateVertexRemap(corners.data(), corners.size(), sizeof(Vertex), m_vulkan.indices);
+    m_vulkan.vertices.resize(vertexCount);
+    vkMeshTools::remapVertexBuffer(m_vulkan.vertices.data(), corners.data(), corners.size(), sizeof(Vertex), m_vulkan.indices);
+
+    if (m_optimizeMesh && !m_vulkan.indices.empty()) {
+        optimizeMesh();
+    }
+
+    m_vulkan.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+    m_vulkan.boundsMax = glm::vec3(-std::numeric_limits<float>::max());
+    for (const auto& vertex : m_vulkan.vertices) {
+        m_vulkan.boundsMin = glm::min(m_vulkan.boundsMin, glm::vec3(vertex.pos));
+        m_vulkan.boundsMax = glm::max(m_vulkan.boundsMax, glm::vec3(vertex.pos));
+    }
+
+    generateLods();
+    buildMeshlets();
 
-            vertex.color = { 1.0f, 1.0f, 1.0f };
+    spdlog::info("Loaded {}: {} vertices, {} triangles, {} meshlets", model_path, m_vulkan.vertices.size(), m_vulkan.lods[0].indexCount / 3, m_vulkan.meshlets.size());
 
-            if (uniqueVertices.count(vertex) == 0) {
-                uniqueVertices[vertex] = static_cast<uint32_t>(m_vulkan.vertices.size());
-                m_vulkan.vertices.push_back(vertex);
-            } 
+    packMesh();
 
-            m_vulkan.indices.push_back(uniqueVertices[vertex]);
+    uint32_t indexSize = (m_vulkan.indexType == vk::IndexType::eUint16) ? 2 : 4;
+    if (!vkMeshCache::write(cachePath, layout, source, cacheFlags, cacheSettings, m_vulkan.vertexData.data(), static_cast<uint32_t>(m_vulkan.vertices.size()),
+                            m_vulkan.indexData.data(), m_vulkan.indexCount, indexSize, m_vulkan.boundsMin, m_vulkan.boundsMax,
+                            { { vkMeshCache::kBlobMeshlets, m_vulkan.meshlets.data(), m_vulkan.meshlets.size() * sizeof(vkMeshlet) },
+                              { vkMeshCache::kBlobLods, m_vulkan.lods.data(), m_vulkan.lods.size() * sizeof(vkMeshLod) } })) {
+        spdlog::warn("Could not write mesh cache {}", cachePath);
+    }
+}
+
+void vkRender::optimizeMesh()
+{
+    VK_TRACE_FUNCTION();
+    auto& vertices = m_vulkan.vertices;
+    auto& indices = m_vulkan.indices;
+    auto before = vkMeshTools::analyzeVertexCache(indices.data(), indices.size(), vertices.size());
+
+    // Tipsify for the post-transform cache, then order its clusters for overdraw
+    std::vector<uint32_t> clusters;
+    std::vector<uint32_t> reordered(indices.size());
+    vkMeshTools::optimizeVertexCache(reordered.data(), indices.data(), indices.size(), vertices.size(), vkMeshTools::kVertexCacheSize, &clusters);
+    vkMeshTools::optimizeOverdraw(indices.data(), reordered.data(), reordered.size(), &vertices[0].pos.x, sizeof(Vertex), clusters);
+
+    // Store vertices in the order they are first fetched
+    std::vector<uint32_t> remap;
+    uint32_t vertexCount = vkMeshTools::optimizeVertexFetchRemap(remap, indices.data(), indices.size(), vertices.size());
+    std::vector<Vertex> fetchOrdered(vertexCount);
+    vkMeshTools::remapVertexBuffer(fetchOrdered.data(), vertices.data(), vertices.size(), sizeof(Vertex), remap);
+    vkMeshTools::remapIndexBuffer(indices.data(), indices.size(), remap);
+    vertices.swap(fetchOrdered);
+
+    auto after = vkMeshTools::analyzeVertexCache(indices.data(), indices.size(), vertices.size());
+    spdlog::info("Mesh optimization: ACMR {:.3f} -> {:.3f}, ATVR {:.3f} -> {:.3f}, {} overdraw clusters", before.acmr, after.acmr, before.atvr, after.atvr, clusters.size());
+}
 
+void vkRender::generateLods()
+{
+    VK_TRACE_FUNCTION();
+    auto& vertices = m_vulkan.vertices;
+    auto& indices = m_vulkan.indices;
+    m_vulkan.lods.assign(1, vkMeshLod{ 0, static_cast<uint32_t>(indices.size()), 0, 0, 0.0f, {} });
+    m_vulkan.indexCount = static_cast<uint32_t>(indices.size());
+    if (!m_generateLods || indices.empty()) {
+        return;
+    }
+
+    // Every level targets half the triangles of the previous one. All of them are simplified from the
+    // full resolution mesh, so their error is measured against it and stays below the limit.
+    float targetError = m_lodMaxError * glm::length(m_vulkan.boundsMax - m_vulkan.boundsMin);
+    const std::vector<uint32_t> source(indices);
+    std::vector<uint32_t> simplified(source.size());
+    std::vector<uint32_t> optimized(source.size());
+    size_t previousCount = source.size();
+    while (m_vulkan.lods.size() < m_lodLevels) {
+        float error = 0.0f;
+        size_t count = vkMeshTools::simplify(simplified.data(), source.data(), source.size(), &vertices[0].pos.x, vertices.size(), sizeof(Vertex),
+                                             previousCount / 6 * 3, targetError, &error);
+        if (count == 0 || count > previousCount * 9 / 10) {
+            // Stuck on locked vertices or at the error limit
+            break;
         }
+
+        vkMeshLod lod = {};
+        lod.firstIndex = static_cast<uint32_t>(indices.size());
+        lod.indexCount = static_cast<uint32_t>(count);
+        lod.error = error;
+        m_vulkan.lods.push_back(lod);
+        previousCount = count;
+
+        vkMeshTools::optimizeVertexCache(optimized.data(), simplified.data(), count, vertices.size());
+        indices.insert(indices.end(), optimized.begin(), optimized.begin() + count);
     }
+    m_vulkan.indexCount = static_cast<uint32_t>(indices.size());
 
+    for (size_t i = 1; i < m_vulkan.lods.size(); ++i) {
+        spdlog::info("LOD {}: {} triangles, error {:.5f}", i, m_vulkan.lods[i].indexCount / 3, m_vulkan.lods[i].error);
+    }
 }
 
-void vkRender::createVertexBuffer()
+void vkRender::buildMeshlets()
 {
-    vk::DeviceSize bufferSize = sizeof(Vertex) * m_vulkan.vertices.size();
-    vk::UniqueBuffer stagingBuffer;
-    vk::UniqueDeviceMemory stagingBufferMemory;
+    VK_TRACE_FUNCTION();
+    m_vulkan.meshlets.clear();
+
+    // Every level gets its own meshlets so the cull pass can work on the selected one only
+    std::vector<vkMeshlet> meshlets;
+    for (auto& lod : m_vulkan.lods) {
+        lod.firstMeshlet = static_cast<uint32_t>(m_vulkan.meshlets.size());
+        lod.meshletCount = 0;
+        if (lod.indexCount == 0) {
+            continue;
+        }
+        vkMeshTools::buildMeshlets(meshlets, &m_vulkan.indices[lod.firstIndex], lod.indexCount, &m_vulkan.vertices[0].pos.x, m_vulkan.vertices.size(), sizeof(Vertex));
+        for (auto& meshlet : meshlets) {
+            meshlet.firstIndex += lod.firstIndex;
+        }
+        lod.meshletCount = static_cast<uint32_t>(meshlets.size());
+        m_vulkan.meshlets.insert(m_vulkan.meshlets.end(), meshlets.begin(), meshlets.end());
+    }
+}
 
-    utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-                 stagingBuffer, stagingBufferMemory);
+uint32_t vkRender::selectLod(const vkSceneBatch& batch, const glm::mat4& modelView, const glm::mat4& proj)
+{
+    const vkSceneMesh& mesh = m_scene.meshes()[batch.mesh];
+    if (mesh.lodCount < 2 || m_vulkan.swapChain.extent.height == 0) {
+        return mesh.firstLod;
+    }
+
+    // Screen space error of each level at the nearest point of the batch bounding sphere
+    float viewScale = glm::length(glm::vec3(modelView[0]));
+    float distance = glm::length(glm::vec3(modelView * glm::vec4(batch.center, 1.0f))) - batch.radius * viewScale;
+    if (distance <= 0.0f) {
+        return mesh.firstLod;
+    }
+    float pixelsPerUnit = proj[1][1] * 0.5f * m_vulkan.swapChain.extent.height * viewScale * batch.scale / distance;
+
+    const vkMeshLod* lods = &m_vulkan.lods[mesh.firstLod];
+    uint32_t level = 0;
+    while (level + 1 < mesh.lodCount && lods[level + 1].error * pixelsPerUnit <= m_lodPixelError) {
+        ++level;
+    }
+    return mesh.firstLod + level;
+}
+
+void vkRender::packMesh()
+{
+    VK_TRACE_FUNCTION();
+    const auto& vertices = m_vulkan.vertices;
+    const auto& indices = m_vulkan.indices;
+
+    m_vulkan.vertexData.resize(vertices.size() * m_vertexFormat.stride());
+    m_vertexFormat.encode(m_vulkan.vertexData.data(), vertices.data(), vertices.size(), sizeof(Vertex),
+                          offsetof(Vertex, pos), offsetof(Vertex, color), offsetof(Vertex, texCoord), m_vulkan.boundsMin, m_vulkan.boundsMax);
+    m_vulkan.positionTransform = m_vertexFormat.positionTransform(m_vulkan.boundsMin, m_vulkan.boundsMax);
+
+    uint32_t indexSize = vkVertexFormat::indexSize(vertices.size());
+    m_vulkan.indexData.resize(indices.size() * indexSize);
+    vkVertexFormat::encodeIndices(m_vulkan.indexData.data(), indices.data(), indices.size(), indexSize);
+    m_vulkan.indexType = vkVertexFormat::indexType(indexSize);
+
+    spdlog::info("Packed mesh: {} -> {} vertex bytes, {} -> {} index bytes", vertices.size() * sizeof(Vertex), m_vulkan.vertexData.size(),
+                 indices.size() * sizeof(uint32_t), m_vulkan.indexData.size());
+}
 
-    auto data = m_vulkan.device->mapMemory(*stagingBufferMemory, 0, bufferSize);
-    memcpy(data, m_vulkan.vertices.data(), bufferSize);
-    m_vulkan.device->unmapMemory(*stagingBufferMemory);
+void vkRender::createScene()
+{
+    VK_TRACE_FUNCTION();
+    m_scene.clear();
+
+    // The loaded model is the only mesh so far, later meshes append their vertices, indices and levels
+    vkSceneMesh mesh = {};
+    mesh.vertexOffset = 0;
+    mesh.firstLod = 0;
+    mesh.lodCount = static_cast<uint32_t>(m_vulkan.lods.size());
+    mesh.center = (m_vulkan.boundsMin + m_vulkan.boundsMax) * 0.5f;
+    mesh.radius = glm::length(m_vulkan.boundsMax - m_vulkan.boundsMin) * 0.5f;
+    mesh.positionTransform = m_vulkan.positionTransform;
+    uint32_t meshIndex = m_scene.addMesh(mesh);
+
+    m_scene.addGrid(meshIndex, m_sceneInstances, m_sceneSpacing * 2.0f * mesh.radius);
+    m_scene.build();
+
+    spdlog::info("Scene: {} meshes, {} instances in {} batches", m_scene.meshes().size(), m_scene.instances().size(), m_scene.batches().size());
+}
+
+void vkRender::selectCulling()
+{
+    VK_TRACE_FUNCTION();
+    // Resolves the culling options against the scene and the device before anything depends on them
+    if (m_meshletCulling) {
+        if (m_vulkan.meshlets.empty()) {
+            m_meshletCulling = false;
+        } else if (m_scene.instances().size() != 1) {
+            // Meshlet bounds are in model space, the pass handles the single instance scene only
+            spdlog::info("{} instances, meshlet culling disabled", m_scene.instances().size());
+            m_meshletCulling = false;
+        } else if (!m_vulkan.multiDrawIndirect) {
+            spdlog::warn("multiDrawIndirect not supported, meshlet culling disabled");
+            m_meshletCulling = false;
+        }
+    }
+
+    // A single instance is better served by meshlet culling
+    // Without multiDrawIndirect the pass issues one indirect draw per level of detail
+    if (m_gpuCulling) {
+        if (m_scene.instances().size() < 2) {
+            m_gpuCulling = false;
+        } else if (!m_vulkan.drawIndirectFirstInstance) {
+            spdlog::warn("drawIndirectFirstInstance not supported, GPU object culling disabled");
+            m_gpuCulling = false;
+        }
+    }
+
+    // Only the GPU culling passes test against the pyramid, which is built from the depth attachment
+    if (m_occlusionCulling) {
+        if (!m_meshletCulling && !m_gpuCulling) {
+            m_occlusionCulling = false;
+        } else if (!depthSamplingSupported()) {
+            spdlog::warn("Depth attachment can not be sampled, occlusion culling disabled");
+            m_occlusionCulling = false;
+        }
+    }
+}
+
+void vkRender::createVertexBuffer()
+{
+    VK_TRACE_FUNCTION();
+    const vkMeshCache& cache = m_vulkan.meshCache;
+    vk::DeviceSize bufferSize = cache.isOpen() ? cache.header().vertexBytes : m_vulkan.vertexData.size();
+    vk::Buffer stagingBuffer = m_vulkan.upload->stage(cache.isOpen() ? cache.vertexData() : m_vulkan.vertexData.data(), bufferSize);
 
     utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eVertexBuffer|vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal,
                  m_vulkan.vertexBuffer, m_vulkan.vertexBufferMemory);
 
     copyBuffer(stagingBuffer, m_vulkan.vertexBuffer, bufferSize);
+
+    if (m_depthPrepass) {
+        size_t vertexCount = bufferSize / m_vertexFormat.stride();
+        std::vector<uint8_t> positions(vertexCount * m_vertexFormat.positionStride());
+        m_vertexFormat.extractPositions(positions.data(), cache.isOpen() ? cache.vertexData() : m_vulkan.vertexData.data(), vertexCount);
+        vk::DeviceSize positionSize = positions.size();
+        stagingBuffer = m_vulkan.upload->stage(positions.data(), positionSize);
+
+        utilCreateBuffer(positionSize, vk::BufferUsageFlagBits::eVertexBuffer|vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                     m_vulkan.positionBuffer, m_vulkan.positionBufferMemory);
+
+        copyBuffer(stagingBuffer, m_vulkan.positionBuffer, positionSize);
+    }
 }
 
 void vkRender::createIndexBuffer()
 {
-    vk::DeviceSize bufferSize = sizeof(uint32_t) * m_vulkan.indices.size();
-    vk::UniqueBuffer stagingBuffer;
-    vk::UniqueDeviceMemory stagingBufferMemory;
-    utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eTransferSrc, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-                 stagingBuffer, stagingBufferMemory);
-
-    auto data = m_vulkan.device->mapMemory(*stagingBufferMemory, 0, bufferSize);
-    memcpy(data, m_vulkan.indices.data(), bufferSize);
-    m_vulkan.device->unmapMemory(*stagingBufferMemory);
+    VK_TRACE_FUNCTION();
+    const vkMeshCache& cache = m_vulkan.meshCache;
+    vk::DeviceSize bufferSize = cache.isOpen() ? cache.header().indexBytes : m_vulkan.indexData.size();
+    vk::Buffer stagingBuffer = m_vulkan.upload->stage(cache.isOpen() ? cache.indexData() : m_vulkan.indexData.data(), bufferSize);
 
     utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eIndexBuffer|vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal,
                  m_vulkan.indexBuffer, m_vulkan.indexBufferMemory);
@@ -787,26 +1365,219 @@ void vkRender::createIndexBuffer()
     copyBuffer(stagingBuffer, m_vulkan.indexBuffer, bufferSize);
 }
 
-void vkRender::createUniformBuffer()
+void vkRender::createInstanceBuffer()
 {
-    vk::DeviceSize bufferSize = sizeof(UniformBufferObject);
-    size_t imageSize = m_vulkan.swapChain.images.size();
-    m_vulkan.uniformBuffer.resize(imageSize);
-    m_vulkan.uniformBufferMemory.resize(imageSize);
+    VK_TRACE_FUNCTION();
+    const auto& instanceData = m_scene.instanceData();
+    vk::DeviceSize bufferSize = sizeof(vkInstanceData) * instanceData.size();
+    vk::Buffer stagingBuffer = m_vulkan.upload->stage(instanceData.data(), bufferSize);
+
+    utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                 m_vulkan.instanceBuffer, m_vulkan.instanceBufferMemory);
+
+    copyBuffer(stagingBuffer, m_vulkan.instanceBuffer, bufferSize, vk::PipelineStageFlagBits::eVertexShader, vk::AccessFlagBits::eShaderRead);
+
+    std::vector<uint32_t> instanceIds(instanceData.size());
+    std::iota(instanceIds.begin(), instanceIds.end(), 0);
+    bufferSize = sizeof(uint32_t) * instanceIds.size();
+    stagingBuffer = m_vulkan.upload->stage(instanceIds.data(), bufferSize);
+
+    utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eVertexBuffer|vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                 m_vulkan.instanceIdBuffer, m_vulkan.instanceIdBufferMemory);
+
+    copyBuffer(stagingBuffer, m_vulkan.instanceIdBuffer, bufferSize, vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eVertexAttributeRead);
+}
 
-    for (size_t i = 0; i < imageSize; ++i) {
-        utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eUniformBuffer, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-                     m_vulkan.uniformBuffer[i], m_vulkan.uniformBufferMemory[i]);
+void vkRender::createObjectBuffers()
+{
+    VK_TRACE_FUNCTION();
+    if (!m_gpuCulling) {
+        return;
     }
-    
+
+    const auto& objects = m_scene.objects();
+    vk::DeviceSize bufferSize = sizeof(vkSceneObject) * objects.size();
+    vk::Buffer stagingBuffer = m_vulkan.upload->stage(objects.data(), bufferSize);
+
+    utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                 m_vulkan.objectBuffer, m_vulkan.objectBufferMemory);
+
+    copyBuffer(stagingBuffer, m_vulkan.objectBuffer, bufferSize, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
+
+    auto lodDraws = vkObjectCullPass::makeLodDraws(m_scene, m_vulkan.lods, m_vulkan.instanceCapacity);
+    bufferSize = sizeof(vkLodDraw) * lodDraws.size();
+    stagingBuffer = m_vulkan.upload->stage(lodDraws.data(), bufferSize);
+
+    utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                 m_vulkan.lodDrawBuffer, m_vulkan.lodDrawBufferMemory);
+
+    copyBuffer(stagingBuffer, m_vulkan.lodDrawBuffer, bufferSize, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
+}
+
+void vkRender::createMeshletBuffer()
+{
+    VK_TRACE_FUNCTION();
+    if (m_vulkan.meshlets.empty()) {
+        return;
+    }
+
+    vk::DeviceSize bufferSize = sizeof(vkMeshlet) * m_vulkan.meshlets.size();
+    vk::Buffer stagingBuffer = m_vulkan.upload->stage(m_vulkan.meshlets.data(), bufferSize);
+
+    utilCreateBuffer(bufferSize, vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eTransferDst, vk::MemoryPropertyFlagBits::eDeviceLocal,
+                 m_vulkan.meshletBuffer, m_vulkan.meshletBufferMemory);
+
+    copyBuffer(stagingBuffer, m_vulkan.meshletBuffer, bufferSize, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
+}
+
+void vkRender::createDepthPyramid()
+{
+    VK_TRACE_FUNCTION();
+    if (!m_occlusionCulling) {
+        return;
+    }
+
+    std::map<std::string, std::string> firstLevelMacros;
+    if (m_vulkan.sampleCount != vk::SampleCountFlagBits::e1) {
+        firstLevelMacros["DEPTH_SAMPLES"] = std::to_string(static_cast<uint32_t>(m_vulkan.sampleCount));
+    }
+    auto shaderCode = vku::instance()->glslCompileBatch({
+        { "depthreduce.comp", shaderc_compute_shader, firstLevelMacros },
+        { "depthreduce.comp", shaderc_compute_shader },
+    });
+    auto firstLevelCode = shaderCode[0].get();
+    auto reduceCode = shaderCode[1].get();
+
+    m_vulkan.depthPyramid = std::make_unique<vkDepthPyramid>(m_vulkan.physicalDevice, *m_vulkan.device, *m_vulkan.allocator, *m_vulkan.pipelineCache,
+                                                             firstLevelCode, reduceCode, findDepthFormat(), m_max_frame_in_flight);
+    m_vulkan.depthPyramid->resize(*m_vulkan.depthImageView, m_vulkan.swapChain.extent.width, m_vulkan.swapChain.extent.height, m_vulkan.deletionQueue, m_frameNumber);
+    spdlog::info("Occlusion culling: {} level depth pyramid", m_vulkan.depthPyramid->levelCount());
+}
+
+void vkRender::createCullPass()
+{
+    VK_TRACE_FUNCTION();
+    if (!m_meshletCulling || !m_vulkan.meshletBuffer) {
+        return;
+    }
+
+    size_t size = 0;
+    std::map<std::string, std::string> macros;
+    if (m_vulkan.depthPyramid) {
+        macros["OCCLUSION"] = "1";
+    }
+    auto shaderCode = vku::instance()->glslCompile("cull.comp", size, shaderc_compute_shader, macros);
+    m_vulkan.cullPass = std::make_unique<vkCullPass>(m_vulkan.physicalDevice, *m_vulkan.device, *m_vulkan.allocator, *m_vulkan.pipelineCache, shaderCode,
+                                                     *m_vulkan.meshletBuffer, static_cast<uint32_t>(m_vulkan.meshlets.size()), m_max_frame_in_flight, m_vulkan.drawIndirectCount,
+                                                     m_vulkan.depthPyramid.get());
+    spdlog::info("Meshlet culling: {} meshlets, {}{}", m_vulkan.meshlets.size(), m_vulkan.drawIndirectCount ? "GPU draw count" : "cleared draw list",
+                 m_vulkan.depthPyramid ? ", occlusion" : "");
+}
+
+void vkRender::createCpuCulling()
+{
+    VK_TRACE_FUNCTION();
+    if (!m_cpuCulling || m_vulkan.objectBuffer || m_scene.instances().size() < 2) {
+        return;
+    }
+
+    const auto& objects = m_scene.objects();
+    m_vulkan.cullBvh.build(&objects[0].sphere, objects.size(), sizeof(vkSceneObject));
+    uint32_t instanceCapacity = 0;
+    m_vulkan.lodDraws = vkObjectCullPass::makeLodDraws(m_scene, m_vulkan.lods, instanceCapacity);
+
+    // Every visible instance goes to exactly one level, a region never needs more than all of them
+    m_vulkan.visibleRegionSize = sizeof(uint32_t) * objects.size();
+    utilCreateBuffer(m_vulkan.visibleRegionSize * m_max_frame_in_flight, vk::BufferUsageFlagBits::eVertexBuffer,
+                     vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, m_vulkan.visibleBuffer, m_vulkan.visibleBufferMemory);
+
+    spdlog::info("CPU object culling: {} instances, {} BVH nodes", objects.size(), m_vulkan.cullBvh.nodeCount());
+}
+
+void vkRender::cullOnCpu(uint32_t frame)
+{
+    m_cpuDraws.clear();
+    if (!m_vulkan.visibleBuffer || m_vulkan.swapChain.extent.height == 0) {
+        return;
+    }
+
+    glm::mat4 proj = m_pCamera->getPerspective();
+    vkCullParams frustum = vkCullParams::fromMatrices(proj, m_pCamera->getModelView());
+    m_vulkan.cullBvh.cull(frustum.planes, m_cpuVisible, vkThreadPool::instance());
+
+    // Same level of detail choice as objectcull.comp
+    const auto& objects = m_scene.objects();
+    const auto& lodDraws = m_vulkan.lodDraws;
+    glm::vec3 camera = glm::vec3(frustum.cameraPosition);
+    float pixelScale = proj[1][1] * 0.5f * m_vulkan.swapChain.extent.height;
+    m_cpuVisibleLod.resize(m_cpuVisible.size());
+    m_cpuLodCursor.assign(lodDraws.size(), 0);
+    for (size_t i = 0; i < m_cpuVisible.size(); ++i) {
+        const vkSceneObject& object = objects[m_cpuVisible[i]];
+        uint32_t level = 0;
+        float distance = glm::length(glm::vec3(object.sphere) - camera) - object.sphere.w;
+        if (distance > 0.0f) {
+            float pixelsPerUnit = pixelScale * object.scale / distance;
+            while (level + 1 < object.lodCount && lodDraws[object.firstLod + level + 1].error * pixelsPerUnit <= m_lodPixelError) {
+                ++level;
+            }
+        }
+        m_cpuVisibleLod[i] = object.firstLod + level;
+        ++m_cpuLodCursor[object.firstLod + level];
+    }
+
+    // Counting sort into one instance range per level, each range is one instanced draw
+    uint32_t firstInstance = 0;
+    for (size_t lod = 0; lod < lodDraws.size(); ++lod) {
+        uint32_t count = m_cpuLodCursor[lod];
+        m_cpuLodCursor[lod] = firstInstance;
+        if (count > 0) {
+            m_cpuDraws.push_back(vk::DrawIndexedIndirectCommand(lodDraws[lod].indexCount, count, lodDraws[lod].firstIndex, lodDraws[lod].vertexOffset, firstInstance));
+            firstInstance += count;
+        }
+    }
+
+    auto ids = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(m_vulkan.visibleBufferMemory->pointer) + frame * m_vulkan.visibleRegionSize);
+    for (size_t i = 0; i < m_cpuVisible.size(); ++i) {
+        ids[m_cpuLodCursor[m_cpuVisibleLod[i]]++] = m_cpuVisible[i];
+    }
+}
+
+void vkRender::createObjectCullPass()
+{
+    VK_TRACE_FUNCTION();
+    if (!m_vulkan.objectBuffer) {
+        return;
+    }
+
+    size_t size = 0;
+    std::map<std::string, std::string> macros;
+    if (m_vulkan.depthPyramid) {
+        macros["OCCLUSION"] = "1";
+    }
+    auto shaderCode = vku::instance()->glslCompile("objectcull.comp", size, shaderc_compute_shader, macros);
+    m_vulkan.objectCullPass = std::make_unique<vkObjectCullPass>(m_vulkan.physicalDevice, *m_vulkan.device, *m_vulkan.allocator, *m_vulkan.pipelineCache, shaderCode,
+                                                                 *m_vulkan.objectBuffer, static_cast<uint32_t>(m_scene.objects().size()),
+                                                                 *m_vulkan.lodDrawBuffer, static_cast<uint32_t>(m_vulkan.lods.size()), m_vulkan.instanceCapacity,
+                                                                 m_max_frame_in_flight, m_vulkan.multiDrawIndirect, m_vulkan.drawIndirectCount, m_vulkan.depthPyramid.get());
+    spdlog::info("GPU object culling: {} instances, {} draws, {}{}", m_scene.objects().size(), m_vulkan.lods.size(),
+                 m_vulkan.drawIndirectCount ? "GPU draw count" : "fixed draw list", m_vulkan.depthPyramid ? ", occlusion" : "");
+}
+
+void vkRender::createUniformBuffer()
+{
+    VK_TRACE_FUNCTION();
+    m_vulkan.uniformRing = std::make_unique<vkUniformRing>(m_vulkan.physicalDevice, *m_vulkan.device, *m_vulkan.allocator, m_uniformRegionSize, m_max_frame_in_flight);
 }
 
 void vkRender::createDescriptorPool()
 {
-    uint32_t maxPoolSize = static_cast<uint32_t>(m_vulkan.swapChain.images.size());
-    std::array<vk::DescriptorPoolSize, 2> poolSize;
-    poolSize[0].setType(vk::DescriptorType::eUniformBuffer).setDescriptorCount(maxPoolSize);
+    VK_TRACE_FUNCTION();
+    uint32_t maxPoolSize = 1;
+    std::array<vk::DescriptorPoolSize, 3> poolSize;
+    poolSize[0].setType(vk::DescriptorType::eUniformBufferDynamic).setDescriptorCount(maxPoolSize);
     poolSize[1].setType(vk::DescriptorType::eCombinedImageSampler).setDescriptorCount(maxPoolSize);
+    poolSize[2].setType(vk::DescriptorType::eStorageBuffer).setDescriptorCount(maxPoolSize);
 
     vk::DescriptorPoolCreateInfo poolInfo;
     poolInfo.setPoolSizeCount(static_cast<uint32_t>(poolSize.size()))
@@ -817,35 +1588,39 @@ void vkRender::createDescriptorPool()
 
 void vkRender::createDescriptorSets()
 {
-    uint32_t maxSetSize = static_cast<uint32_t>(m_vulkan.swapChain.images.size());
-    std::vector<vk::DescriptorSetLayout> layouts(m_vulkan.swapChain.images.size(), *m_vulkan.descriptorsetLayout);
+    VK_TRACE_FUNCTION();
+    // A single set serves every frame, the ring region and per-draw constants are selected with a dynamic offset
     vk::DescriptorSetAllocateInfo allocInfo;
-    allocInfo.setDescriptorPool(*m_vulkan.descriptorPool).setDescriptorSetCount(maxSetSize).setPSetLayouts(layouts.data());
+    allocInfo.setDescriptorPool(*m_vulkan.descriptorPool).setDescriptorSetCount(1).setPSetLayouts(&*m_vulkan.descriptorsetLayout);
 
-    m_vulkan.descriptorSets = m_vulkan.device->allocateDescriptorSetsUnique(allocInfo);
+    m_vulkan.descriptorSet = std::move(m_vulkan.device->allocateDescriptorSetsUnique(allocInfo)[0]);
 
-    for (uint32_t i = 0; i < maxSetSize; ++i) {
-        vk::DescriptorBufferInfo bufferInfo;
-        bufferInfo.setBuffer(*m_vulkan.uniformBuffer[i]).setRange(sizeof(UniformBufferObject));
-        vk::DescriptorImageInfo imageInfo;
-        imageInfo.setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal).setImageView(*m_vulkan.textureImageView).setSampler(*m_vulkan.textureSampler);
+    vk::DescriptorBufferInfo bufferInfo;
+    bufferInfo.setBuffer(m_vulkan.uniformRing->buffer()).setOffset(0).setRange(sizeof(UniformBufferObject));
+    vk::DescriptorImageInfo imageInfo;
+    imageInfo.setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal).setImageView(*m_vulkan.textureImageView).setSampler(*m_vulkan.textureSampler);
 
-        std::array<vk::WriteDescriptorSet, 2> descriptorWrite;
-        descriptorWrite[0].setDstSet(*m_vulkan.descriptorSets[i]).setDstBinding(0).setDescriptorType(vk::DescriptorType::eUniformBuffer).setDescriptorCount(1).setPBufferInfo(&bufferInfo);
-        descriptorWrite[1].setDstSet(*m_vulkan.descriptorSets[i]).setDstBinding(1).setDescriptorType(vk::DescriptorType::eCombinedImageSampler).setDescriptorCount(1).setPImageInfo(&imageInfo);
-        m_vulkan.device->updateDescriptorSets(descriptorWrite, nullptr);
-    }
+    vk::DescriptorBufferInfo instanceInfo;
+    instanceInfo.setBuffer(*m_vulkan.instanceBuffer).setOffset(0).setRange(VK_WHOLE_SIZE);
+
+    std::array<vk::WriteDescriptorSet, 3> descriptorWrite;
+    descriptorWrite[0].setDstSet(*m_vulkan.descriptorSet).setDstBinding(0).setDescriptorType(vk::DescriptorType::eUniformBufferDynamic).setDescriptorCount(1).setPBufferInfo(&bufferInfo);
+    descriptorWrite[1].setDstSet(*m_vulkan.descriptorSet).setDstBinding(1).setDescriptorType(vk::DescriptorType::eCombinedImageSampler).setDescriptorCount(1).setPImageInfo(&imageInfo);
+    descriptorWrite[2].setDstSet(*m_vulkan.descriptorSet).setDstBinding(2).setDescriptorType(vk::DescriptorType::eStorageBuffer).setDescriptorCount(1).setPBufferInfo(&instanceInfo);
+    m_vulkan.device->updateDescriptorSets(descriptorWrite, nullptr);
 }
 
-void vkRender::updateUniformBuffer(uint32_t index)
+uint32_t vkRender::updateUniformBuffer(uint32_t frame)
 {
     static auto startTime = std::chrono::high_resolution_clock::now();
 
     auto currentTime = std::chrono::high_resolution_clock::now();
     float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
     
+    m_vulkan.uniformRing->beginFrame(frame);
+
     if (m_vulkan.swapChain.extent.height == 0) {
-        return;
+        return 0;
     }
     
     UniformBufferObject ubo;
@@ -857,45 +1632,110 @@ void vkRender::updateUniformBuffer(uint32_t index)
     //ubo.proj = glm::perspective(glm::radians(90.0f), 1.0f /*m_vulkan.swapChain.extent.width / float(m_vulkan.swapChain.extent.height)*/, 0.1f, 10.0f);
     //ubo.proj[1][1] = -1;
 
-    auto data = m_vulkan.device->mapMemory(*m_vulkan.uniformBufferMemory[index], 0, sizeof(ubo));
-    memcpy(data, &ubo, sizeof(ubo));
-    m_vulkan.device->unmapMemory(*m_vulkan.uniformBufferMemory[index]);
+    return m_vulkan.uniformRing->push(ubo);
 }
 
 void vkRender::createCommandBuffers() 
 {
+    VK_TRACE_FUNCTION();
     vk::CommandBufferAllocateInfo allocInfo;
-    allocInfo.setCommandBufferCount(static_cast<uint32_t>(m_vulkan.swapChain.views.size()))
+    allocInfo.setCommandBufferCount(m_max_frame_in_flight)
         .setCommandPool(*m_vulkan.commandPool)
         .setLevel(vk::CommandBufferLevel::ePrimary);
 
     m_vulkan.commandBuffers = m_vulkan.device->allocateCommandBuffersUnique(allocInfo);
+}
 
-    for(size_t i=0;i<m_vulkan.commandBuffers.size();++i) {
-        m_vulkan.commandBuffers[i]->begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eSimultaneousUse));
-        vk::Rect2D renderArea(vk::Offset2D(0, 0), m_vulkan.swapChain.extent);
-        std::array<vk::ClearValue, 2> clearValues;
-        clearValues[0].color.float32[3] = 1.0;
-        clearValues[1].depthStencil = { 1.0f, 0 };
-        
-        vk::RenderPassBeginInfo rpBeginInfo(*m_vulkan.renderPass, *m_vulkan.swapChain.frameBuffers[i],  renderArea, static_cast<uint32_t>(clearValues.size()), clearValues.data());
-        m_vulkan.commandBuffers[i]->beginRenderPass(rpBeginInfo, vk::SubpassContents::eInline);
-        m_vulkan.commandBuffers[i]->bindPipeline(vk::PipelineBindPoint::eGraphics, *m_vulkan.pipeLine);
-        vk::DeviceSize offset =  0;
-        m_vulkan.commandBuffers[i]->bindVertexBuffers(0, 1, &*m_vulkan.vertexBuffer, &offset);
-        m_vulkan.commandBuffers[i]->bindIndexBuffer(*m_vulkan.indexBuffer, offset, vk::IndexType::eUint32);
-        uint32_t dynamic_offset = 0;
-        m_vulkan.commandBuffers[i]->bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *m_vulkan.pipelineLayout, 0, *m_vulkan.descriptorSets[i], nullptr);
-        m_vulkan.commandBuffers[i]->drawIndexed(static_cast<uint32_t>(m_vulkan.indices.size()), 1, 0, 0, 0);
-        m_vulkan.commandBuffers[i]->endRenderPass();
+void vkRender::recordCommandBuffer(uint32_t frame, uint32_t imageIndex, uint32_t uboOffset)
+{
+    auto& commandBuffer = m_vulkan.commandBuffers[frame];
+
+    commandBuffer->reset(vk::CommandBufferResetFlags());
+    commandBuffer->begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+    vk::Rect2D renderArea(vk::Offset2D(0, 0), m_vulkan.swapChain.extent);
+    std::array<vk::ClearValue, 2> clearValues;
+    clearValues[0].color.float32[3] = 1.0;
+    clearValues[1].depthStencil = { 1.0f, 0 };
+
+    m_profiler.writeGpuBegin(*commandBuffer, frame);
+
+    glm::mat4 modelView = m_pCamera->getModelView();
+    glm::mat4 proj = m_pCamera->getPerspective();
+    const auto& batches = m_scene.batches();
+    if (m_vulkan.depthPyramid) {
+        // Meshlet bounds are in the model space of the single instance, object bounds in world space
+        m_vulkan.depthPyramid->prepare(*commandBuffer, frame, m_vulkan.cullPass ? m_scene.instances()[0].transform : glm::mat4(1.0f));
+    }
+    if (m_vulkan.cullPass) {
+        // Single instance, culled meshlet by meshlet in its model space
+        const vkMeshLod& lod = m_vulkan.lods[selectLod(batches[0], modelView, proj)];
+        vkCullParams cullParams = vkCullParams::fromMatrices(proj, modelView * m_scene.instances()[0].transform);
+        cullParams.firstCluster = lod.firstMeshlet;
+        cullParams.clusterCount = lod.meshletCount;
+        m_vulkan.cullPass->record(*commandBuffer, frame, cullParams);
+    } else if (m_vulkan.objectCullPass) {
+        auto objectParams = vkObjectCullParams::fromMatrices(proj, modelView, float(m_vulkan.swapChain.extent.height), m_lodPixelError);
+        m_vulkan.objectCullPass->record(*commandBuffer, frame, objectParams);
+    }
+
+    vk::RenderPassBeginInfo rpBeginInfo(*m_vulkan.renderPass, *m_vulkan.swapChain.frameBuffers[imageIndex], renderArea, static_cast<uint32_t>(clearValues.size()), clearValues.data());
+    commandBuffer->beginRenderPass(rpBeginInfo, vk::SubpassContents::eInline);
+    vk::Viewport viewport(0, 0, float(m_vulkan.swapChain.extent.width), float(m_vulkan.swapChain.extent.height), 0.0, 1.0);
+    commandBuffer->setViewport(0, viewport);
+    commandBuffer->setScissor(0, renderArea);
+    commandBuffer->bindIndexBuffer(*m_vulkan.indexBuffer, 0, m_vulkan.indexType);
+    // Both pipelines share the layout, the set stays bound across the switch
+    commandBuffer->bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *m_vulkan.pipelineLayout, 0, *m_vulkan.descriptorSet, uboOffset);
+
+    // Everything the culling path selected, the prepass has to draw exactly what the main pass draws
+    auto drawScene = [&](vk::Buffer vertexBuffer) {
+        std::array<vk::Buffer, 2> vertexBuffers = { vertexBuffer, *m_vulkan.instanceIdBuffer };
+        std::array<vk::DeviceSize, 2> offsets = { 0, 0 };
+        commandBuffer->bindVertexBuffers(0, vertexBuffers, offsets);
+        if (m_vulkan.cullPass) {
+            m_vulkan.cullPass->draw(*commandBuffer, frame, m_vulkan.dldi);
+        } else if (m_vulkan.objectCullPass) {
+            m_vulkan.objectCullPass->draw(*commandBuffer, frame, m_vulkan.dldi);
+        } else if (m_vulkan.visibleBuffer) {
+            // Draw list of cullOnCpu, one instanced draw per visible level of detail
+            vk::DeviceSize visibleOffset = frame * m_vulkan.visibleRegionSize;
+            commandBuffer->bindVertexBuffers(vkScene::kBinding, 1, &*m_vulkan.visibleBuffer, &visibleOffset);
+            for (const auto& draw : m_cpuDraws) {
+                commandBuffer->drawIndexed(draw.indexCount, draw.instanceCount, draw.firstIndex, draw.vertexOffset, draw.firstInstance);
+            }
+        } else {
+            // One instanced draw per batch, whole batches outside the frustum are skipped
+            vkCullParams frustum = vkCullParams::fromMatrices(proj, modelView);
+            for (const auto& batch : batches) {
+                if (!frustum.sphereVisible(batch.center, batch.radius)) {
+                    continue;
+                }
+                const vkMeshLod& lod = m_vulkan.lods[selectLod(batch, modelView, proj)];
+                const vkSceneMesh& mesh = m_scene.meshes()[batch.mesh];
+                commandBuffer->drawIndexed(lod.indexCount, batch.instanceCount, lod.firstIndex, mesh.vertexOffset, batch.firstInstance);
+            }
+        }
+    };
+    if (m_vulkan.prepassPipeline) {
+        commandBuffer->bindPipeline(vk::PipelineBindPoint::eGraphics, *m_vulkan.prepassPipeline);
+        drawScene(*m_vulkan.positionBuffer);
+    }
+    commandBuffer->bindPipeline(vk::PipelineBindPoint::eGraphics, *m_vulkan.pipeLine);
+    drawScene(*m_vulkan.vertexBuffer);
+    commandBuffer->endRenderPass();
 
-        m_vulkan.commandBuffers[i]->end();
+    if (m_vulkan.depthPyramid) {
+        m_vulkan.depthPyramid->build(*commandBuffer, *m_vulkan.depthImage, proj * modelView);
     }
 
+    m_profiler.writeGpuEnd(*commandBuffer, frame);
+
+    commandBuffer->end();
 }
 
 void vkRender::createSyncObjects()
 {
+    VK_TRACE_FUNCTION();
     vk::SemaphoreCreateInfo semaphorInfo;
     m_vulkan.imageAvailableSemaphore.resize(m_max_frame_in_flight);
     m_vulkan.renderFinishedSemaphore.resize(m_max_frame_in_flight);
@@ -915,34 +1755,75 @@ void vkRender::waitIdle()
 
 void vkRender::drawFrame()
 {
-    m_vulkan.device->waitForFences(1, &*m_vulkan.inFlightFences[m_currentFrame], VK_TRUE, std::numeric_limits<uint32_t>::max());
+    VK_TRACE_FUNCTION();
+    m_profiler.beginFrame();
+    {
+        vkCpuTimer timer(m_profiler, vkStage::eWaitFence);
+        m_vulkan.device->waitForFences(1, &*m_vulkan.inFlightFences[m_currentFrame], VK_TRUE, std::numeric_limits<uint32_t>::max());
+    }
+    m_profiler.collectGpu(m_currentFrame);
+    if (m_vulkan.depthPyramid) {
+        m_vulkan.depthPyramid->collect(m_currentFrame);
+    }
+    m_vulkan.upload->retire();
+    // Fences signal in submission order, so everything up to the frame that last used this slot is done
+    if (m_frameNumber >= m_max_frame_in_flight) {
+        m_vulkan.deletionQueue.retire(m_frameNumber - m_max_frame_in_flight + 1);
+    }
 
     try {
-        auto imageIndex = m_vulkan.device->acquireNextImageKHR(*m_vulkan.swapChain.swapChainKHR, std::numeric_limits<uint32_t>::max(), *m_vulkan.imageAvailableSemaphore[m_currentFrame], vk::Fence());
+        uint32_t imageIndex = 0;
+        if (m_headless) {
+            imageIndex = static_cast<uint32_t>(m_frameNumber % m_vulkan.swapChain.images.size());
+        } else {
+            vkCpuTimer timer(m_profiler, vkStage::eAcquire);
+            imageIndex = m_vulkan.device->acquireNextImageKHR(*m_vulkan.swapChain.swapChainKHR, std::numeric_limits<uint32_t>::max(), *m_vulkan.imageAvailableSemaphore[m_currentFrame], vk::Fence()).value;
+        }
 
         m_vulkan.device->resetFences(1, &*m_vulkan.inFlightFences[m_currentFrame]);
 
-        updateUniformBuffer(imageIndex.value);
+        uint32_t uboOffset = 0;
+        {
+            vkCpuTimer timer(m_profiler, vkStage::eUpdateUniform);
+            uboOffset = updateUniformBuffer(m_currentFrame);
+        }
+        {
+            vkCpuTimer timer(m_profiler, vkStage::eCull);
+            cullOnCpu(m_currentFrame);
+        }
+        {
+            vkCpuTimer timer(m_profiler, vkStage::eRecord);
+            recordCommandBuffer(m_currentFrame, imageIndex, uboOffset);
+        }
 
         vk::SubmitInfo submitInfo;
         const vk::PipelineStageFlags waitStages[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
         submitInfo.setCommandBufferCount(1)
-            .setPCommandBuffers(&*m_vulkan.commandBuffers[imageIndex.value])
-            .setWaitSemaphoreCount(1)
-            .setPWaitSemaphores(&*m_vulkan.imageAvailableSemaphore[m_currentFrame])
-            .setPWaitDstStageMask(waitStages)
-            .setSignalSemaphoreCount(1)
-            .setPSignalSemaphores(&*m_vulkan.renderFinishedSemaphore[m_currentFrame]);
-        m_vulkan.gQueue.queue.submit(1, &submitInfo, *m_vulkan.inFlightFences[m_currentFrame]);
-
-        vk::PresentInfoKHR presentInfo;
-        presentInfo.setWaitSemaphoreCount(1)
-            .setPWaitSemaphores(&*m_vulkan.renderFinishedSemaphore[m_currentFrame])
-            .setSwapchainCount(1)
-            .setPSwapchains(&*m_vulkan.swapChain.swapChainKHR)
-            .setPImageIndices(&imageIndex.value);
-        m_vulkan.pQueue.queue.presentKHR(&presentInfo);
+            .setPCommandBuffers(&*m_vulkan.commandBuffers[m_currentFrame]);
+        if (!m_headless) {
+            submitInfo.setWaitSemaphoreCount(1)
+                .setPWaitSemaphores(&*m_vulkan.imageAvailableSemaphore[m_currentFrame])
+                .setPWaitDstStageMask(waitStages)
+                .setSignalSemaphoreCount(1)
+                .setPSignalSemaphores(&*m_vulkan.renderFinishedSemaphore[m_currentFrame]);
+        }
+        {
+            vkCpuTimer timer(m_profiler, vkStage::eSubmit);
+            m_vulkan.gQueue.queue.submit(1, &submitInfo, *m_vulkan.inFlightFences[m_currentFrame]);
+        }
 
+        if (!m_headless) {
+            vkCpuTimer timer(m_profiler, vkStage::ePresent);
+            vk::PresentInfoKHR presentInfo;
+            presentInfo.setWaitSemaphoreCount(1)
+                .setPWaitSemaphores(&*m_vulkan.renderFinishedSemaphore[m_currentFrame])
+                .setSwapchainCount(1)
+                .setPSwapchains(&*m_vulkan.swapChain.swapChainKHR)
+                .setPImageIndices(&imageIndex);
+            m_vulkan.pQueue.queue.presentKHR(&presentInfo);
+        }
+
+        m_frameNumber++;
         m_currentFrame = (m_currentFrame + 1) % m_max_frame_in_flight;
     } catch (vk::OutOfDateKHRError  e) {
         recreateSwapChain(m_width, m_height);
@@ -953,27 +1834,6 @@ void vkRender::drawFrame()
 
 }
 
-std::vector<vk::UniqueCommandBuffer> vkRender::beginSingleTimeCommands()
-{
-    vk::CommandBufferAllocateInfo allocInfo;
-    allocInfo.setLevel(vk::CommandBufferLevel::ePrimary).setCommandBufferCount(1).setCommandPool(*m_vulkan.commandPool);
-    auto commandBuffers = m_vulkan.device->allocateCommandBuffersUnique(allocInfo);
-    commandBuffers[0]->begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
-
-    return commandBuffers;
-}
-
-void vkRender::endSingleTimeCommands(std::vector<vk::UniqueCommandBuffer>& commandBuffers)
-{
-    commandBuffers[0]->end();
-
-    vk::SubmitInfo submitInfo;
-    submitInfo.setCommandBufferCount(1).setPCommandBuffers(&*commandBuffers[0]);
-
-    m_vulkan.gQueue.queue.submit(1, &submitInfo, nullptr);
-    m_vulkan.gQueue.queue.waitIdle();
-}
-
 template <typename... Args>
 void vkRender::submit(void (vkRender::*func)(Args...), Args... args)
 {
@@ -982,7 +1842,8 @@ void vkRender::submit(void (vkRender::*func)(Args...), Args... args)
 
 void vkRender::transitionImageLayout(vk::UniqueImage& image, vk::Format format, vk::ImageLayout oldLayout, vk::ImageLayout newLayout, uint32_t mipLevels)
 {
-    auto commandBuffers = beginSingleTimeCommands();
+    // Copy destinations are prepared on the transfer queue, attachment layouts need the graphics queue
+    auto commandBuffer = (newLayout == vk::ImageLayout::eTransferDstOptimal) ? m_vulkan.upload->transferCommandBuffer() : m_vulkan.upload->graphicsCommandBuffer();
 
     vk::ImageSubresourceRange range;
     range.setLayerCount(1).setLevelCount(mipLevels);
@@ -1026,9 +1887,7 @@ void vkRender::transitionImageLayout(vk::UniqueImage& image, vk::Format format,
     }
 
     vk::DependencyFlags flag;
-    commandBuffers[0]->pipelineBarrier(srcStage, dstStage, flag, nullptr, nullptr, barrier);
-
-    endSingleTimeCommands(commandBuffers);
+    commandBuffer.pipelineBarrier(srcStage, dstStage, flag, nullptr, nullptr, barrier);
 }
 
 void vkRender::generateMipmaps(vk::Image& image, vk::Format format, int32_t texWidth, int32_t texHeight, uint32_t mipLevels)
@@ -1040,7 +1899,7 @@ void vkRender::generateMipmaps(vk::Image& image, vk::Format format, int32_t texW
         throw std::runtime_error("texture image format does not support linear blitting!");
     }
 
-    auto commandBuffers = beginSingleTimeCommands();
+    auto commandBuffer = m_vulkan.upload->graphicsCommandBuffer();
 
     vk::ImageSubresourceRange range;
     range.setAspectMask(vk::ImageAspectFlagBits::eColor).setLayerCount(1).setLevelCount(1);
@@ -1059,7 +1918,7 @@ void vkRender::generateMipmaps(vk::Image& image, vk::Format format, int32_t texW
             .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
             .setDstAccessMask(vk::AccessFlagBits::eTransferRead);
 
-        commandBuffers[0]->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, flag, nullptr, nullptr, barrier);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, flag, nullptr, nullptr, barrier);
 
         vk::ImageBlit blit;
         blit.srcOffsets[0] = { 0, 0, 0 };
@@ -1075,14 +1934,14 @@ void vkRender::generateMipmaps(vk::Image& image, vk::Format format, int32_t texW
         blit.dstSubresource.baseArrayLayer = 0;
         blit.dstSubresource.layerCount = 1;
 
-        commandBuffers[0]->blitImage(image, vk::ImageLayout::eTransferSrcOptimal, image, vk::ImageLayout::eTransferDstOptimal, blit, vk::Filter::eLinear);
+        commandBuffer.blitImage(image, vk::ImageLayout::eTransferSrcOptimal, image, vk::ImageLayout::eTransferDstOptimal, blit, vk::Filter::eLinear);
 
         barrier.setOldLayout(vk::ImageLayout::eTransferSrcOptimal)
             .setNewLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
             .setSrcAccessMask(vk::AccessFlagBits::eTransferRead)
             .setDstAccessMask(vk::AccessFlagBits::eShaderRead);
 
-        commandBuffers[0]->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eFragmentShader, flag, nullptr, nullptr, barrier);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eFragmentShader, flag, nullptr, nullptr, barrier);
 
         if (mipWidth > 1) mipWidth /= 2;
         if (mipHeight > 1) mipHeight /= 2;
@@ -1094,32 +1953,34 @@ void vkRender::generateMipmaps(vk::Image& image, vk::Format format, int32_t texW
         .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
         .setDstAccessMask(vk::AccessFlagBits::eShaderRead);
 
-    commandBuffers[0]->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eFragmentShader, flag, nullptr, nullptr, barrier);
-
-    endSingleTimeCommands(commandBuffers);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eFragmentShader, flag, nullptr, nullptr, barrier);
 }
 
-void vkRender::copyBufferToImage(vk::UniqueBuffer& buffer, vk::UniqueImage& image, uint32_t width, uint32_t height)
+void vkRender::copyBufferToImage(vk::Buffer buffer, vk::UniqueImage& image, uint32_t width, uint32_t height)
 {
-    auto commandBuffers = beginSingleTimeCommands();
+    auto commandBuffer = m_vulkan.upload->transferCommandBuffer();
 
     vk::ImageSubresourceLayers subResourceLayers;
     subResourceLayers.setAspectMask(vk::ImageAspectFlagBits::eColor).setLayerCount(1);
     vk::BufferImageCopy region;
     region.setImageSubresource(subResourceLayers).setImageExtent(vk::Extent3D(width, height, 1));
-    commandBuffers[0]->copyBufferToImage(*buffer, *image, vk::ImageLayout::eTransferDstOptimal, region);
+    commandBuffer.copyBufferToImage(buffer, *image, vk::ImageLayout::eTransferDstOptimal, region);
 
-    endSingleTimeCommands(commandBuffers);
+    // Hand every mip over, generateMipmaps blits from level 0 into the rest on the graphics queue
+    vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, VK_REMAINING_MIP_LEVELS, 0, 1);
+    m_vulkan.upload->releaseImage(*image, range, vk::ImageLayout::eTransferDstOptimal, vk::PipelineStageFlagBits::eTransfer,
+                                  vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite);
 }
 
-void vkRender::copyBuffer(vk::UniqueBuffer& srcBuffer, vk::UniqueBuffer& dstBuffer, vk::DeviceSize size)
+void vkRender::copyBuffer(vk::Buffer srcBuffer, vk::UniqueBuffer& dstBuffer, vk::DeviceSize size, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
 {
-    auto commandBuffers = beginSingleTimeCommands();
-    commandBuffers[0]->copyBuffer(*srcBuffer, *dstBuffer, vk::BufferCopy().setSize(size));
-    endSingleTimeCommands(commandBuffers);
+    auto commandBuffer = m_vulkan.upload->transferCommandBuffer();
+    commandBuffer.copyBuffer(srcBuffer, *dstBuffer, vk::BufferCopy().setSize(size));
+
+    m_vulkan.upload->releaseBuffer(*dstBuffer, dstStage, dstAccess);
 }
 
-void vkRender::utilCreateImage(uint32_t width, uint32_t height, uint32_t mipLevels, vk::SampleCountFlagBits msaa, vk::Format format, vk::ImageTiling tiling, vk::ImageUsageFlags usage, vk::MemoryPropertyFlags properties, vk::UniqueImage& image, vk::UniqueDeviceMemory& imageMemory)
+void vkRender::utilCreateImage(uint32_t width, uint32_t height, uint32_t mipLevels, vk::SampleCountFlagBits msaa, vk::Format format, vk::ImageTiling tiling, vk::ImageUsageFlags usage, vk::MemoryPropertyFlags properties, vk::UniqueImage& image, vkUniqueAllocation& imageMemory)
 {
     vk::ImageCreateInfo imageInfo;
     imageInfo.setImageType(vk::ImageType::e2D).setExtent(vk::Extent3D(width, height, 1)).setMipLevels(1).setArrayLayers(1)
@@ -1129,10 +1990,8 @@ void vkRender::utilCreateImage(uint32_t width, uint32_t height, uint32_t mipLeve
     image = m_vulkan.device->createImageUnique(imageInfo);
 
     vk::MemoryRequirements memRequirements = m_vulkan.device->getImageMemoryRequirements(*image);
-    vk::MemoryAllocateInfo allocInfo;
-    allocInfo.setAllocationSize(memRequirements.size).setMemoryTypeIndex(findMemoryType(memRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal));
-    imageMemory = m_vulkan.device->allocateMemoryUnique(allocInfo);
-    m_vulkan.device->bindImageMemory(*image, *imageMemory, 0);
+    imageMemory = m_vulkan.allocator->allocate(memRequirements, properties, tiling == vk::ImageTiling::eLinear);
+    m_vulkan.device->bindImageMemory(*image, imageMemory->memory, imageMemory->offset);
 }
 
 vk::UniqueImageView vkRender::utilCreateImageView(vk::Image& image, vk::Format format, vk::ImageAspectFlags aspectFlags, uint32_t mipLevels)
@@ -1146,31 +2005,20 @@ vk::UniqueImageView vkRender::utilCreateImageView(vk::Image& image, vk::Format f
     return m_vulkan.device->createImageViewUnique(viewInfo);
 }
 
-void vkRender::utilCreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, vk::UniqueBuffer& buffer, vk::UniqueDeviceMemory& bufferMemory)
+void vkRender::utilCreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, vk::UniqueBuffer& buffer, vkUniqueAllocation& bufferMemory)
 {
     vk::BufferCreateInfo bufferInfo;
     bufferInfo.setSize(size).setUsage(usage).setSharingMode(vk::SharingMode::eExclusive);
     buffer = m_vulkan.device->createBufferUnique(bufferInfo);
 
     vk::MemoryRequirements memRequirements = m_vulkan.device->getBufferMemoryRequirements(*buffer);
-    vk::MemoryAllocateInfo allocInfo;
-    allocInfo.setAllocationSize(memRequirements.size).setMemoryTypeIndex(findMemoryType(memRequirements.memoryTypeBits, properties));
-    bufferMemory = m_vulkan.device->allocateMemoryUnique(allocInfo);
-    m_vulkan.device->bindBufferMemory(*buffer, *bufferMemory, 0);
+    bufferMemory = m_vulkan.allocator->allocate(memRequirements, properties, true);
+    m_vulkan.device->bindBufferMemory(*buffer, bufferMemory->memory, bufferMemory->offset);
 }
 
 uint32_t vkRender::findMemoryType(uint32_t typeFilter, vk::MemoryPropertyFlags properties)
 {
-    vk::PhysicalDeviceMemoryProperties memProperties = m_vulkan.physicalDevice.getMemoryProperties();
-
-    for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i) {
-        if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-            return i;
-        }
-    }
-    throw std::runtime_error("failed to find suitable memory type");
-    
-
+    return m_vulkan.allocator->findMemoryType(typeFilter, properties);
 }
 
 vk::Format vkRender::findDepthFormat()
@@ -1209,6 +2057,15 @@ vk::SampleCountFlagBits vkRender::getMaxUsableSampleCount()
     return vk::SampleCountFlagBits::e1; 
 }
 
+bool vkRender::depthSamplingSupported()
+{
+    // The depth pyramid reads the attachment with the sample count it is rendered at
+    auto formatProperties = m_vulkan.physicalDevice.getFormatProperties(findDepthFormat());
+    auto limits = m_vulkan.physicalDevice.getProperties().limits;
+    return (formatProperties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImage)
+        && (limits.sampledImageDepthSampleCounts & m_vulkan.sampleCount);
+}
+
 bool vkRender::hasStencilComponent(vk::Format format)
 {
     return format == vk::Format::eD32SfloatS8Uint || format == vk::Format::eD24UnormS8Uint;
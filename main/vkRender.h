@@ -12,42 +12,41 @@
 // Tell SDL not to mess with main()
 #define SDL_MAIN_HANDLED
 
-#define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
-#define GLM_FORCE_RADIANS
-#define GLM_FORCE_DEPTH_ZERO_TO_ONE
-#define GLM_ENABLE_EXPERIMENTAL
+// The GLM_FORCE_* configuration comes from the project PreprocessorDefinitions: it changes the size
+// and alignment of the gentypes, so every translation unit has to see the same one
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
-#include "glm/gtx/hash.hpp"
 
 #include <vulkan/vulkan.hpp>
 
+#include "vkAllocator.h"
+#include "vkCullBvh.h"
+#include "vkDepthPyramid.h"
+#include "vkCullPass.h"
+#include "vkDeletionQueue.h"
+#include "vkMeshCache.h"
+#include "vkMeshTools.h"
+#include "vkObjectCullPass.h"
+#include "vkProfiler.h"
+#include "vkScene.h"
+#include "vkTrace.h"
+#include "vkUniformRing.h"
+#include "vkUploadBatch.h"
+#include "vkVertexFormat.h"
+
+#include <cstddef>
 #include <iostream>
+#include <string>
 #include <vector>
 
+// Full precision import vertex, packed into the vkVertexFormat layout before upload.
+// Vertices are deduplicated and cached byte-wise, so there must not be any padding. The members use
+// the packed qualifier: with aligned gentypes glm::vec3 is padded to 16 bytes.
 struct Vertex
 {
-    glm::vec3 pos;
-    glm::vec3 color;
-    glm::vec2 texCoord;
-
-    static vk::VertexInputBindingDescription getBindingDescription()
-    {
-        vk::VertexInputBindingDescription bindingDesc;
-        bindingDesc.setBinding(0).setInputRate(vk::VertexInputRate::eVertex).setStride(sizeof(Vertex));
-        
-        return bindingDesc;
-    }
-
-    static std::array<vk::VertexInputAttributeDescription, 3> getAttributeDescription()
-    {
-        std::array<vk::VertexInputAttributeDescription, 3> attrDesc;
-        attrDesc[0].setBinding(0).setLocation(0).setOffset(offsetof(Vertex, pos)).setFormat(vk::Format::eR32G32B32Sfloat);
-        attrDesc[1].setBinding(0).setLocation(1).setOffset(offsetof(Vertex, color)).setFormat(vk::Format::eR32G32B32Sfloat);
-        attrDesc[2].setBinding(0).setLocation(2).setOffset(offsetof(Vertex, texCoord)).setFormat(vk::Format::eR32G32Sfloat);
-
-        return attrDesc;
-    }
+    glm::vec<3, float, glm::packed_highp> pos;
+    glm::vec<3, float, glm::packed_highp> color;
+    glm::vec<2, float, glm::packed_highp> texCoord;
 
     bool operator==(const Vertex& other) const
     {
@@ -55,16 +54,7 @@ struct Vertex
     }
 };
 
-namespace std
-{
-    template<> struct hash<Vertex>
-    {
-        size_t operator()(Vertex const& vertex) const
-        {
-            return ((hash<glm::vec3>()(vertex.pos) ^ (hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^ (hash<glm::vec2>()(vertex.texCoord) << 1);
-        }
-    };
-}
+static_assert(sizeof(Vertex) == 8 * sizeof(float), "Vertex must be tightly packed");
 
 struct UniformBufferObject
 {
@@ -73,6 +63,9 @@ struct UniformBufferObject
     alignas(16) glm::mat4 proj;
 };
 
+static_assert(offsetof(UniformBufferObject, modelview) == 16 && offsetof(UniformBufferObject, proj) == 80 && sizeof(UniformBufferObject) == 144,
+              "UniformBufferObject must match the std140 block of transform.glsl");
+
 struct QueueParams
 {
     vk::Queue queue;
@@ -84,13 +77,13 @@ struct ImageParams
     vk::UniqueImage image;
     vk::UniqueImageView view;
     vk::UniqueSampler sampler;
-    vk::UniqueDeviceMemory memory;
+    vkUniqueAllocation memory;
 };
 
 struct BufferParams
 {
     vk::UniqueBuffer buffer;
-    vk::UniqueDeviceMemory memory;
+    vkUniqueAllocation memory;
     void *pointer;
     uint32_t size;
 };
@@ -120,6 +113,9 @@ struct SwapChainParams
     vk::PresentInfoKHR presentMode;
     vk::ImageUsageFlags usageFlags;
 
+    // Headless mode renders into this image ring instead of swapchain images
+    std::vector<vk::UniqueImage> offscreenImages;
+    std::vector<vkUniqueAllocation> offscreenMemory;
 };
 
 struct SDL_Window;
@@ -140,16 +136,24 @@ struct CommonParams
 
     vk::PhysicalDevice physicalDevice;
     vk::UniqueDevice device;
+    bool multiDrawIndirect;
+    bool drawIndirectFirstInstance;
+    bool drawIndirectCount;
+    std::unique_ptr<vkAllocator> allocator;
 
     QueueParams gQueue;
     QueueParams pQueue;
+    QueueParams tQueue;
     SwapChainParams swapChain;
 
+    vk::UniquePipelineCache pipelineCache;
     vk::UniqueRenderPass renderPass;
     vk::UniquePipelineLayout pipelineLayout;
     vk::UniquePipeline pipeLine;
+    vk::UniquePipeline prepassPipeline;
 
     vk::UniqueCommandPool commandPool;
+    std::unique_ptr<vkUploadBatch> upload;
     std::vector<vk::UniqueCommandBuffer> commandBuffers;
 
     std::vector<vk::UniqueSemaphore> imageAvailableSemaphore;
@@ -157,36 +161,78 @@ struct CommonParams
     std::vector<vk::UniqueFence> inFlightFences;
 
     vk::UniqueBuffer vertexBuffer;
-    vk::UniqueDeviceMemory vertexBufferMemory;
+    vkUniqueAllocation vertexBufferMemory;
+    // Positions only, deinterleaved from the vertex buffer for the depth prepass
+    vk::UniqueBuffer positionBuffer;
+    vkUniqueAllocation positionBufferMemory;
 
     vk::UniqueBuffer indexBuffer;
-    vk::UniqueDeviceMemory indexBufferMemory;
+    vkUniqueAllocation indexBufferMemory;
+
+    // Instance transforms read by the vertex shader, and the identity instance stream for batch draws
+    vk::UniqueBuffer instanceBuffer;
+    vkUniqueAllocation instanceBufferMemory;
+    vk::UniqueBuffer instanceIdBuffer;
+    vkUniqueAllocation instanceIdBufferMemory;
 
-    std::vector<vk::UniqueBuffer> uniformBuffer;
-    std::vector<vk::UniqueDeviceMemory> uniformBufferMemory;
+    std::unique_ptr<vkUniformRing> uniformRing;
 
     vk::UniqueDescriptorSetLayout descriptorsetLayout;
     vk::UniqueDescriptorPool descriptorPool;
-    std::vector<vk::UniqueDescriptorSet> descriptorSets;
+    vk::UniqueDescriptorSet descriptorSet;
 
     vk::UniqueImage depthImage;
     vk::UniqueImageView depthImageView;
-    vk::UniqueDeviceMemory depthImageMemory;
+    vkUniqueAllocation depthImageMemory;
 
     vk::SampleCountFlagBits sampleCount;
     vk::UniqueImage colorImage;
     vk::UniqueImageView colorImageView;
-    vk::UniqueDeviceMemory colorImageMemory;
+    vkUniqueAllocation colorImageMemory;
 
     uint32_t mipLevels;
 
     vk::UniqueImage textureImage;
     vk::UniqueImageView textureImageView;
-    vk::UniqueDeviceMemory textureImageMemory;
+    vkUniqueAllocation textureImageMemory;
     vk::UniqueSampler textureSampler;
    
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
+    uint32_t indexCount;
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    // Vertices and indices packed for upload, released once they are staged
+    std::vector<uint8_t> vertexData;
+    std::vector<uint8_t> indexData;
+    vk::IndexType indexType;
+    glm::mat4 positionTransform;
+    // When open the buffers are staged straight from this mapping and the vectors stay empty
+    vkMeshCache meshCache;
+
+    std::vector<vkMeshLod> lods;
+    std::vector<vkMeshlet> meshlets;
+    vk::UniqueBuffer meshletBuffer;
+    vkUniqueAllocation meshletBufferMemory;
+    std::unique_ptr<vkDepthPyramid> depthPyramid;
+    std::unique_ptr<vkCullPass> cullPass;
+
+    vk::UniqueBuffer objectBuffer;
+    vkUniqueAllocation objectBufferMemory;
+    vk::UniqueBuffer lodDrawBuffer;
+    vkUniqueAllocation lodDrawBufferMemory;
+    uint32_t instanceCapacity;
+    std::unique_ptr<vkObjectCullPass> objectCullPass;
+
+    // CPU culling fallback: per frame regions of visible instance indices, written through the mapping
+    vkCullBvh cullBvh;
+    std::vector<vkLodDraw> lodDraws;
+    vk::UniqueBuffer visibleBuffer;
+    vkUniqueAllocation visibleBufferMemory;
+    vk::DeviceSize visibleRegionSize;
+
+    // Declared last so deferred objects go before the allocator and device
+    vkDeletionQueue deletionQueue;
 };
 
 
@@ -195,7 +241,7 @@ class Camera;
 class vkRender
 {
 public:
-    vkRender(SDL_Window* window, std::shared_ptr<Camera> pTrackBall, uint32_t width, uint32_t height);
+    vkRender(SDL_Window* window, std::shared_ptr<Camera> pTrackBall, uint32_t width, uint32_t height, uint32_t sceneInstances = 1, bool depthPrepass = false);
     virtual ~vkRender();
 
     int initVulkan(uint32_t width, uint32_t height);
@@ -203,26 +249,70 @@ public:
     void waitIdle();
     void drawFrame();
 
+    bool isHeadless() const { return m_headless; }
+    const vkProfiler& getProfiler() const { return m_profiler; }
+    const vkAllocator& getAllocator() const { return *m_vulkan.allocator; }
+    vkUploadBatch& getUploadBatch() { return *m_vulkan.upload; }
+    // Counters of the GPU culling pass of the last completed frame, zero without occlusion culling
+    vkCullStats getCullStats() const { return m_vulkan.depthPyramid ? m_vulkan.depthPyramid->stats() : vkCullStats(); }
+
 protected:
     uint32_t m_width;
     uint32_t m_height;
     uint32_t m_max_frame_in_flight = 2;
     uint32_t m_currentFrame = 0; 
+    uint64_t m_frameNumber = 0;
+    bool m_headless = false;
+    uint32_t m_offscreenImageCount = 3;
+    vk::DeviceSize m_uniformRegionSize = 1024 * 1024;
+    std::string m_pipelineCacheFile = "pipeline.cache";
+    std::string m_modelFileName = "chalet.obj";
+    std::string m_meshCacheDir = "meshcache/";
+    bool m_optimizeMesh = true;
+    vkVertexFormat m_vertexFormat;
+    bool m_meshletCulling = true;
+    bool m_generateLods = true;
+    uint32_t m_lodLevels = 5;
+    float m_lodMaxError = 0.02f;        // Largest error of any level against the full mesh, relative to the bounds diagonal
+    float m_lodPixelError = 1.0f;       // Coarsest level whose projected error stays below this many pixels
+    uint32_t m_sceneInstances = 1;      // Instances of the model, laid out on a grid
+    float m_sceneSpacing = 1.5f;        // Grid spacing relative to the model's bounding sphere diameter
+    bool m_gpuCulling = true;           // Cull instances and pick their level of detail in a compute pass
+    bool m_cpuCulling = true;           // BVH culling on the CPU where the GPU path is not available
+    bool m_occlusionCulling = true;     // GPU culling also tests against the previous frame's depth pyramid
+    bool m_depthPrepass = false;        // Lay down depth from positions first, then shade with depth EQUAL
+    std::vector<uint32_t> m_cpuVisible;
+    std::vector<uint32_t> m_cpuVisibleLod;
+    std::vector<uint32_t> m_cpuLodCursor;
+    std::vector<vk::DrawIndexedIndirectCommand> m_cpuDraws;
+    vkScene m_scene;
     CommonParams m_vulkan;
     std::shared_ptr<Camera> m_pCamera;
+    vkProfiler m_profiler;
 
 protected:
     void loadModel();
+    void optimizeMesh();
+    void generateLods();
+    void buildMeshlets();
+    uint32_t selectLod(const vkSceneBatch& batch, const glm::mat4& modelView, const glm::mat4& proj);
+    void packMesh();
+    void createScene();
+    void selectCulling();
 
-    void updateUniformBuffer(uint32_t index);
+    uint32_t updateUniformBuffer(uint32_t frame);
 
     void createInstance();
     void setupDebugMessenger();
     void createSurface();
     void pickPhysicalDevice();
     void createLogicalDevice();
+    void selectVertexFormat();
+    void createPipelineCache();
+    void savePipelineCache();
 
     void createSwapChain(uint32_t width, uint32_t height);
+    void createOffscreenImages(uint32_t width, uint32_t height);
     void createRenderPass();
     void createDescriptorSetLayout();
     void createGraphicsPipeline();
@@ -238,12 +328,21 @@ protected:
 
     void createVertexBuffer();
     void createIndexBuffer();
+    void createInstanceBuffer();
+    void createObjectBuffers();
+    void createCpuCulling();
+    void cullOnCpu(uint32_t frame);
+    void createMeshletBuffer();
+    void createDepthPyramid();
+    void createCullPass();
+    void createObjectCullPass();
 
     void createUniformBuffer();
 
     void createDescriptorPool();
     void createDescriptorSets();
     void createCommandBuffers();
+    void recordCommandBuffer(uint32_t frame, uint32_t imageIndex, uint32_t uboOffset);
 
     void createSyncObjects();
 
@@ -255,20 +354,21 @@ protected:
 
 protected:
     void findQueueFamilies(bool presentSupport);
-    std::vector<vk::UniqueCommandBuffer> beginSingleTimeCommands();
-    void endSingleTimeCommands(std::vector<vk::UniqueCommandBuffer>& commandBuffers);
 
     void transitionImageLayout(vk::UniqueImage& image, vk::Format format, vk::ImageLayout oldLayout, vk::ImageLayout newLayout, uint32_t mipLevels);
 
-    void utilCreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, vk::UniqueBuffer& buffer, vk::UniqueDeviceMemory& bufferMemory);
-    void utilCreateImage(uint32_t width, uint32_t height, uint32_t mipLevels, vk::SampleCountFlagBits msaa, vk::Format format, vk::ImageTiling tiling, vk::ImageUsageFlags usage, vk::MemoryPropertyFlags properties, vk::UniqueImage& image, vk::UniqueDeviceMemory& imageMemory);
+    void utilCreateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, vk::UniqueBuffer& buffer, vkUniqueAllocation& bufferMemory);
+    void utilCreateImage(uint32_t width, uint32_t height, uint32_t mipLevels, vk::SampleCountFlagBits msaa, vk::Format format, vk::ImageTiling tiling, vk::ImageUsageFlags usage, vk::MemoryPropertyFlags properties, vk::UniqueImage& image, vkUniqueAllocation& imageMemory);
     vk::UniqueImageView utilCreateImageView(vk::Image& image, vk::Format format, vk::ImageAspectFlags aspectFlags, uint32_t mipLevels);
     void generateMipmaps(vk::Image& image, vk::Format format, int32_t texWidth, int32_t texHeight, uint32_t mipLevels);
 
-    void copyBufferToImage(vk::UniqueBuffer& buffer, vk::UniqueImage& image, uint32_t width, uint32_t height);
-    void copyBuffer(vk::UniqueBuffer& srcBuffer, vk::UniqueBuffer& dstBuffer, vk::DeviceSize size);
+    void copyBufferToImage(vk::Buffer buffer, vk::UniqueImage& image, uint32_t width, uint32_t height);
+    void copyBuffer(vk::Buffer srcBuffer, vk::UniqueBuffer& dstBuffer, vk::DeviceSize size,
+                    vk::PipelineStageFlags dstStage = vk::PipelineStageFlagBits::eVertexInput,
+                    vk::AccessFlags dstAccess = vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
 
     vk::Format findDepthFormat();
+    bool depthSamplingSupported();
     uint32_t findMemoryType(uint32_t typeFilter, vk::MemoryPropertyFlags properties);
     vk::Format findSupportedFormat(const std::vector<vk::Format>& candidates, vk::ImageTiling tiling, vk::FormatFeatureFlags features);
     bool hasStencilComponent(vk::Format format);
@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "vkScene.h"
+
+const uint32_t vkScene::kBinding;
+const uint32_t vkScene::kLocationInstance;
+const uint32_t vkScene::kBatchInstances;
+
+// Spreads the low 10 bits of v to every third bit
+static uint32_t spreadBits(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+static float maxScale(const glm::mat4& m)
+{
+    float sx = glm::dot(glm::vec3(m[0]), glm::vec3(m[0]));
+    float sy = glm::dot(glm::vec3(m[1]), glm::vec3(m[1]));
+    float sz = glm::dot(glm::vec3(m[2]), glm::vec3(m[2]));
+    return std::sqrt(std::max(sx, std::max(sy, sz)));
+}
+
+uint32_t vkScene::addMesh(const vkSceneMesh& mesh)
+{
+    m_meshes.push_back(mesh);
+    return static_cast<uint32_t>(m_meshes.size() - 1);
+}
+
+uint32_t vkScene::addInstance(uint32_t mesh, const glm::mat4& transform)
+{
+    m_instances.push_back(vkSceneInstance{ mesh, transform });
+    return static_cast<uint32_t>(m_instances.size() - 1);
+}
+
+void vkScene::addGrid(uint32_t mesh, uint32_t count, float spacing)
+{
+    uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(double(count))));
+    float origin = -0.5f * spacing * (side - 1);
+    for (uint32_t i = 0; i < count; ++i) {
+        glm::vec3 offset(origin + spacing * (i % side), origin + spacing * (i / side), 0.0f);
+        addInstance(mesh, glm::translate(glm::mat4(1.0f), offset));
+    }
+}
+
+void vkScene::clear()
+{
+    m_meshes.clear();
+    m_instances.clear();
+    m_batches.clear();
+    m_instanceData.clear();
+    m_objects.clear();
+}
+
+void vkScene::build(uint32_t maxBatchInstances)
+{
+    m_batches.clear();
+    m_instanceData.clear();
+    m_objects.clear();
+    size_t count = m_instances.size();
+    if (count == 0) {
+        return;
+    }
+    maxBatchInstances = std::max(maxBatchInstances, 1u);
+
+    // World space bounding spheres
+    std::vector<glm::vec4> spheres(count);
+    glm::vec3 sceneMin(std::numeric_limits<float>::max());
+    glm::vec3 sceneMax(-std::numeric_limits<float>::max());
+    for (size_t i = 0; i < count; ++i) {
+        const vkSceneInstance& instance = m_instances[i];
+        const vkSceneMesh& mesh = m_meshes[instance.mesh];
+        glm::vec3 center = glm::vec3(instance.transform * glm::vec4(mesh.center, 1.0f));
+        spheres[i] = glm::vec4(center, mesh.radius * maxScale(instance.transform));
+        sceneMin = glm::min(sceneMin, center);
+        sceneMax = glm::max(sceneMax, center);
+    }
+
+    // Mesh in the upper half of the key, Morton code of the quantized center in the lower half
+    glm::vec3 extent = sceneMax - sceneMin;
+    glm::vec3 invExtent;
+    for (int c = 0; c < 3; ++c) {
+        invExtent[c] = (extent[c] > 0.0f) ? 1023.0f / extent[c] : 0.0f;
+    }
+    std::vector<uint64_t> keys(count);
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec3 q = (glm::vec3(spheres[i]) - sceneMin) * invExtent;
+        uint32_t morton = spreadBits(uint32_t(q.x)) | (spreadBits(uint32_t(q.y)) << 1) | (spreadBits(uint32_t(q.z)) << 2);
+        keys[i] = (uint64_t(m_instances[i].mesh) << 32) | morton;
+    }
+    std::vector<uint32_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+    m_instanceData.resize(count);
+    m_objects.resize(count);
+    for (size_t begin = 0; begin < count;) {
+        uint32_t meshIndex = m_instances[order[begin]].mesh;
+        size_t end = begin;
+        while (end < count && end - begin < maxBatchInstances && m_instances[order[end]].mesh == meshIndex) {
+            ++end;
+        }
+
+        vkSceneBatch batch = {};
+        batch.mesh = meshIndex;
+        batch.firstInstance = static_cast<uint32_t>(begin);
+        batch.instanceCount = static_cast<uint32_t>(end - begin);
+
+        glm::vec3 batchMin(std::numeric_limits<float>::max());
+        glm::vec3 batchMax(-std::numeric_limits<float>::max());
+        for (size_t i = begin; i < end; ++i) {
+            batchMin = glm::min(batchMin, glm::vec3(spheres[order[i]]));
+            batchMax = glm::max(batchMax, glm::vec3(spheres[order[i]]));
+        }
+        batch.center = (batchMin + batchMax) * 0.5f;
+
+        const vkSceneMesh& mesh = m_meshes[meshIndex];
+        for (size_t i = begin; i < end; ++i) {
+            const vkSceneInstance& instance = m_instances[order[i]];
+            const glm::vec4& sphere = spheres[order[i]];
+            float scale = maxScale(instance.transform);
+            batch.radius = std::max(batch.radius, glm::length(glm::vec3(sphere) - batch.center) + sphere.w);
+            batch.scale = std::max(batch.scale, scale);
+
+            glm::mat4 rows = glm::transpose(instance.transform * mesh.positionTransform);
+            m_instanceData[i] = vkInstanceData{ { rows[0], rows[1], rows[2] } };
+            m_objects[i] = vkSceneObject{ sphere, mesh.firstLod, mesh.lodCount, scale, 0 };
+        }
+
+        m_batches.push_back(batch);
+        begin = end;
+    }
+}
+
+std::vector<uint32_t> vkScene::meshInstanceCounts() const
+{
+    std::vector<uint32_t> counts(m_meshes.size(), 0);
+    for (const auto& instance : m_instances) {
+        ++counts[instance.mesh];
+    }
+    return counts;
+}
+
+vk::VertexInputBindingDescription vkScene::getBindingDescription()
+{
+    vk::VertexInputBindingDescription bindingDesc;
+    bindingDesc.setBinding(kBinding).setInputRate(vk::VertexInputRate::eInstance).setStride(sizeof(uint32_t));
+
+    return bindingDesc;
+}
+
+std::vector<vk::VertexInputAttributeDescription> vkScene::getAttributeDescription()
+{
+    std::vector<vk::VertexInputAttributeDescription> attrDesc(1);
+    attrDesc[0].setBinding(kBinding).setLocation(kLocationInstance).setOffset(0).setFormat(vk::Format::eR32Uint);
+
+    return attrDesc;
+}
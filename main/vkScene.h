@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstddef>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+// Draw ranges of one mesh inside the shared vertex and index buffers
+struct vkSceneMesh
+{
+    int32_t vertexOffset;
+    uint32_t firstLod;              // Range of the shared level of detail table
+    uint32_t lodCount;
+    glm::vec3 center;               // Model space bounding sphere
+    float radius;
+    glm::mat4 positionTransform;    // Maps stored positions to model space, see vkVertexFormat
+};
+
+struct vkSceneInstance
+{
+    uint32_t mesh;
+    glm::mat4 transform;            // Model to world
+};
+
+// Instance transform read by the vertex shader: the first three rows of transform * positionTransform
+struct vkInstanceData
+{
+    glm::vec4 rows[3];
+};
+
+static_assert(sizeof(vkInstanceData) == 48, "vkInstanceData must match the Instances block of transform.glsl");
+
+// Culling input of one instance, laid out to match the std430 Object struct of objectcull.comp
+struct vkSceneObject
+{
+    glm::vec4 sphere;               // World space center, radius
+    uint32_t firstLod;
+    uint32_t lodCount;
+    float scale;                    // Largest model to world scale
+    uint32_t reserved;
+};
+
+static_assert(offsetof(vkSceneObject, firstLod) == 16 && offsetof(vkSceneObject, scale) == 24 && sizeof(vkSceneObject) == 32,
+              "vkSceneObject must match Object in objectcull.comp");
+
+// One instanced draw: consecutive instances of a mesh that lie close together
+struct vkSceneBatch
+{
+    uint32_t mesh;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
+    glm::vec3 center;               // World space bounding sphere of all its instances
+    float radius;
+    float scale;                    // Largest model to world scale of its instances
+};
+
+// Meshes and their instances.
+// build() sorts the instances by mesh and along a Morton curve, then cuts them into batches of at
+// most maxBatchInstances, so a scene of any size renders with one instanced draw per batch.
+// Transforms and objects are in batch order. The instance rate vertex stream holds indices into
+// them: the identity for batch draws, the surviving instances when culling on the GPU.
+class vkScene
+{
+public:
+    static const uint32_t kBinding = 1;
+    static const uint32_t kLocationInstance = 3;
+    static const uint32_t kBatchInstances = 1024;
+
+    uint32_t addMesh(const vkSceneMesh& mesh);
+    uint32_t addInstance(uint32_t mesh, const glm::mat4& transform);
+    // count instances on a square grid in the xy plane around the origin, a single one stays at the origin
+    void addGrid(uint32_t mesh, uint32_t count, float spacing);
+    void clear();
+
+    void build(uint32_t maxBatchInstances = kBatchInstances);
+
+    const std::vector<vkSceneMesh>& meshes() const { return m_meshes; }
+    const std::vector<vkSceneInstance>& instances() const { return m_instances; }
+    const std::vector<vkSceneBatch>& batches() const { return m_batches; }
+    const std::vector<vkInstanceData>& instanceData() const { return m_instanceData; }
+    const std::vector<vkSceneObject>& objects() const { return m_objects; }
+    // Instance count of every mesh
+    std::vector<uint32_t> meshInstanceCounts() const;
+
+    static vk::VertexInputBindingDescription getBindingDescription();
+    static std::vector<vk::VertexInputAttributeDescription> getAttributeDescription();
+
+private:
+    std::vector<vkSceneMesh> m_meshes;
+    std::vector<vkSceneInstance> m_instances;
+    std::vector<vkSceneBatch> m_batches;
+    std::vector<vkInstanceData> m_instanceData;
+    std::vector<vkSceneObject> m_objects;
+};
@@ -0,0 +1,48 @@
+#include <algorithm>
+
+#include "vkThreadPool.h"
+
+vkThreadPool* vkThreadPool::instance()
+{
+    static std::unique_ptr<vkThreadPool> thisPtr(new vkThreadPool);
+    return thisPtr.get();
+}
+
+vkThreadPool::vkThreadPool(uint32_t threadCount)
+{
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (uint32_t i = 0; i < threadCount; ++i) {
+        m_workers.emplace_back(&vkThreadPool::workerLoop, this);
+    }
+}
+
+vkThreadPool::~vkThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+void vkThreadPool::workerLoop()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+            if (m_stop && m_tasks.empty()) {
+                return;
+            }
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
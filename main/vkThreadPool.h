@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed size worker pool, tasks are queued FIFO and their results returned through futures.
+class vkThreadPool
+{
+public:
+    explicit vkThreadPool(uint32_t threadCount = 0);
+    virtual ~vkThreadPool();
+
+    vkThreadPool(vkThreadPool const&) = delete;
+    vkThreadPool& operator=(vkThreadPool const&) = delete;
+
+    static vkThreadPool* instance();
+
+    template <typename F>
+    auto enqueue(F&& func) -> std::future<decltype(func())>
+    {
+        using R = decltype(func());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(func));
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.emplace_back([task]() { (*task)(); });
+        }
+        m_condition.notify_one();
+        return result;
+    }
+
+    uint32_t size() const { return static_cast<uint32_t>(m_workers.size()); }
+
+private:
+    void workerLoop();
+
+private:
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stop = false;
+};
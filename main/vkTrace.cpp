@@ -0,0 +1,114 @@
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+#include "vkTrace.h"
+
+std::atomic<bool> vkTrace::s_enabled(false);
+
+static std::chrono::steady_clock::time_point traceEpoch()
+{
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return epoch;
+}
+
+static std::string jsonEscape(const char* str)
+{
+    std::string out;
+    for (const char* c = str; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            out.push_back('\\');
+            out.push_back(*c);
+        } else if (static_cast<unsigned char>(*c) < 0x20) {
+            out.push_back(' ');
+        } else {
+            out.push_back(*c);
+        }
+    }
+    return out;
+}
+
+vkTrace* vkTrace::instance()
+{
+    static std::unique_ptr<vkTrace> thisPtr(new vkTrace);
+    return thisPtr.get();
+}
+
+vkTrace::vkTrace()
+{
+    traceEpoch();
+}
+
+vkTrace::~vkTrace()
+{
+}
+
+uint64_t vkTrace::nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceEpoch()).count();
+}
+
+void vkTrace::setEnabled(bool enable)
+{
+    s_enabled.store(enable, std::memory_order_relaxed);
+}
+
+vkTrace::ThreadBuffer* vkTrace::threadBuffer()
+{
+    // The registry keeps buffers alive after their thread exits so save() still sees them
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (!buffer) {
+        auto newBuffer = std::make_shared<ThreadBuffer>();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        newBuffer->tid = static_cast<uint32_t>(m_buffers.size() + 1);
+        m_buffers.push_back(newBuffer);
+        buffer = newBuffer.get();
+    }
+    return buffer;
+}
+
+void vkTrace::addEvent(const char* name, const char* category, uint64_t startUs, uint64_t durationUs, const std::string& detail)
+{
+    ThreadBuffer* buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    buffer->events.push_back({ name, category, startUs, durationUs, detail });
+}
+
+void vkTrace::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& buffer : m_buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        buffer->events.clear();
+    }
+}
+
+bool vkTrace::save(const std::string& fileName)
+{
+    std::ofstream file(fileName, std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& buffer : m_buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        for (const auto& event : buffer->events) {
+            file << (first ? "\n" : ",\n");
+            first = false;
+            file << "{\"name\":\"" << jsonEscape(event.name) << "\",\"cat\":\"" << jsonEscape(event.category)
+                 << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                 << ",\"ts\":" << event.start << ",\"dur\":" << event.duration;
+            if (!event.detail.empty()) {
+                file << ",\"args\":{\"detail\":\"" << jsonEscape(event.detail.c_str()) << "\"}";
+            }
+            file << "}";
+        }
+    }
+    file << "\n]}\n";
+
+    return true;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Chrome trace-event (chrome://tracing, Perfetto) recorder.
+// Events are appended to thread local buffers and only merged when saved. When tracing is off a
+// scope costs one relaxed atomic load, so the hooks can stay in field builds. Defining
+// VK_TRACE_DISABLED compiles the scopes out, their arguments are not evaluated.
+class vkTrace
+{
+public:
+    virtual ~vkTrace();
+    static vkTrace* instance();
+
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+    static uint64_t nowUs();
+
+    void setEnabled(bool enable);
+    void addEvent(const char* name, const char* category, uint64_t startUs, uint64_t durationUs, const std::string& detail = std::string());
+    bool save(const std::string& fileName);
+    void clear();
+
+private:
+    struct Event
+    {
+        const char* name;
+        const char* category;
+        uint64_t start;
+        uint64_t duration;
+        std::string detail;
+    };
+
+    struct ThreadBuffer
+    {
+        uint32_t tid;
+        std::mutex mutex;
+        std::vector<Event> events;
+    };
+
+    vkTrace();
+    vkTrace(vkTrace const&) = delete;
+    vkTrace& operator=(vkTrace const&) = delete;
+
+    ThreadBuffer* threadBuffer();
+
+private:
+    static std::atomic<bool> s_enabled;
+
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> m_buffers;
+};
+
+class vkTraceScope
+{
+public:
+    vkTraceScope(const char* name, const char* category = "vk")
+    {
+        if (vkTrace::enabled()) {
+            m_name = name;
+            m_category = category;
+            m_start = vkTrace::nowUs();
+        }
+    }
+    // detail is only copied while tracing is on
+    vkTraceScope(const char* name, const char* category, const char* detail) : vkTraceScope(name, category)
+    {
+        if (m_name && detail) {
+            m_detail = detail;
+        }
+    }
+    ~vkTraceScope()
+    {
+        if (m_name) {
+            vkTrace::instance()->addEvent(m_name, m_category, m_start, vkTrace::nowUs() - m_start, m_detail);
+        }
+    }
+
+    vkTraceScope(vkTraceScope const&) = delete;
+    vkTraceScope& operator=(vkTraceScope const&) = delete;
+
+private:
+    const char* m_name = nullptr;
+    const char* m_category = nullptr;
+    uint64_t m_start = 0;
+    std::string m_detail;
+};
+
+#define VK_TRACE_CONCAT_IMPL(a, b) a##b
+#define VK_TRACE_CONCAT(a, b) VK_TRACE_CONCAT_IMPL(a, b)
+#ifdef VK_TRACE_DISABLED
+#define VK_TRACE_SCOPE(...) ((void)0)
+#else
+#define VK_TRACE_SCOPE(...) vkTraceScope VK_TRACE_CONCAT(vkTraceScope_, __LINE__)(__VA_ARGS__)
+#endif
+#define VK_TRACE_FUNCTION() VK_TRACE_SCOPE(__FUNCTION__)
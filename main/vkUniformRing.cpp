@@ -0,0 +1,45 @@
+#include <algorithm>
+
+#include "vkUniformRing.h"
+
+static vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+vkUniformRing::vkUniformRing(vk::PhysicalDevice physicalDevice, vk::Device device, vkAllocator& allocator, vk::DeviceSize regionSize, uint32_t regionCount)
+{
+    m_alignment = std::max<vk::DeviceSize>(physicalDevice.getProperties().limits.minUniformBufferOffsetAlignment, 1);
+    m_regionSize = alignUp(regionSize, m_alignment);
+    m_regionCount = regionCount;
+
+    vk::BufferCreateInfo bufferInfo;
+    bufferInfo.setSize(m_regionSize * m_regionCount).setUsage(vk::BufferUsageFlagBits::eUniformBuffer).setSharingMode(vk::SharingMode::eExclusive);
+    m_buffer = device.createBufferUnique(bufferInfo);
+
+    vk::MemoryRequirements memRequirements = device.getBufferMemoryRequirements(*m_buffer);
+    m_memory = allocator.allocate(memRequirements, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, true);
+    device.bindBufferMemory(*m_buffer, m_memory->memory, m_memory->offset);
+}
+
+vkUniformRing::~vkUniformRing()
+{
+}
+
+void vkUniformRing::beginFrame(uint32_t region)
+{
+    m_regionBase = (region % m_regionCount) * m_regionSize;
+    m_head = m_regionBase;
+}
+
+uint32_t vkUniformRing::allocate(vk::DeviceSize size, void** pointer)
+{
+    vk::DeviceSize offset = m_head;
+    if (offset + size > m_regionBase + m_regionSize) {
+        throw std::runtime_error("vkUniformRing region overflow");
+    }
+    m_head = alignUp(offset + size, m_alignment);
+
+    *pointer = static_cast<char*>(m_memory->pointer) + offset;
+    return static_cast<uint32_t>(offset);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstring>
+
+#include "vkAllocator.h"
+
+// Persistently mapped, host coherent uniform buffer split into one region per frame in flight.
+// Each frame rewinds its region and linearly sub-allocates per-draw constants, the returned
+// offsets are meant to be used as dynamic offsets for an eUniformBufferDynamic descriptor.
+class vkUniformRing
+{
+public:
+    vkUniformRing(vk::PhysicalDevice physicalDevice, vk::Device device, vkAllocator& allocator, vk::DeviceSize regionSize, uint32_t regionCount);
+    virtual ~vkUniformRing();
+
+    vkUniformRing(vkUniformRing const&) = delete;
+    vkUniformRing& operator=(vkUniformRing const&) = delete;
+
+    void beginFrame(uint32_t region);
+    uint32_t allocate(vk::DeviceSize size, void** pointer);
+
+    template <typename T>
+    uint32_t push(const T& data)
+    {
+        void* pointer = nullptr;
+        uint32_t offset = allocate(sizeof(T), &pointer);
+        memcpy(pointer, &data, sizeof(T));
+        return offset;
+    }
+
+    vk::Buffer buffer() const { return *m_buffer; }
+    vk::DeviceSize regionSize() const { return m_regionSize; }
+    vk::DeviceSize regionUsed() const { return m_head - m_regionBase; }
+
+private:
+    vk::UniqueBuffer m_buffer;
+    vkUniqueAllocation m_memory;
+
+    vk::DeviceSize m_alignment;
+    vk::DeviceSize m_regionSize;
+    uint32_t m_regionCount;
+
+    vk::DeviceSize m_regionBase = 0;
+    vk::DeviceSize m_head = 0;
+};
@@ -0,0 +1,186 @@
+#include <cstring>
+#include <limits>
+
+#include "vkUploadBatch.h"
+
+vkUploadBatch::vkUploadBatch(vk::Device device, vkAllocator& allocator, vk::Queue transferQueue, uint32_t transferFamily, vk::Queue graphicsQueue, uint32_t graphicsFamily) : m_allocator(allocator)
+{
+    m_device = device;
+    m_transferQueue = transferQueue;
+    m_transferFamily = transferFamily;
+    m_graphicsQueue = graphicsQueue;
+    m_graphicsFamily = graphicsFamily;
+
+    vk::CommandPoolCreateInfo poolInfo;
+    poolInfo.setQueueFamilyIndex(m_transferFamily).setFlags(vk::CommandPoolCreateFlagBits::eTransient);
+    m_transferPool = m_device.createCommandPoolUnique(poolInfo);
+
+    if (asyncTransfer()) {
+        poolInfo.setQueueFamilyIndex(m_graphicsFamily);
+        m_graphicsPool = m_device.createCommandPoolUnique(poolInfo);
+    }
+}
+
+vkUploadBatch::~vkUploadBatch()
+{
+    retire(true);
+}
+
+vk::UniqueCommandBuffer vkUploadBatch::beginCommandBuffer(vk::CommandPool pool)
+{
+    vk::CommandBufferAllocateInfo allocInfo;
+    allocInfo.setLevel(vk::CommandBufferLevel::ePrimary).setCommandBufferCount(1).setCommandPool(pool);
+    auto commandBuffer = std::move(m_device.allocateCommandBuffersUnique(allocInfo)[0]);
+    commandBuffer->begin(vk::CommandBufferBeginInfo().setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+    m_recording = true;
+
+    return commandBuffer;
+}
+
+vk::CommandBuffer vkUploadBatch::transferCommandBuffer()
+{
+    if (!m_current.transferCommandBuffer) {
+        m_current.transferCommandBuffer = beginCommandBuffer(*m_transferPool);
+    }
+
+    return *m_current.transferCommandBuffer;
+}
+
+vk::CommandBuffer vkUploadBatch::graphicsCommandBuffer()
+{
+    if (!asyncTransfer()) {
+        return transferCommandBuffer();
+    }
+    if (!m_current.graphicsCommandBuffer) {
+        m_current.graphicsCommandBuffer = beginCommandBuffer(*m_graphicsPool);
+    }
+
+    return *m_current.graphicsCommandBuffer;
+}
+
+vk::Buffer vkUploadBatch::stage(const void* data, vk::DeviceSize size)
+{
+    // Barriers recorded earlier (e.g. attachment transitions) would otherwise let asset loading
+    // between them and the first copy count as upload time
+    if (m_current.stagingBuffers.empty()) {
+        m_current.start = std::chrono::steady_clock::now();
+    }
+
+    vk::BufferCreateInfo bufferInfo;
+    bufferInfo.setSize(size).setUsage(vk::BufferUsageFlagBits::eTransferSrc).setSharingMode(vk::SharingMode::eExclusive);
+    vk::UniqueBuffer buffer = m_device.createBufferUnique(bufferInfo);
+
+    vk::MemoryRequirements memRequirements = m_device.getBufferMemoryRequirements(*buffer);
+    vkUniqueAllocation memory = m_allocator.allocate(memRequirements, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, true);
+    m_device.bindBufferMemory(*buffer, memory->memory, memory->offset);
+    if (data) {
+        memcpy(memory->pointer, data, size);
+    }
+
+    vk::Buffer handle = *buffer;
+    m_current.stagingBuffers.push_back(std::move(buffer));
+    m_current.stagingMemory.push_back(std::move(memory));
+    m_stagedBytes += size;
+
+    return handle;
+}
+
+void vkUploadBatch::releaseBuffer(vk::Buffer buffer, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+    if (!asyncTransfer()) {
+        // Same queue family, the trailing barrier in submit() covers visibility
+        return;
+    }
+
+    vk::BufferMemoryBarrier barrier;
+    barrier.setBuffer(buffer).setOffset(0).setSize(VK_WHOLE_SIZE)
+        .setSrcQueueFamilyIndex(m_transferFamily).setDstQueueFamilyIndex(m_graphicsFamily);
+
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite).setDstAccessMask(vk::AccessFlags());
+    transferCommandBuffer().pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), nullptr, barrier, nullptr);
+
+    barrier.setSrcAccessMask(vk::AccessFlags()).setDstAccessMask(dstAccess);
+    graphicsCommandBuffer().pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, dstStage, vk::DependencyFlags(), nullptr, barrier, nullptr);
+}
+
+void vkUploadBatch::releaseImage(vk::Image image, const vk::ImageSubresourceRange& range, vk::ImageLayout layout, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess)
+{
+    if (!asyncTransfer()) {
+        return;
+    }
+
+    vk::ImageMemoryBarrier barrier;
+    barrier.setImage(image).setSubresourceRange(range).setOldLayout(layout).setNewLayout(layout)
+        .setSrcQueueFamilyIndex(m_transferFamily).setDstQueueFamilyIndex(m_graphicsFamily);
+
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite).setDstAccessMask(vk::AccessFlags());
+    transferCommandBuffer().pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags(), nullptr, nullptr, barrier);
+
+    barrier.setSrcAccessMask(vk::AccessFlags()).setDstAccessMask(dstAccess);
+    graphicsCommandBuffer().pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, dstStage, vk::DependencyFlags(), nullptr, nullptr, barrier);
+}
+
+void vkUploadBatch::submit()
+{
+    if (!m_recording) {
+        return;
+    }
+
+    // Make every transfer write visible to the consumers of uploaded buffers and images
+    vk::MemoryBarrier barrier;
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+        .setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead | vk::AccessFlagBits::eUniformRead | vk::AccessFlagBits::eShaderRead);
+    graphicsCommandBuffer().pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eAllCommands, vk::DependencyFlags(), barrier, nullptr, nullptr);
+
+    m_current.fence = m_device.createFenceUnique(vk::FenceCreateInfo());
+
+    if (m_transferQueue == m_graphicsQueue) {
+        m_current.transferCommandBuffer->end();
+
+        vk::SubmitInfo submitInfo;
+        submitInfo.setCommandBufferCount(1).setPCommandBuffers(&*m_current.transferCommandBuffer);
+        m_graphicsQueue.submit(1, &submitInfo, *m_current.fence);
+    } else {
+        // Transfer queue signals, graphics queue acquires ownership and waits before anything renders
+        m_current.semaphore = m_device.createSemaphoreUnique(vk::SemaphoreCreateInfo());
+
+        vk::SubmitInfo transferSubmit;
+        transferSubmit.setSignalSemaphoreCount(1).setPSignalSemaphores(&*m_current.semaphore);
+        if (m_current.transferCommandBuffer) {
+            m_current.transferCommandBuffer->end();
+            transferSubmit.setCommandBufferCount(1).setPCommandBuffers(&*m_current.transferCommandBuffer);
+        }
+        m_transferQueue.submit(1, &transferSubmit, vk::Fence());
+
+        const vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eAllCommands;
+        vk::SubmitInfo graphicsSubmit;
+        graphicsSubmit.setWaitSemaphoreCount(1).setPWaitSemaphores(&*m_current.semaphore).setPWaitDstStageMask(&waitStage);
+        if (m_current.graphicsCommandBuffer) {
+            m_current.graphicsCommandBuffer->end();
+            graphicsSubmit.setCommandBufferCount(1).setPCommandBuffers(&*m_current.graphicsCommandBuffer);
+        }
+        m_graphicsQueue.submit(1, &graphicsSubmit, *m_current.fence);
+    }
+
+    m_pending.push_back(std::move(m_current));
+    m_current = Submission();
+    m_recording = false;
+}
+
+bool vkUploadBatch::retire(bool wait)
+{
+    while (!m_pending.empty()) {
+        vk::Fence fence = *m_pending.front().fence;
+        if (wait) {
+            m_device.waitForFences(1, &fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+        } else if (m_device.getFenceStatus(fence) != vk::Result::eSuccess) {
+            return false;
+        }
+        if (!m_pending.front().stagingBuffers.empty()) {
+            m_uploadSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_pending.front().start).count();
+        }
+        m_pending.pop_front();
+    }
+
+    return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include "vkAllocator.h"
+
+// Records many copies, layout transitions and mip blits into one submission guarded by a fence.
+// Staging buffers stay alive until that fence signals and are released by retire(), so loading
+// assets no longer stalls the queue per operation.
+//
+// Copies are recorded on the transfer queue. When it belongs to a different family, the graphics
+// only work (blits, attachment transitions) goes to a second command buffer on the graphics queue;
+// release/acquire barriers hand queue family ownership over and a semaphore orders the two submits.
+class vkUploadBatch
+{
+public:
+    vkUploadBatch(vk::Device device, vkAllocator& allocator, vk::Queue transferQueue, uint32_t transferFamily, vk::Queue graphicsQueue, uint32_t graphicsFamily);
+    virtual ~vkUploadBatch();
+
+    vkUploadBatch(vkUploadBatch const&) = delete;
+    vkUploadBatch& operator=(vkUploadBatch const&) = delete;
+
+    vk::CommandBuffer transferCommandBuffer();
+    vk::CommandBuffer graphicsCommandBuffer();
+    vk::Buffer stage(const void* data, vk::DeviceSize size);
+
+    void releaseBuffer(vk::Buffer buffer, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess);
+    void releaseImage(vk::Image image, const vk::ImageSubresourceRange& range, vk::ImageLayout layout, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccess);
+
+    void submit();
+    bool retire(bool wait = false);
+
+    bool recording() const { return m_recording; }
+    bool asyncTransfer() const { return m_transferFamily != m_graphicsFamily; }
+    uint64_t stagedBytes() const { return m_stagedBytes; }
+    // Time from the first staged copy of each batch until its fence was seen signaled
+    double uploadSeconds() const { return m_uploadSeconds; }
+
+private:
+    struct Submission
+    {
+        vk::UniqueCommandBuffer transferCommandBuffer;
+        vk::UniqueCommandBuffer graphicsCommandBuffer;
+        vk::UniqueSemaphore semaphore;
+        vk::UniqueFence fence;
+        std::vector<vk::UniqueBuffer> stagingBuffers;
+        std::vector<vkUniqueAllocation> stagingMemory;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    vk::UniqueCommandBuffer beginCommandBuffer(vk::CommandPool pool);
+
+private:
+    vk::Device m_device;
+    vkAllocator& m_allocator;
+
+    vk::Queue m_transferQueue;
+    vk::Queue m_graphicsQueue;
+    uint32_t m_transferFamily;
+    uint32_t m_graphicsFamily;
+    vk::UniqueCommandPool m_transferPool;
+    vk::UniqueCommandPool m_graphicsPool;
+
+    bool m_recording = false;
+    Submission m_current;
+    std::deque<Submission> m_pending;
+
+    uint64_t m_stagedBytes = 0;
+    double m_uploadSeconds = 0.0;
+};
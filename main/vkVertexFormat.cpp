@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "glm/packing.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "vkVertexFormat.h"
+
+vk::Format vkVertexFormat::positionFormat() const
+{
+    // 16 bit three component formats are rarely supported for vertex fetch, the fourth one is padding
+    return (position == Position::eUnorm16) ? vk::Format::eR16G16B16A16Unorm : vk::Format::eR32G32B32Sfloat;
+}
+
+vk::Format vkVertexFormat::texCoordFormat() const
+{
+    switch (texCoord) {
+    case TexCoord::eFloat16:
+        return vk::Format::eR16G16Sfloat;
+    case TexCoord::eUnorm16:
+        return vk::Format::eR16G16Unorm;
+    default:
+        return vk::Format::eR32G32Sfloat;
+    }
+}
+
+uint32_t vkVertexFormat::stride() const
+{
+    return positionStride() + ((texCoord == TexCoord::eFloat32) ? 8 : 4) + (color ? 4 : 0);
+}
+
+vk::VertexInputBindingDescription vkVertexFormat::getBindingDescription() const
+{
+    vk::VertexInputBindingDescription bindingDesc;
+    bindingDesc.setBinding(0).setInputRate(vk::VertexInputRate::eVertex).setStride(stride());
+
+    return bindingDesc;
+}
+
+std::vector<vk::VertexInputAttributeDescription> vkVertexFormat::getAttributeDescription() const
+{
+    // Position, texture coordinate, then the optional color so every attribute stays 4 byte aligned
+    std::vector<vk::VertexInputAttributeDescription> attrDesc(color ? 3 : 2);
+    uint32_t offset = 0;
+    attrDesc[0].setBinding(0).setLocation(kLocationPosition).setOffset(offset).setFormat(positionFormat());
+    offset += positionStride();
+    attrDesc[1].setBinding(0).setLocation(kLocationTexCoord).setOffset(offset).setFormat(texCoordFormat());
+    offset += (texCoord == TexCoord::eFloat32) ? 8 : 4;
+    if (color) {
+        attrDesc[2].setBinding(0).setLocation(kLocationColor).setOffset(offset).setFormat(colorFormat());
+    }
+
+    return attrDesc;
+}
+
+vk::VertexInputBindingDescription vkVertexFormat::getPositionBindingDescription() const
+{
+    vk::VertexInputBindingDescription bindingDesc;
+    bindingDesc.setBinding(0).setInputRate(vk::VertexInputRate::eVertex).setStride(positionStride());
+
+    return bindingDesc;
+}
+
+vk::VertexInputAttributeDescription vkVertexFormat::getPositionAttributeDescription() const
+{
+    vk::VertexInputAttributeDescription attrDesc;
+    attrDesc.setBinding(0).setLocation(kLocationPosition).setOffset(0).setFormat(positionFormat());
+
+    return attrDesc;
+}
+
+vkMeshLayout vkVertexFormat::getMeshLayout() const
+{
+    auto attrDesc = getAttributeDescription();
+    return vkMeshLayout::make(getBindingDescription(), attrDesc.data(), static_cast<uint32_t>(attrDesc.size()));
+}
+
+std::map<std::string, std::string> vkVertexFormat::getShaderMacros() const
+{
+    std::map<std::string, std::string> macros;
+    if (color) {
+        macros["VERTEX_COLOR"] = "1";
+    }
+    return macros;
+}
+
+glm::mat4 vkVertexFormat::positionTransform(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const
+{
+    if (position == Position::eFloat32) {
+        return glm::mat4(1.0f);
+    }
+    return glm::scale(glm::translate(glm::mat4(1.0f), boundsMin), boundsMax - boundsMin);
+}
+
+void vkVertexFormat::encode(void* destination, const void* vertices, size_t vertexCount, size_t sourceStride,
+                            size_t positionOffset, size_t colorOffset, size_t texCoordOffset,
+                            const glm::vec3& boundsMin, const glm::vec3& boundsMax) const
+{
+    auto attrDesc = getAttributeDescription();
+    const uint32_t dstStride = stride();
+    const uint32_t dstTexCoord = attrDesc[1].offset;
+    const uint32_t dstColor = color ? attrDesc[2].offset : 0;
+
+    glm::vec3 extent = boundsMax - boundsMin;
+    glm::vec3 invExtent;
+    for (int i = 0; i < 3; ++i) {
+        invExtent[i] = (extent[i] > 0.0f) ? 1.0f / extent[i] : 0.0f;
+    }
+
+    const uint8_t* src = static_cast<const uint8_t*>(vertices);
+    uint8_t* dst = static_cast<uint8_t*>(destination);
+    for (size_t i = 0; i < vertexCount; ++i, src += sourceStride, dst += dstStride) {
+        glm::vec3 pos;
+        glm::vec2 uv;
+        memcpy(&pos, src + positionOffset, sizeof(pos));
+        memcpy(&uv, src + texCoordOffset, sizeof(uv));
+
+        if (position == Position::eUnorm16) {
+            uint16_t q[4] = {};
+            for (int c = 0; c < 3; ++c) {
+                float n = std::min(std::max((pos[c] - boundsMin[c]) * invExtent[c], 0.0f), 1.0f);
+                q[c] = static_cast<uint16_t>(std::lround(n * 65535.0f));
+            }
+            memcpy(dst, q, sizeof(q));
+        } else {
+            memcpy(dst, &pos, sizeof(pos));
+        }
+
+        if (texCoord == TexCoord::eFloat16) {
+            uint32_t packed = glm::packHalf2x16(uv);
+            memcpy(dst + dstTexCoord, &packed, sizeof(packed));
+        } else if (texCoord == TexCoord::eUnorm16) {
+            uint32_t packed = glm::packUnorm2x16(uv);
+            memcpy(dst + dstTexCoord, &packed, sizeof(packed));
+        } else {
+            memcpy(dst + dstTexCoord, &uv, sizeof(uv));
+        }
+
+        if (color) {
+            glm::vec3 rgb;
+            memcpy(&rgb, src + colorOffset, sizeof(rgb));
+            uint32_t packed = glm::packUnorm4x8(glm::vec4(rgb, 1.0f));
+            memcpy(dst + dstColor, &packed, sizeof(packed));
+        }
+    }
+}
+
+void vkVertexFormat::extractPositions(void* destination, const void* packedVertices, size_t vertexCount) const
+{
+    // Position is the first attribute of every packed vertex
+    const uint32_t srcStride = stride();
+    const uint32_t dstStride = positionStride();
+    const uint8_t* src = static_cast<const uint8_t*>(packedVertices);
+    uint8_t* dst = static_cast<uint8_t*>(destination);
+    for (size_t i = 0; i < vertexCount; ++i, src += srcStride, dst += dstStride) {
+        memcpy(dst, src, dstStride);
+    }
+}
+
+uint32_t vkVertexFormat::indexSize(size_t vertexCount)
+{
+    return (vertexCount <= 0x10000) ? 2 : 4;
+}
+
+vk::IndexType vkVertexFormat::indexType(uint32_t indexSize)
+{
+    return (indexSize == 2) ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+}
+
+void vkVertexFormat::encodeIndices(void* destination, const uint32_t* indices, size_t indexCount, uint32_t indexSize)
+{
+    if (indexSize == 4) {
+        memcpy(destination, indices, indexCount * sizeof(uint32_t));
+        return;
+    }
+    uint16_t* dst = static_cast<uint16_t*>(destination);
+    for (size_t i = 0; i < indexCount; ++i) {
+        dst[i] = static_cast<uint16_t>(indices[i]);
+    }
+}
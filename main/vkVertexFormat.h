@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "vkMeshCache.h"
+
+// Vertex layout of the GPU vertex buffer, the attribute descriptions and the mesh cache layout are
+// generated from it.
+// Quantized positions are unorm16 relative to the mesh bounds; the dequantization is a scale and
+// offset folded into the model view matrix (see positionTransform), so the vertex shader reads them
+// like plain floats. Unorm16 texture coordinates are clamped to [0, 1], half floats keep the range.
+struct vkVertexFormat
+{
+    enum class Position { eFloat32, eUnorm16 };
+    enum class TexCoord { eFloat32, eFloat16, eUnorm16 };
+
+    static const uint32_t kLocationPosition = 0;
+    static const uint32_t kLocationColor = 1;
+    static const uint32_t kLocationTexCoord = 2;
+
+    Position position = Position::eUnorm16;
+    TexCoord texCoord = TexCoord::eFloat16;
+    bool color = false;         // Packed RGBA8, without it the shader uses white
+
+    vk::Format positionFormat() const;
+    vk::Format texCoordFormat() const;
+    vk::Format colorFormat() const { return vk::Format::eR8G8B8A8Unorm; }
+    uint32_t positionStride() const { return (position == Position::eUnorm16) ? 8 : 12; }
+    uint32_t stride() const;
+
+    vk::VertexInputBindingDescription getBindingDescription() const;
+    std::vector<vk::VertexInputAttributeDescription> getAttributeDescription() const;
+    // Binding 0 as a tightly packed stream of positions only, for the depth prepass
+    vk::VertexInputBindingDescription getPositionBindingDescription() const;
+    vk::VertexInputAttributeDescription getPositionAttributeDescription() const;
+    vkMeshLayout getMeshLayout() const;
+    std::map<std::string, std::string> getShaderMacros() const;
+
+    // Maps stored positions back to model space, identity for float positions
+    glm::mat4 positionTransform(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const;
+
+    // Packs vertexCount source vertices of sourceStride bytes into destination, which must hold
+    // vertexCount * stride() bytes. Source attributes are floats at the given byte offsets: a vec3
+    // position, a vec3 color and a vec2 texture coordinate.
+    void encode(void* destination, const void* vertices, size_t vertexCount, size_t sourceStride,
+                size_t positionOffset, size_t colorOffset, size_t texCoordOffset,
+                const glm::vec3& boundsMin, const glm::vec3& boundsMax) const;
+
+    // Copies the positions of vertexCount vertices packed by encode() into destination, which must
+    // hold vertexCount * positionStride() bytes
+    void extractPositions(void* destination, const void* packedVertices, size_t vertexCount) const;
+
+    // 2 when every index of a mesh with vertexCount vertices fits in 16 bits, 4 otherwise
+    static uint32_t indexSize(size_t vertexCount);
+    static vk::IndexType indexType(uint32_t indexSize);
+    static void encodeIndices(void* destination, const uint32_t* indices, size_t indexCount, uint32_t indexSize);
+};
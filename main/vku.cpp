@@ -35,6 +35,8 @@ Authors:
 #endif
 
 #include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
 #include <vector>
 #include <unordered_map>
 #include <string>
@@ -45,8 +47,74 @@ Authors:
 #include <array>
 
 #include "vku.h"
+#include "vkThreadPool.h"
+#include "vkTrace.h"
 #include "shaderc/shaderc.hpp"
 
+#if defined(WIN32)
+#include <direct.h>
+#define vku_mkdir(path) _mkdir(path)
+#else
+#define vku_mkdir(path) mkdir(path, 0755)
+#endif
+
+// Bump whenever the compile options below change in a way that is not part of the cache key
+static const char* kSPVCacheVersion = "vku-spv-1";
+static const shaderc_optimization_level kSPVOptimizationLevel = shaderc_optimization_level_performance;
+
+static uint64_t fnv1a64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a64(const std::string& str, uint64_t hash)
+{
+    // Hash the terminator as well so adjacent fields can not alias
+    return fnv1a64(str.c_str(), str.size() + 1, hash);
+}
+
+// Resolves #include directives through the shader resource paths
+class vkuIncluder : public shaderc::CompileOptions::IncluderInterface
+{
+    struct Include
+    {
+        std::string name;
+        std::string content;
+    };
+
+public:
+    shaderc_include_result* GetInclude(const char* requested_source, shaderc_include_type type, const char* requesting_source, size_t include_depth) override
+    {
+        Include* include = new Include;
+        include->name = vku::instance()->getShaderFileName(requested_source);
+        if (!include->name.empty()) {
+            std::ifstream t(include->name);
+            include->content.assign((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+        } else {
+            include->content = std::string("Cannot find include file ") + requested_source;
+        }
+
+        shaderc_include_result* result = new shaderc_include_result;
+        result->source_name = include->name.c_str();
+        result->source_name_length = include->name.size();
+        result->content = include->content.c_str();
+        result->content_length = include->content.size();
+        result->user_data = include;
+        return result;
+    }
+
+    void ReleaseInclude(shaderc_include_result* data) override
+    {
+        delete static_cast<Include*>(data->user_data);
+        delete data;
+    }
+};
+
 vku* vku::instance()
 {
     std::mutex inst_m;
@@ -64,7 +132,8 @@ vku* vku::instance()
 
 vku::vku() 
 {
-    m_enableSPVDump = false;
+    m_enableSPVCache = true;
+    m_spvCacheDir = "spvcache/";
 }
 
 vku::~vku()
@@ -180,21 +249,33 @@ std::stringstream vku::glslCompile(const char* fileName, int shader_type)
     return stream;
 }
 
-std::vector<uint32_t> vku::glslCompile(const char* fileName, size_t& size, int shader_type)
+std::vector<uint32_t> vku::glslCompile(const char* fileName, size_t& size, int shader_type, const std::map<std::string, std::string>& macros)
 {
+    VK_TRACE_SCOPE("glslCompile", "shader", fileName);
     std::vector<uint32_t> spvBinary;
 
-    shaderc::Compiler compiler;
-    shaderc::CompileOptions options;
-
     std::string fName;
 
     if ((fName = getShaderFileName(fileName)).empty() == false) {
         std::ifstream t(fName);
         std::string str((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
 
-        //options.AddMacroDefinition("MY_DEFINE", "1");
-        shaderc::SpvCompilationResult module = compiler.CompileGlslToSpv(str, static_cast<shaderc_shader_kind>(shader_type), "shader_src", options);
+        uint64_t key = spvCacheKey(str, shader_type, macros);
+        if (m_enableSPVCache && loadSPVCache(key, spvBinary)) {
+            size = spvBinary.size() * sizeof(uint32_t);
+            return spvBinary;
+        }
+
+        VK_TRACE_SCOPE("shadercCompile", "shader");
+        shaderc::Compiler compiler;
+        shaderc::CompileOptions options;
+        options.SetOptimizationLevel(kSPVOptimizationLevel);
+        options.SetIncluder(std::make_unique<vkuIncluder>());
+        for (const auto& macro : macros) {
+            options.AddMacroDefinition(macro.first, macro.second);
+        }
+
+        shaderc::SpvCompilationResult module = compiler.CompileGlslToSpv(str, static_cast<shaderc_shader_kind>(shader_type), fName.c_str(), options);
 
         if (module.GetCompilationStatus() != shaderc_compilation_status_success) {
             std::string msg = module.GetErrorMessage();
@@ -202,13 +283,8 @@ std::vector<uint32_t> vku::glslCompile(const char* fileName, size_t& size, int s
             spvBinary.assign(module.cbegin(), module.cend()); 
             size = (module.cend() - module.cbegin()) * sizeof(uint32_t);
 
-            static int count = 0;
-            if (m_enableSPVDump) {
-                std::string fileName("shader");
-                fileName += std::to_string(count++) + ".spv";
-                FILE* fptr = fopen(fileName.c_str(), "wb");
-                fwrite(spvBinary.data(), size, 1, fptr);
-                fclose(fptr);
+            if (m_enableSPVCache) {
+                storeSPVCache(key, spvBinary);
             }
         }
     }
@@ -217,66 +293,158 @@ std::vector<uint32_t> vku::glslCompile(const char* fileName, size_t& size, int s
 
 }
 
-void* vku::glslRead(const char* fileName, size_t& size) 
+uint64_t vku::spvCacheKey(const std::string& source, int shader_type, const std::map<std::string, std::string>& macros)
 {
-    std::string glslFileName;
-    std::string outSpvFileName;
-
-    if ((glslFileName = getShaderFileName(fileName)).empty() == false) {
-        outSpvFileName = getSpvFileName(glslFileName);
-        if (glsl2spv(glslFileName, outSpvFileName) == 0) {
-            FILE* fp = fopen(outSpvFileName.c_str(), "rb");
-            if (!fp) {
-                return nullptr;
-            }
+    std::string includes;
+    collectIncludes(source, includes, 0);
+
+    uint64_t hash = fnv1a64(std::string(kSPVCacheVersion), 0xcbf29ce484222325ull);
+    hash = fnv1a64(&shader_type, sizeof(shader_type), hash);
+    hash = fnv1a64(&kSPVOptimizationLevel, sizeof(kSPVOptimizationLevel), hash);
+    for (const auto& macro : macros) {
+        hash = fnv1a64(macro.first, hash);
+        hash = fnv1a64(macro.second, hash);
+    }
+    hash = fnv1a64(source, hash);
+    hash = fnv1a64(includes, hash);
 
-            fseek(fp, 0L, SEEK_END);
-            size = ftell(fp);
+    return hash;
+}
 
-            fseek(fp, 0L, SEEK_SET);
+void vku::collectIncludes(const std::string& source, std::string& includes, int depth)
+{
+    // Light-weight scan of #include lines, good enough to invalidate the cache when a header changes
+    if (depth > 16) {
+        return;
+    }
 
-            void* shader_code = malloc(size);
-            size_t retval = fread(shader_code, size, 1, fp);
-            fclose(fp);
-            
-            return shader_code;
+    std::istringstream lines(source);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t pos = line.find_first_not_of(" \t");
+        if (pos == std::string::npos || line.compare(pos, 8, "#include") != 0) {
+            continue;
+        }
+        size_t begin = line.find_first_of("\"<", pos + 8);
+        size_t end = (begin == std::string::npos) ? begin : line.find_first_of("\">", begin + 1);
+        if (end == std::string::npos) {
+            continue;
+        }
+
+        std::string incName = line.substr(begin + 1, end - begin - 1);
+        std::string incFile = getShaderFileName(incName.c_str());
+        includes += incName;
+        includes.push_back('\0');
+        if (!incFile.empty()) {
+            std::ifstream t(incFile);
+            std::string content((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+            includes += content;
+            collectIncludes(content, includes, depth + 1);
         }
     }
-    return nullptr;
 }
 
-int vku::glsl2spv(const std::string& glslFileName, const std::string& outSpvFileName)
+bool vku::loadSPVCache(uint64_t key, std::vector<uint32_t>& spvBinary)
 {
-    std::string cmdLine = std::string("glslangValidator -s -V -o") + outSpvFileName + " " + glslFileName;
-    return execCmd(cmdLine);
+    std::lock_guard<std::mutex> lock(m_spvCacheMutex);
+
+    auto it = m_spvCache.find(key);
+    if (it != m_spvCache.end()) {
+        spvBinary = it->second;
+        return true;
+    }
+
+    char keyName[32];
+    snprintf(keyName, sizeof(keyName), "%016llx.spv", static_cast<unsigned long long>(key));
+    std::ifstream file(m_spvCacheDir + keyName, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    size_t size = static_cast<size_t>(file.tellg());
+    if (size < sizeof(uint32_t) || size % sizeof(uint32_t) != 0) {
+        return false;
+    }
+    spvBinary.resize(size / sizeof(uint32_t));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(spvBinary.data()), size);
+
+    const uint32_t spvMagic = 0x07230203;
+    if (!file || spvBinary[0] != spvMagic) {
+        spvBinary.clear();
+        return false;
+    }
+
+    m_spvCache[key] = spvBinary;
+    return true;
 }
 
-int vku::execCmd(std::string& cmd) 
+void vku::storeSPVCache(uint64_t key, const std::vector<uint32_t>& spvBinary)
 {
-#if defined(WIN32)
-    #define popen _popen
-    #define pclose _pclose
-#elif defined(LINUX)
-#endif
+    std::lock_guard<std::mutex> lock(m_spvCacheMutex);
 
-    int rtnVal = 0;
-    std::array<char, 128> buffer;
-    std::string result;
-    //std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
-    //if (!pipe) {
-    //    throw std::runtime_error("popen() failed!");
-    //}
-    //while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-    //    result += buffer.data();
-    //}
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
-        return -1;
+    m_spvCache[key] = spvBinary;
+
+    struct stat buffer;
+    if (stat(m_spvCacheDir.c_str(), &buffer) != 0) {
+        vku_mkdir(m_spvCacheDir.c_str());
     }
-    while (fgets(buffer.data(), 128, pipe) != NULL) {
-        result += buffer.data();
+
+    char keyName[32];
+    snprintf(keyName, sizeof(keyName), "%016llx.spv", static_cast<unsigned long long>(key));
+    std::ofstream file(m_spvCacheDir + keyName, std::ios::binary | std::ios::trunc);
+    if (file.is_open()) {
+        file.write(reinterpret_cast<const char*>(spvBinary.data()), spvBinary.size() * sizeof(uint32_t));
     }
-    return pclose(pipe);
 }
 
+std::future<std::vector<uint32_t>> vku::glslCompileAsync(const vkuShaderDesc& desc)
+{
+    return vkThreadPool::instance()->enqueue([this, desc]() {
+        size_t size = 0;
+        return glslCompile(desc.fileName.c_str(), size, desc.shaderType, desc.macros);
+    });
+}
+
+std::vector<std::future<std::vector<uint32_t>>> vku::glslCompileBatch(const std::vector<vkuShaderDesc>& descs)
+{
+    std::vector<std::future<std::vector<uint32_t>>> results;
+    results.reserve(descs.size());
+    for (const auto& desc : descs) {
+        results.push_back(glslCompileAsync(desc));
+    }
+    return results;
+}
+
+int vku::shaderTypeFromFileName(const std::string& fileName)
+{
+    static const std::unordered_map<std::string, int> extTypes = {
+        { "vert", shaderc_vertex_shader },
+        { "frag", shaderc_fragment_shader },
+        { "comp", shaderc_compute_shader },
+        { "geom", shaderc_geometry_shader },
+        { "tesc", shaderc_tess_control_shader },
+        { "tese", shaderc_tess_evaluation_shader },
+    };
+
+    size_t offset = fileName.rfind('.');
+    if (offset != std::string::npos) {
+        auto it = extTypes.find(fileName.substr(offset + 1));
+        if (it != extTypes.end()) {
+            return it->second;
+        }
+    }
+    return shaderc_glsl_infer_from_source;
+}
+
+void* vku::glslRead(const char* fileName, size_t& size) 
+{
+    std::vector<uint32_t> spvBinary = glslCompile(fileName, size, shaderTypeFromFileName(fileName));
+    if (spvBinary.empty()) {
+        return nullptr;
+    }
+
+    void* shader_code = malloc(size);
+    memcpy(shader_code, spvBinary.data(), size);
+    return shader_code;
+}
@@ -31,6 +31,21 @@ Authors:
 #define _VKU_H
 #pragma once
 
+#include <future>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+struct vkuShaderDesc
+{
+    std::string fileName;
+    int shaderType;
+    std::map<std::string, std::string> macros;
+};
 
 class vku {
     enum class ResourceType {
@@ -46,10 +61,13 @@ public:
     std::string getShaderFileName(const char* fileName);
     std::string getTextureFileName(const char* fileName);
     std::string getModelFileName(const char* fileName);
-    int execCmd(std::string & cmd);
     void* glslRead(const char* fileName, size_t& size);
-    std::vector<uint32_t> glslCompile(const char* fileName, size_t& size, int shader_type);
+    std::vector<uint32_t> glslCompile(const char* fileName, size_t& size, int shader_type, const std::map<std::string, std::string>& macros = {});
     std::stringstream glslCompile(const char* fileName, int shader_type);
+    std::future<std::vector<uint32_t>> glslCompileAsync(const vkuShaderDesc& desc);
+    std::vector<std::future<std::vector<uint32_t>>> glslCompileBatch(const std::vector<vkuShaderDesc>& descs);
+
+    void enableSPVCache(bool enable) { m_enableSPVCache = enable; }
 
     int numResPaths();
 protected:
@@ -57,7 +75,12 @@ protected:
     std::string getResourceFileName(const std::string& fileName, ResourceType resType);
     std::string getFileNameWoExt(const std::string& fileName);
     std::string getSpvFileName(const std::string& fileName);
-    int glsl2spv(const std::string& glslFileName, const std::string& spvFileName);
+    int shaderTypeFromFileName(const std::string& fileName);
+
+    uint64_t spvCacheKey(const std::string& source, int shader_type, const std::map<std::string, std::string>& macros);
+    void collectIncludes(const std::string& source, std::string& includes, int depth);
+    bool loadSPVCache(uint64_t key, std::vector<uint32_t>& spvBinary);
+    void storeSPVCache(uint64_t key, const std::vector<uint32_t>& spvBinary);
 
 private:
     vku();
@@ -67,7 +90,10 @@ private:
     vku& operator=(vku &&) = delete;
     
 private:
-    bool m_enableSPVDump;
+    bool m_enableSPVCache;
+    std::string m_spvCacheDir;
+    std::mutex m_spvCacheMutex;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> m_spvCache;
     std::vector<std::string> resPaths[static_cast<int>(ResourceType::NUM_RESOURCES)];
 };
 